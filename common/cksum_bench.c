@@ -0,0 +1,170 @@
+/******************************************************************************
+ * cksum_bench.c
+ * -------------
+ * Benchmark for inet_cksum.c. Times each version of inet_sum() the CPU
+ * supports, and the old 16-bit loop, over sizes from an IP header (20 bytes)
+ * to 64 KB. Then times memcpy() followed by inet_sum() against each version
+ * of inet_sum_copy(). Prints tab-separated tables with the ns per checksum of
+ * each, and the GB/s of the fastest.
+ *
+ * Usage: cksum_bench [total_bytes_per_run]
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "inet_cksum.h"
+
+/** A version of the checksum to time. */
+struct impl {
+  const char *name;
+  uint64_t (*sum)(const void *, size_t, uint64_t);
+};
+
+/** A version of copying and checksumming to time. */
+struct copy_impl {
+  const char *name;
+  uint64_t (*sum_copy)(void *, const void *, size_t, uint64_t);
+};
+
+/** Keeps the compiler from throwing away results. */
+static volatile uint16_t sink;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The checksum the way it used to be computed in cTCP and the router: one
+ * 16-bit word at a time. It is only timed, so the sum is not put in the same
+ * byte order as the others.
+ */
+static uint64_t reference_sum(const void *_data, size_t len, uint64_t sum) {
+  const uint8_t *data = _data;
+
+  for (; len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  return sum;
+}
+
+/** Copying, then checksumming the copy, the way cTCP used to. */
+static uint64_t memcpy_then_sum(void *dst, const void *src, size_t len,
+                                uint64_t sum) {
+  memcpy(dst, src, len);
+  return inet_sum(dst, len, sum);
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t sizes[] = {
+    20, 40, 64, 128, 256, 576, 1460, 1500, 4096, 9000, 16384, 65536
+  };
+  struct impl impls[5];
+  struct copy_impl copy_impls[5];
+  int num_impls = 0, num_copy_impls = 0;
+  uint64_t total = argc > 1 ? strtoull(argv[1], NULL, 10) : 256 << 20;
+  size_t i;
+  int j;
+
+  impls[num_impls].name = "16bit";
+  impls[num_impls++].sum = reference_sum;
+  impls[num_impls].name = "scalar";
+  impls[num_impls++].sum = inet_sum_scalar;
+#ifdef INET_CKSUM_X86
+  if (inet_have_sse2()) {
+    impls[num_impls].name = "sse2";
+    impls[num_impls++].sum = inet_sum_sse2;
+  }
+  if (inet_have_avx2()) {
+    impls[num_impls].name = "avx2";
+    impls[num_impls++].sum = inet_sum_avx2;
+  }
+#endif
+  impls[num_impls].name = "inet_sum";
+  impls[num_impls++].sum = inet_sum;
+
+  copy_impls[num_copy_impls].name = "memcpy+sum";
+  copy_impls[num_copy_impls++].sum_copy = memcpy_then_sum;
+  copy_impls[num_copy_impls].name = "copy_scalar";
+  copy_impls[num_copy_impls++].sum_copy = inet_sum_copy_scalar;
+#ifdef INET_CKSUM_X86
+  if (inet_have_sse2()) {
+    copy_impls[num_copy_impls].name = "copy_sse2";
+    copy_impls[num_copy_impls++].sum_copy = inet_sum_copy_sse2;
+  }
+  if (inet_have_avx2()) {
+    copy_impls[num_copy_impls].name = "copy_avx2";
+    copy_impls[num_copy_impls++].sum_copy = inet_sum_copy_avx2;
+  }
+#endif
+  copy_impls[num_copy_impls].name = "inet_sum_copy";
+  copy_impls[num_copy_impls++].sum_copy = inet_sum_copy;
+
+  uint8_t *data = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+  uint8_t *copy = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+  for (i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; i++)
+    data[i] = rand();
+
+  printf("bytes");
+  for (j = 0; j < num_impls; j++)
+    printf("\t%s_ns", impls[j].name);
+  printf("\tbest_gbps\n");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t len = sizes[i];
+    uint64_t reps = total / len, r;
+    double best = 0;
+
+    printf("%zu", len);
+    for (j = 0; j < num_impls; j++) {
+      /* Warm up the caches and branch predictors first. */
+      for (r = 0; r < reps / 8; r++)
+        sink = inet_fold(impls[j].sum(data, len, r & 1));
+
+      uint64_t start = now_ns();
+      for (r = 0; r < reps; r++)
+        sink = inet_fold(impls[j].sum(data, len, r & 1));
+      double ns = (double) (now_ns() - start) / reps;
+      printf("\t%.1f", ns);
+      if (best == 0 || ns < best)
+        best = ns;
+    }
+    printf("\t%.2f\n", len / best);
+  }
+
+  printf("\nbytes");
+  for (j = 0; j < num_copy_impls; j++)
+    printf("\t%s_ns", copy_impls[j].name);
+  printf("\tbest_gbps\n");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t len = sizes[i];
+    uint64_t reps = total / len, r;
+    double best = 0;
+
+    printf("%zu", len);
+    for (j = 0; j < num_copy_impls; j++) {
+      for (r = 0; r < reps / 8; r++)
+        sink = inet_fold(copy_impls[j].sum_copy(copy, data, len, r & 1));
+
+      uint64_t start = now_ns();
+      for (r = 0; r < reps; r++)
+        sink = inet_fold(copy_impls[j].sum_copy(copy, data, len, r & 1));
+      double ns = (double) (now_ns() - start) / reps;
+      printf("\t%.1f", ns);
+      if (best == 0 || ns < best)
+        best = ns;
+    }
+    printf("\t%.2f\n", len / best);
+  }
+
+  free(data);
+  free(copy);
+  return 0;
+}
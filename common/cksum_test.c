@@ -0,0 +1,185 @@
+/******************************************************************************
+ * cksum_test.c
+ * ------------
+ * Fuzz test for inet_cksum.c. Checksums random data of random lengths and
+ * alignments with every version of inet_sum() and inet_sum_copy() the CPU
+ * supports, and with the data split in two, and checks each against a plain
+ * 16-bit reference. Also checks that the copies match, and that
+ * inet_sum_pseudo() matches a pseudo-header built in memory.
+ *
+ * Usage: cksum_test [iterations] [seed]
+ * Exits with 0 if every checksum matched.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "inet_cksum.h"
+
+/** Longest data to try, plus room to misalign it. */
+#define TEST_MAX_LEN 65536
+#define TEST_MAX_OFFSET 64
+
+/** A version of inet_sum() and inet_sum_copy() to test. */
+struct impl {
+  const char *name;
+  uint64_t (*sum)(const void *, size_t, uint64_t);
+  uint64_t (*sum_copy)(void *, const void *, size_t, uint64_t);
+};
+
+static uint64_t rng_state;
+
+static uint32_t rng() {
+  rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return rng_state >> 33;
+}
+
+/**
+ * The checksum the way it used to be computed in cTCP and the router: one
+ * 16-bit word at a time.
+ */
+static uint16_t reference_cksum(const void *_data, size_t len) {
+  const uint8_t *data = _data;
+  uint64_t sum = 0;
+
+  for (; len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons(~sum);
+  return sum ? sum : 0xffff;
+}
+
+/**
+ * Picks a length. Mostly short, like headers and segments, with the odd
+ * one up to TEST_MAX_LEN.
+ */
+static size_t random_len() {
+  switch (rng() % 4) {
+  case 0:
+    return rng() % 64;
+  case 1:
+    return rng() % 1600;
+  case 2:
+    return rng() % 4096;
+  default:
+    return rng() % (TEST_MAX_LEN + 1);
+  }
+}
+
+/**
+ * Fills data with random bytes, or with runs of 0xff and 0x00 that make the
+ * sums carry as much as they can.
+ */
+static void random_fill(uint8_t *data, size_t len) {
+  size_t i;
+  int mode = rng() % 4;
+
+  for (i = 0; i < len; i++) {
+    if (mode == 0)
+      data[i] = 0xff;
+    else if (mode == 1)
+      data[i] = rng() % 8 == 0 ? 0 : 0xff;
+    else
+      data[i] = rng();
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct impl impls[3];
+  int num_impls = 0;
+  long iterations = argc > 1 ? atol(argv[1]) : 200000;
+  long i, failures = 0;
+  int j;
+
+  rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 144;
+  impls[num_impls].name = "scalar";
+  impls[num_impls].sum = inet_sum_scalar;
+  impls[num_impls++].sum_copy = inet_sum_copy_scalar;
+#ifdef INET_CKSUM_X86
+  if (inet_have_sse2()) {
+    impls[num_impls].name = "sse2";
+    impls[num_impls].sum = inet_sum_sse2;
+    impls[num_impls++].sum_copy = inet_sum_copy_sse2;
+  }
+  if (inet_have_avx2()) {
+    impls[num_impls].name = "avx2";
+    impls[num_impls].sum = inet_sum_avx2;
+    impls[num_impls++].sum_copy = inet_sum_copy_avx2;
+  }
+#endif
+
+  uint8_t *buf = malloc(TEST_MAX_LEN + TEST_MAX_OFFSET);
+  uint8_t *copy_buf = malloc(TEST_MAX_LEN + TEST_MAX_OFFSET);
+  for (i = 0; i < iterations && failures < 10; i++) {
+    size_t len = random_len();
+    uint8_t *data = buf + rng() % TEST_MAX_OFFSET;
+    random_fill(data, len);
+    uint16_t expected = reference_cksum(data, len);
+
+    /* Whole, with each version. */
+    for (j = 0; j < num_impls; j++) {
+      uint16_t got = inet_fold(impls[j].sum(data, len, 0));
+      if (got != expected) {
+        fprintf(stderr, "[ERROR] %s: len %zu offset %ld: got %04x, "
+                        "expected %04x\n", impls[j].name, len,
+                (long) (data - buf), got, expected);
+        failures++;
+      }
+
+      /* Copied to a differently aligned buffer, with a starting sum. */
+      uint8_t *copy = copy_buf + rng() % TEST_MAX_OFFSET;
+      uint64_t start = rng();
+      got = inet_fold(impls[j].sum_copy(copy, data, len, start));
+      if (got != inet_fold(impls[j].sum(data, len, start)) ||
+          memcmp(copy, data, len) != 0) {
+        fprintf(stderr, "[ERROR] %s copy: len %zu offset %ld: bad sum or "
+                        "copy\n", impls[j].name, len, (long) (copy - copy_buf));
+        failures++;
+      }
+    }
+
+    /* Through the dispatcher, in two pieces split at an even length. */
+    size_t split = len > 0 ? (rng() % (len + 1)) & ~(size_t) 1 : 0;
+    uint16_t got = inet_fold(inet_sum(data + split, len - split,
+                                      inet_sum(data, split, 0)));
+    if (got != expected || inet_cksum(data, len) != expected) {
+      fprintf(stderr, "[ERROR] split at %zu: len %zu: got %04x, expected "
+                      "%04x\n", split, len, got, expected);
+      failures++;
+    }
+
+    /* A TCP pseudo-header built in memory, followed by the data. */
+    uint8_t pseudo[12];
+    uint32_t saddr = rng(), daddr = rng();
+    uint8_t protocol = rng();
+    memcpy(pseudo, &saddr, 4);
+    memcpy(pseudo + 4, &daddr, 4);
+    pseudo[8] = 0;
+    pseudo[9] = protocol;
+    pseudo[10] = (len & 0xffff) >> 8;
+    pseudo[11] = len & 0xff;
+    expected = inet_fold(inet_sum(data, len, inet_sum(pseudo, 12, 0)));
+    got = inet_fold(inet_sum_pseudo(saddr, daddr, protocol, len,
+                                    inet_sum_copy(copy_buf, data, len, 0)));
+    if (got != expected) {
+      fprintf(stderr, "[ERROR] pseudo-header: len %zu: got %04x, expected "
+                      "%04x\n", len, got, expected);
+      failures++;
+    }
+  }
+
+  printf("iterations: %ld\n", i);
+  printf("versions:");
+  for (j = 0; j < num_impls; j++)
+    printf(" %s", impls[j].name);
+  printf("\nresult: %s\n", failures == 0 ? "ok" : "FAILED");
+  free(buf);
+  free(copy_buf);
+  return failures == 0 ? 0 : 1;
+}
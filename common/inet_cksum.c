@@ -0,0 +1,304 @@
+#include <string.h>
+
+#include "inet_cksum.h"
+
+#ifdef INET_CKSUM_X86
+#include <immintrin.h>
+#endif
+
+/** Below this many bytes, setting up the vector versions costs more than
+    they save. */
+#define INET_VECTOR_MIN 128
+
+/** The versions of inet_sum() and inet_sum_copy() to use, picked by
+    inet_pick() at startup. */
+static uint64_t (*sum_impl)(const void *, size_t, uint64_t) = inet_sum_scalar;
+static uint64_t (*sum_copy_impl)(void *, const void *, size_t, uint64_t) =
+  inet_sum_copy_scalar;
+
+/**
+ * Adds two 64-bit words in ones' complement: a carry out of the top is added
+ * back in at the bottom. Since 2^64 - 1 is a multiple of 2^16 - 1, this folds
+ * down to the same 16-bit sum as adding 16 bits at a time.
+ */
+static uint64_t add64(uint64_t sum, uint64_t x) {
+  sum += x;
+  return sum + (sum < x);
+}
+
+uint64_t inet_sum_scalar(const void *data, size_t len, uint64_t sum) {
+  const uint8_t *p = data;
+  uint64_t w[4];
+
+  /* Four words at a time, so the carries of one do not hold up the next. */
+  while (len >= 32) {
+    memcpy(w, p, 32);
+    sum = add64(sum, w[0]);
+    sum = add64(sum, w[1]);
+    sum = add64(sum, w[2]);
+    sum = add64(sum, w[3]);
+    p += 32;
+    len -= 32;
+  }
+  while (len >= 8) {
+    memcpy(w, p, 8);
+    sum = add64(sum, w[0]);
+    p += 8;
+    len -= 8;
+  }
+
+  /* The rest, in smaller words. Where a word sits within 64 bits does not
+     matter, since moving it by 16 bits is the same as multiplying it by
+     2^16, which is 1 in ones' complement. An odd byte at the end goes in the
+     half of its 16-bit word it would be in if the data were summed 16 bits
+     at a time. */
+  if (len & 4) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    sum = add64(sum, v);
+    p += 4;
+  }
+  if (len & 2) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    sum = add64(sum, v);
+    p += 2;
+  }
+  if (len & 1) {
+    uint8_t last[2] = { 0, 0 };
+    uint16_t v;
+    last[0] = *p;
+    memcpy(&v, last, 2);
+    sum = add64(sum, v);
+  }
+  return sum;
+}
+
+uint64_t inet_sum_copy_scalar(void *dst, const void *src, size_t len,
+                              uint64_t sum) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  uint64_t w[4];
+
+  while (len >= 32) {
+    memcpy(w, s, 32);
+    memcpy(d, w, 32);
+    sum = add64(sum, w[0]);
+    sum = add64(sum, w[1]);
+    sum = add64(sum, w[2]);
+    sum = add64(sum, w[3]);
+    s += 32;
+    d += 32;
+    len -= 32;
+  }
+
+  /* The rest is short. Copy it, then sum the copy while it is in cache. */
+  memcpy(d, s, len);
+  return inet_sum_scalar(d, len, sum);
+}
+
+#ifdef INET_CKSUM_X86
+/* Each 32-bit word is widened to 64 bits and added to a 64-bit lane, so the
+   lanes cannot overflow for any length that fits in memory, and the carries
+   only need to be dealt with once at the end. */
+
+__attribute__((target("sse2")))
+uint64_t inet_sum_sse2(const void *data, size_t len, uint64_t sum) {
+  const uint8_t *p = data;
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = zero, acc1 = zero;
+  uint64_t lanes[2];
+
+  while (len >= 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *) p);
+    __m128i b = _mm_loadu_si128((const __m128i *) (p + 16));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+    p += 32;
+    len -= 32;
+  }
+
+  _mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(acc0, acc1));
+  sum = add64(sum, lanes[0]);
+  sum = add64(sum, lanes[1]);
+  return inet_sum_scalar(p, len, sum);
+}
+
+__attribute__((target("sse2")))
+uint64_t inet_sum_copy_sse2(void *dst, const void *src, size_t len,
+                            uint64_t sum) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = zero, acc1 = zero;
+  uint64_t lanes[2];
+
+  while (len >= 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *) s);
+    __m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+    _mm_storeu_si128((__m128i *) d, a);
+    _mm_storeu_si128((__m128i *) (d + 16), b);
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+    s += 32;
+    d += 32;
+    len -= 32;
+  }
+
+  _mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(acc0, acc1));
+  sum = add64(sum, lanes[0]);
+  sum = add64(sum, lanes[1]);
+  return inet_sum_copy_scalar(d, s, len, sum);
+}
+
+__attribute__((target("avx2")))
+uint64_t inet_sum_avx2(const void *data, size_t len, uint64_t sum) {
+  const uint8_t *p = data;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = zero, acc1 = zero;
+  uint64_t lanes[4];
+
+  while (len >= 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) p);
+    __m256i b = _mm256_loadu_si256((const __m256i *) (p + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+    p += 64;
+    len -= 64;
+  }
+
+  _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+  sum = add64(sum, lanes[0]);
+  sum = add64(sum, lanes[1]);
+  sum = add64(sum, lanes[2]);
+  sum = add64(sum, lanes[3]);
+
+  /* The scalar version may use SSE, which stalls while the upper halves of
+     the AVX registers are dirty. */
+  _mm256_zeroupper();
+  return inet_sum_scalar(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+uint64_t inet_sum_copy_avx2(void *dst, const void *src, size_t len,
+                            uint64_t sum) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = zero, acc1 = zero;
+  uint64_t lanes[4];
+
+  while (len >= 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) s);
+    __m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+    _mm256_storeu_si256((__m256i *) d, a);
+    _mm256_storeu_si256((__m256i *) (d + 32), b);
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+    s += 64;
+    d += 64;
+    len -= 64;
+  }
+
+  _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+  sum = add64(sum, lanes[0]);
+  sum = add64(sum, lanes[1]);
+  sum = add64(sum, lanes[2]);
+  sum = add64(sum, lanes[3]);
+  _mm256_zeroupper();
+  return inet_sum_copy_scalar(d, s, len, sum);
+}
+#endif
+
+int inet_have_sse2(void) {
+#ifdef INET_CKSUM_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#else
+  return 0;
+#endif
+}
+
+int inet_have_avx2(void) {
+#ifdef INET_CKSUM_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Picks the fastest version of inet_sum() the CPU supports. Runs before
+ * main(), so no thread can see it change.
+ */
+__attribute__((constructor))
+static void inet_pick(void) {
+#ifdef INET_CKSUM_X86
+  if (inet_have_avx2()) {
+    sum_impl = inet_sum_avx2;
+    sum_copy_impl = inet_sum_copy_avx2;
+  }
+  else if (inet_have_sse2()) {
+    sum_impl = inet_sum_sse2;
+    sum_copy_impl = inet_sum_copy_sse2;
+  }
+#endif
+}
+
+uint64_t inet_sum(const void *data, size_t len, uint64_t sum) {
+  if (len < INET_VECTOR_MIN)
+    return inet_sum_scalar(data, len, sum);
+  return sum_impl(data, len, sum);
+}
+
+uint64_t inet_sum_copy(void *dst, const void *src, size_t len, uint64_t sum) {
+  if (len < INET_VECTOR_MIN)
+    return inet_sum_copy_scalar(dst, src, len, sum);
+  return sum_copy_impl(dst, src, len, sum);
+}
+
+uint64_t inet_sum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t protocol,
+                         uint16_t len, uint64_t sum) {
+  /* The fields as they would be laid out in memory, in network order:
+     addresses, then a zero byte and the protocol, then the length. */
+  uint8_t words[4];
+  uint16_t proto_word, len_word;
+
+  words[0] = 0;
+  words[1] = protocol;
+  words[2] = len >> 8;
+  words[3] = len & 0xff;
+  memcpy(&proto_word, words, 2);
+  memcpy(&len_word, words + 2, 2);
+  sum = add64(sum, saddr);
+  sum = add64(sum, daddr);
+  sum = add64(sum, proto_word);
+  return add64(sum, len_word);
+}
+
+uint16_t inet_fold(uint64_t sum) {
+  uint16_t result;
+
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+
+  /* Summed in host order, so the complement is already in network order. */
+  result = ~sum;
+  return result ? result : 0xffff;
+}
+
+uint16_t inet_cksum(const void *data, size_t len) {
+  return inet_fold(inet_sum(data, len, 0));
+}
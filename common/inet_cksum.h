@@ -0,0 +1,101 @@
+/******************************************************************************
+ * inet_cksum.h
+ * ------------
+ * Internet checksum (RFC 1071), shared by cTCP (lab12) and the router (lab4).
+ *
+ * The data is summed 64 bits at a time in host byte order, with the carries
+ * added back in, and only folded down to 16 bits at the end. On x86, SSE2 and
+ * AVX2 versions sum 16 or 32 bytes at a time, and the fastest one the CPU
+ * supports is picked when the program starts.
+ *
+ * Written in C90, since the router is built with -ansi.
+ *
+ *****************************************************************************/
+
+#ifndef INET_CKSUM_H
+#define INET_CKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Computes the Internet checksum of some data.
+ *
+ * data: The data.
+ * len: Length of the data, in bytes.
+ * returns: The checksum in network-byte order, ready to be stored in a
+ *          header. Never 0; a checksum of 0 is given as 0xffff.
+ */
+uint16_t inet_cksum(const void *data, size_t len);
+
+/**
+ * Adds data to a running sum, which is turned into a checksum with
+ * inet_fold(). Data that is split up can be summed piece by piece, as long
+ * as every piece but the last has an even length.
+ *
+ * data: The data.
+ * len: Length of the data, in bytes.
+ * sum: The sum so far, or 0 to start.
+ * returns: The new sum.
+ */
+uint64_t inet_sum(const void *data, size_t len, uint64_t sum);
+
+/**
+ * Copies data and adds it to a running sum, in a single pass over it. Gives
+ * the same sum as inet_sum() on the data.
+ *
+ * dst: Where to copy the data to. Must not overlap src.
+ * src: The data.
+ * len: Length of the data, in bytes.
+ * sum: The sum so far, or 0 to start.
+ * returns: The new sum.
+ */
+uint64_t inet_sum_copy(void *dst, const void *src, size_t len, uint64_t sum);
+
+/**
+ * Adds a TCP or UDP pseudo-header to a running sum, without building one in
+ * memory. The header and data are summed with inet_sum() or inet_sum_copy(),
+ * before or after.
+ *
+ * saddr: Source IP address, in network-byte order.
+ * daddr: Destination IP address, in network-byte order.
+ * protocol: IP protocol number, e.g. 6 for TCP.
+ * len: Length of the header and data, in bytes, in host-byte order.
+ * sum: The sum so far, or 0 to start.
+ * returns: The new sum.
+ */
+uint64_t inet_sum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t protocol,
+                         uint16_t len, uint64_t sum);
+
+/**
+ * Turns a sum from inet_sum() into a checksum.
+ *
+ * sum: The sum.
+ * returns: The checksum in network-byte order. Never 0, like inet_cksum().
+ */
+uint16_t inet_fold(uint64_t sum);
+
+/**
+ * The versions of inet_sum() and inet_sum_copy() to pick from, for tests and
+ * benchmarks. They all give sums that fold to the same checksum. The SSE2 and
+ * AVX2 ones must only be called if inet_have_sse2() or inet_have_avx2() says
+ * so.
+ */
+uint64_t inet_sum_scalar(const void *data, size_t len, uint64_t sum);
+uint64_t inet_sum_copy_scalar(void *dst, const void *src, size_t len,
+                              uint64_t sum);
+#if defined(__x86_64__) || defined(__i386__)
+#define INET_CKSUM_X86
+uint64_t inet_sum_sse2(const void *data, size_t len, uint64_t sum);
+uint64_t inet_sum_avx2(const void *data, size_t len, uint64_t sum);
+uint64_t inet_sum_copy_sse2(void *dst, const void *src, size_t len,
+                            uint64_t sum);
+uint64_t inet_sum_copy_avx2(void *dst, const void *src, size_t len,
+                            uint64_t sum);
+#endif
+
+/** Whether or not the CPU can run the SSE2 and AVX2 versions. */
+int inet_have_sse2(void);
+int inet_have_avx2(void);
+
+#endif /* INET_CKSUM_H */
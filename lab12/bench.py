@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+#
+# Benchmarks cTCP. Runs a server and a client over Unix sockets for a sweep of
+# window sizes, unreliability rates and payload sizes, and writes one CSV row
+# per run: goodput, completion time, retransmission ratio and CPU time.
+#
+# Each sweep changes one setting at a time from a base run (window 8, 1 MB
+# unless --base-size says otherwise, reliable). To compare branches, run this
+# on each with a --label and then
+#   ./bench.py --compare old.csv new.csv
+
+import argparse
+import csv
+import os
+import subprocess
+import sys
+import time
+
+CTCP_BINARY = "./ctcp"
+
+DEFAULT_SERVER_PORT = 52365
+DEFAULT_CLIENT_PORT = 32843
+
+BASE = {"size": 1 << 20, "window": 8, "drop": 0, "delay": 0, "duplicate": 0}
+
+SIZES = [1 << 10, 64 << 10, 1 << 20, 16 << 20]
+FULL_SIZES = SIZES + [256 << 20, 2 << 30]
+WINDOWS = [1, 2, 4, 8, 16, 32]
+DROPS = [1, 5, 10]
+DELAYS = [1, 5]
+DUPLICATES = [1, 5, 10]
+
+FIELDS = ["label", "commit", "size", "window", "drop", "delay", "duplicate",
+          "result", "completion_s", "goodput_mbps", "segments", "retransmits",
+          "retransmit_ratio", "cpu_client_s", "cpu_server_s"]
+
+# Which settings tell runs apart, for --compare.
+KEY = ["size", "window", "drop", "delay", "duplicate"]
+
+
+def make_input(size):
+  """Random payload of the given size, kept around between runs."""
+  path = "/tmp/ctcp_bench_%d.bin" % size
+  if not os.path.exists(path) or os.path.getsize(path) != size:
+    with open(path, "wb") as f:
+      left = size
+      while left > 0:
+        chunk = min(left, 1 << 20)
+        f.write(os.urandom(chunk))
+        left -= chunk
+  return path
+
+
+def git_commit():
+  try:
+    return subprocess.check_output(["git", "rev-parse", "--short", "HEAD"],
+                                   stderr=subprocess.DEVNULL).decode().strip()
+  except (OSError, subprocess.CalledProcessError):
+    return ""
+
+
+def cpu_seconds(rusage):
+  return rusage.ru_utime + rusage.ru_stime
+
+
+def run(cfg, args):
+  """Runs one transfer. Returns a dict with a value for every field."""
+  flags = ["-w", str(cfg["window"]), "--stats", "--seed", str(args.seed)]
+  for name in ["drop", "delay", "duplicate"]:
+    if cfg[name]:
+      flags += ["--" + name, str(cfg[name])]
+  if args.netem:
+    flags += ["--netem", args.netem]
+
+  in_path = make_input(cfg["size"])
+  out_path = "/tmp/ctcp_bench_out.bin"
+  client_err_path = "/tmp/ctcp_bench_client.err"
+
+  with open("/tmp/ctcp_bench_server.err", "w") as server_err, \
+       open(client_err_path, "w") as client_err, \
+       open(out_path, "wb") as out_file, open(in_path, "rb") as in_file:
+    server = subprocess.Popen(
+        [CTCP_BINARY, "-s", "-p", str(args.server_port)] + flags,
+        stdin=subprocess.DEVNULL, stdout=out_file, stderr=server_err)
+    time.sleep(args.startup)
+
+    start = time.time()
+    client = subprocess.Popen(
+        [CTCP_BINARY, "-c", "localhost:%d" % args.server_port,
+         "-p", str(args.client_port)] + flags,
+        stdin=in_file, stdout=subprocess.DEVNULL, stderr=client_err)
+
+    # Done once everything is written out. The client may take a while longer
+    # to tear down, or never manage to. If it exits first (it gave up, or got a
+    # RST), the server gets --linger seconds to write out what it has.
+    completion = None
+    deadline = start + args.timeout
+    client_status = None
+    while time.time() < deadline:
+      if completion is None and os.path.getsize(out_path) >= cfg["size"]:
+        completion = time.time() - start
+        deadline = min(deadline, time.time() + args.linger)
+      if client_status is None:
+        pid, status, rusage = os.wait4(client.pid, os.WNOHANG)
+        if pid:
+          client.returncode = os.waitstatus_to_exitcode(status)
+          client_status = rusage
+          deadline = min(deadline, time.time() + args.linger)
+      if client_status is not None and completion is not None:
+        break
+      time.sleep(0.01)
+    if completion is None and os.path.getsize(out_path) >= cfg["size"]:
+      completion = time.time() - start
+    client_exited = client_status is not None
+
+    # Stopping them makes them print their counters.
+    if client_status is None:
+      client.terminate()
+      _, status, client_status = os.wait4(client.pid, 0)
+      client.returncode = os.waitstatus_to_exitcode(status)
+    server.terminate()
+    _, status, server_status = os.wait4(server.pid, 0)
+    server.returncode = os.waitstatus_to_exitcode(status)
+
+  # Read once the client's stderr is closed and flushed.
+  stats = {}
+  with open(client_err_path) as client_err:
+    for line in client_err:
+      if line.startswith("[STATS]"):
+        stats = dict(kv.split("=") for kv in line.split()[1:])
+
+  if completion is None:
+    result = "failed" if client_exited else "timeout"
+  elif subprocess.call(["cmp", "-s", in_path, out_path]) != 0:
+    result = "corrupt"
+  else:
+    result = "ok"
+
+  segments = int(stats.get("segments", 0))
+  retransmits = int(stats.get("retransmits", 0))
+  return {
+    "label": args.label,
+    "commit": args.commit,
+    "size": cfg["size"],
+    "window": cfg["window"],
+    "drop": cfg["drop"],
+    "delay": cfg["delay"],
+    "duplicate": cfg["duplicate"],
+    "result": result,
+    "completion_s": "%.3f" % completion if completion else "",
+    "goodput_mbps": "%.3f" % (cfg["size"] * 8 / completion / 1e6)
+                    if completion else "",
+    "segments": segments,
+    "retransmits": retransmits,
+    "retransmit_ratio": "%.4f" % (retransmits / segments) if segments else "",
+    "cpu_client_s": "%.3f" % cpu_seconds(client_status),
+    "cpu_server_s": "%.3f" % cpu_seconds(server_status),
+  }
+
+
+def sweeps(args):
+  """Configurations to run: the base, then one setting changed at a time."""
+  sizes = [int(s) for s in args.sizes.split(",")] if args.sizes else \
+          (FULL_SIZES if args.full else SIZES)
+  base = dict(BASE, size=args.base_size)
+  configs = [base]
+  for name, values in [("size", sizes), ("window", WINDOWS), ("drop", DROPS),
+                       ("delay", DELAYS), ("duplicate", DUPLICATES)]:
+    for value in values:
+      cfg = dict(base, **{name: value})
+      if cfg not in configs:
+        configs.append(cfg)
+  return configs
+
+
+def compare(old_path, new_path):
+  """Prints goodput and CPU time of matching runs in two CSV files."""
+  def load(path):
+    with open(path) as f:
+      return {tuple(row[k] for k in KEY): row for row in csv.DictReader(f)}
+
+  old, new = load(old_path), load(new_path)
+  print("%-44s %12s %12s %8s %10s" %
+        ("size,window,drop,delay,duplicate", "old Mbit/s", "new Mbit/s",
+         "change", "cpu change"))
+  for key in sorted(old, key=lambda k: [int(x) for x in k]):
+    if key not in new:
+      continue
+    a, b = old[key], new[key]
+    if not a["goodput_mbps"] or not b["goodput_mbps"]:
+      print("%-44s %12s %12s" % (",".join(key), a["result"], b["result"]))
+      continue
+    ga, gb = float(a["goodput_mbps"]), float(b["goodput_mbps"])
+    ca = float(a["cpu_client_s"]) + float(a["cpu_server_s"])
+    cb = float(b["cpu_client_s"]) + float(b["cpu_server_s"])
+    print("%-44s %12.3f %12.3f %+7.1f%% %+9.1f%%" %
+          (",".join(key), ga, gb, (gb / ga - 1) * 100,
+           (cb / ca - 1) * 100 if ca else 0))
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Benchmarks cTCP.")
+  parser.add_argument("--out", default="-",
+                      help="CSV file to write (default: stdout)")
+  parser.add_argument("--label", default="", help="Name for this run")
+  parser.add_argument("--full", action="store_true",
+                      help="Also run 256 MB and 2 GB payloads")
+  parser.add_argument("--sizes", help="Comma-separated payload sizes, in bytes")
+  parser.add_argument("--base-size", type=int, default=BASE["size"],
+                      help="Payload size for the other sweeps, in bytes")
+  parser.add_argument("--netem", help="Network emulator model for both ends")
+  parser.add_argument("--seed", type=int, default=144)
+  parser.add_argument("--timeout", type=float, default=300,
+                      help="Seconds to give each run")
+  parser.add_argument("--linger", type=float, default=3,
+                      help="Seconds to wait for the client to exit once "
+                           "done, or for the output once it exits")
+  parser.add_argument("--startup", type=float, default=0.2,
+                      help="Seconds to give the server to start")
+  parser.add_argument("--server-port", type=int, default=DEFAULT_SERVER_PORT)
+  parser.add_argument("--client-port", type=int, default=DEFAULT_CLIENT_PORT)
+  parser.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"),
+                      help="Compare two CSV files instead of running")
+  args = parser.parse_args()
+
+  if args.compare:
+    compare(*args.compare)
+    return
+  if not os.path.exists(CTCP_BINARY):
+    sys.exit("Build cTCP first (make)")
+  args.commit = git_commit()
+
+  out = sys.stdout if args.out == "-" else open(args.out, "w", newline="")
+  try:
+    writer = csv.DictWriter(out, fieldnames=FIELDS)
+    writer.writeheader()
+    for cfg in sweeps(args):
+      row = run(cfg, args)
+      writer.writerow(row)
+      out.flush()
+      sys.stderr.write("%s %s %s\n" % (
+          ",".join(str(cfg[k]) for k in KEY), row["result"],
+          row["goodput_mbps"]))
+  finally:
+    if out is not sys.stdout:
+      out.close()
+
+
+if __name__ == "__main__":
+  main()
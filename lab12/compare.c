@@ -1,70 +1,339 @@
-// C program to compare two files and report 
-// mismatches by displaying line number and 
-// position of line. 
-#include <stdio.h> 
-#include <string.h> 
-#include <stdlib.h> 
-  
-void compareFiles(FILE *fp1, FILE *fp2) 
-{ 
-    // fetching character of two file 
-    // in two variable ch1 and ch2 
-    char ch1 = getc(fp1); 
-    char ch2 = getc(fp2); 
-  
-    // error keeps track of number of errors 
-    // pos keeps track of position of errors 
-    // line keeps track of error line 
-    int error = 0, pos = 0, line = 1; 
-  
-    // iterate loop till end of file 
-    while (ch1 != EOF && ch2 != EOF) 
-    { 
-        pos++; 
-  
-        // if both variable encounters new 
-        // line then line variable is incremented 
-        // and pos variable is set to 0 
-        if (ch1 == '\n' && ch2 == '\n') 
-        { 
-            line++; 
-            pos = 0; 
-        } 
-  
-        // if fetched data is not equal then 
-        // error is incremented 
-        if (ch1 != ch2) 
-        { 
-            error++; 
-            printf("Line Number : %d \tError"
-               " Position : %d \n", line, pos); 
-        } 
-  
-        // fetching character until end of file 
-        ch1 = getc(fp1); 
-        ch2 = getc(fp2); 
-    } 
-  
-    printf("Total Errors : %d\t", error); 
-} 
-  
-// Driver code 
-int main() 
-{ 
-    // opening both file in read only mode 
-    FILE *fp1 = fopen("myReference", "rt+"); 
-    FILE *fp2 = fopen("reference", "rt+"); 
-  
-    if (fp1 == NULL || fp2 == NULL) 
-    { 
-       printf("Error : Files not open"); 
-       exit(0); 
-    } 
-  
-    compareFiles(fp1, fp2); 
-  
-    // closing both file 
-    fclose(fp1); 
-    fclose(fp2); 
-    return 0; 
-} 
+/******************************************************************************
+ * compare.c
+ * ---------
+ * Checks that a file received over cTCP matches the one that was sent. Both
+ * files are mapped into memory and compared in large blocks with memcmp(),
+ * which is vectorised, so even multi-GB files are checked at about the speed
+ * memory can be read. Only where a block differs are the bytes looked at one
+ * by one, to find the ranges that differ.
+ *
+ * A run of differing bytes is reported as one range, even if a few bytes in
+ * it happen to match, until --gap bytes in a row match. The bytes past the end
+ * of the shorter file are reported as a range of their own.
+ *
+ * With --hash, the XXH64 hash of each file is printed too (the same as
+ * xxhsum -H64), so files on different machines can be compared by their
+ * hashes. Only one file is needed then.
+ *
+ * Usage: compare [--hash] [--gap bytes] [--ranges max] [file1 [file2]]
+ * Compares myReference and reference if no files are given.
+ * Exits with 0 if the files are the same, 1 if not, and 2 on errors.
+ *
+ *****************************************************************************/
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Bytes compared by each call to memcmp(). Big enough for it to run at full
+    speed, small enough to stay in cache when a block has to be looked at
+    again byte by byte. */
+#define COMPARE_BLOCK (64 * 1024)
+
+/** Default for --gap and --ranges. */
+#define DEFAULT_GAP 64
+#define DEFAULT_MAX_RANGES 20
+
+/** A file mapped into memory. */
+typedef struct {
+  const char *path;
+  const uint8_t *data;
+  size_t size;
+} mapped_file_t;
+
+/** Running totals of the ranges that differ. */
+typedef struct {
+  uint64_t ranges;
+  uint64_t bytes;
+  uint64_t max_ranges;
+} mismatches_t;
+
+////////////////////////////////// MAPPING ///////////////////////////////////
+
+/**
+ * Maps a file read-only. An empty file is not mapped, since mmap() cannot map
+ * 0 bytes.
+ *
+ * returns: 0 on success, -1 on error.
+ */
+static int map_file(mapped_file_t *file, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  file->path = path;
+  file->data = NULL;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  file->size = st.st_size;
+  if (file->size > 0) {
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->data == MAP_FAILED) {
+      fprintf(stderr, "[ERROR] Could not map %s\n", path);
+      close(fd);
+      return -1;
+    }
+    /* Each file is read once from start to end, so read ahead as far as the
+       kernel will. */
+    madvise((void *) file->data, file->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return 0;
+}
+
+static void unmap_file(mapped_file_t *file) {
+  if (file->data)
+    munmap((void *) file->data, file->size);
+}
+
+///////////////////////////////// COMPARING //////////////////////////////////
+
+/**
+ * Finds the first byte that differs between two buffers.
+ *
+ * returns: Offset of the first differing byte, or len if there is none.
+ */
+static size_t find_mismatch(const uint8_t *a, const uint8_t *b, size_t len) {
+  size_t off = 0;
+
+  while (off < len) {
+    size_t n = len - off < COMPARE_BLOCK ? len - off : COMPARE_BLOCK;
+    if (memcmp(a + off, b + off, n) == 0) {
+      off += n;
+      continue;
+    }
+
+    /* This block differs somewhere. Find where, a word at a time. */
+    while (n >= 8) {
+      uint64_t x, y;
+      memcpy(&x, a + off, 8);
+      memcpy(&y, b + off, 8);
+      if (x != y)
+        break;
+      off += 8;
+      n -= 8;
+    }
+    while (a[off] == b[off])
+      off++;
+    return off;
+  }
+  return len;
+}
+
+/**
+ * Prints a range that differs, if not too many have been printed already,
+ * and counts it.
+ */
+static void report_range(mismatches_t *m, uint64_t start, uint64_t end,
+                         const char *what) {
+  if (m->ranges < m->max_ranges)
+    printf("mismatch: %llu-%llu (%llu bytes%s)\n", (unsigned long long) start,
+           (unsigned long long) end - 1,
+           (unsigned long long) (end - start), what);
+  m->ranges++;
+  m->bytes += end - start;
+}
+
+/**
+ * Compares two files and reports the ranges that differ.
+ *
+ * gap: How many bytes in a row must match to end a range.
+ */
+static void compare_files(mapped_file_t *f1, mapped_file_t *f2, size_t gap,
+                          mismatches_t *m) {
+  size_t len = f1->size < f2->size ? f1->size : f2->size;
+  const uint8_t *a = f1->data, *b = f2->data;
+  size_t off = 0;
+
+  while (off < len) {
+    off += find_mismatch(a + off, b + off, len - off);
+    if (off == len)
+      break;
+
+    /* Extend the range until gap bytes in a row match. */
+    size_t start = off, last = off;
+    for (off++; off < len && off - last <= gap; off++) {
+      if (a[off] != b[off])
+        last = off;
+    }
+    report_range(m, start, last + 1, "");
+    off = last + 1;
+  }
+
+  if (f1->size != f2->size) {
+    report_range(m, len, f1->size > f2->size ? f1->size : f2->size,
+                 f1->size > f2->size ? ", only in file1" : ", only in file2");
+  }
+  if (m->ranges > m->max_ranges)
+    printf("mismatch: (%llu more ranges not shown)\n",
+           (unsigned long long) (m->ranges - m->max_ranges));
+}
+
+////////////////////////////////// HASHING ///////////////////////////////////
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  return rotl64(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+/**
+ * Computes the XXH64 hash of some data, with a seed of 0. The four lanes are
+ * independent, so they run in parallel and keep up with memory.
+ */
+static uint64_t xxh64(const uint8_t *p, size_t len) {
+  const uint8_t *end = p + len;
+  uint64_t h, k;
+  uint32_t k32;
+
+  if (len >= 32) {
+    uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+    uint64_t w[4];
+    const uint8_t *limit = end - 32;
+    do {
+      memcpy(w, p, 32);
+      v1 = xxh_round(v1, w[0]);
+      v2 = xxh_round(v2, w[1]);
+      v3 = xxh_round(v3, w[2]);
+      v4 = xxh_round(v4, w[3]);
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  }
+  else {
+    h = XXH_P5;
+  }
+
+  h += len;
+  for (; p + 8 <= end; p += 8) {
+    memcpy(&k, p, 8);
+    h ^= xxh_round(0, k);
+    h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if (p + 4 <= end) {
+    memcpy(&k32, p, 4);
+    h ^= k32 * XXH_P1;
+    h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * XXH_P5;
+    h = rotl64(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+///////////////////////////////////// MAIN ///////////////////////////////////
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [--hash]\n"
+    "   [--gap bytes]\n"
+    "   [--ranges max_ranges_shown]\n"
+    "   [file1 [file2]]\n\n",
+    progname
+  );
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = argv[0];
+  const char *paths[2] = { "myReference", "reference" };
+  mapped_file_t files[2];
+  mismatches_t m = { 0, 0, DEFAULT_MAX_RANGES };
+  size_t gap = DEFAULT_GAP;
+  int hash = 0;
+  int num_files = 2;
+  int opt, i;
+
+  static struct option o[] = {
+    { "hash", no_argument, NULL, 'h' },
+    { "gap", required_argument, NULL, 'g' },
+    { "ranges", required_argument, NULL, 'r' },
+    { NULL, 0, NULL, 0 }
+  };
+  while ((opt = getopt_long(argc, argv, "hg:r:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      hash = 1;
+      break;
+    case 'g':
+      gap = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      m.max_ranges = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage(progname);
+    }
+  }
+
+  /* One file can only be hashed. */
+  if (argc - optind > 2 || (argc - optind == 1 && !hash))
+    usage(progname);
+  if (argc - optind > 0) {
+    num_files = argc - optind;
+    for (i = 0; i < num_files; i++)
+      paths[i] = argv[optind + i];
+  }
+
+  for (i = 0; i < num_files; i++) {
+    if (map_file(&files[i], paths[i]) < 0)
+      return 2;
+  }
+
+  if (num_files == 2) {
+    compare_files(&files[0], &files[1], gap, &m);
+    printf("sizes: %zu %zu\n", files[0].size, files[1].size);
+    printf("mismatched_ranges: %llu\n", (unsigned long long) m.ranges);
+    printf("mismatched_bytes: %llu\n", (unsigned long long) m.bytes);
+  }
+  if (hash) {
+    for (i = 0; i < num_files; i++)
+      printf("xxh64: %016llx  %s\n",
+             (unsigned long long) xxh64(files[i].data, files[i].size),
+             files[i].path);
+  }
+  if (num_files == 2)
+    printf("result: %s\n", m.ranges == 0 ? "same" : "differ");
+
+  for (i = 0; i < num_files; i++)
+    unmap_file(&files[i]);
+  return m.ranges == 0 ? 0 : 1;
+}
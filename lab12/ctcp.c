@@ -19,8 +19,9 @@
 #undef ENABLE_DEBUG
 
 typedef struct {
+  ll_link_t link; /* on tx_state.wrapped_unacked_segments */
   uint32_t num_retransmits; /* number of retransmission */
-  long timestamp_of_last_send; /* timestamp of last send */
+  uint64_t timestamp_of_last_send; /* timestamp of last send, in ns */
   ctcp_segment_t ctcp_segment; /* ctcp_segment struct */
 } wrapped_ctcp_segment_t;
 
@@ -36,8 +37,8 @@ typedef struct {
 typedef struct {
   uint32_t last_ackno_received;
   uint32_t last_seqno_read; /* LAST byte read from conn_input(). */
-  linked_list_t *wrapped_unacked_segments; /* point to wrapped_ctcp_segment_t 
-                                            * list of unacknowledged segments. */
+  ilist_t wrapped_unacked_segments; /* wrapped_ctcp_segment_t's not yet
+                                     * acknowledged, linked through link. */
   bool EOF_was_read;
 } tx_state_t;
 
@@ -65,20 +66,43 @@ struct ctcp_state {
 
 /**
  * Linked list of connection states. Go through this in ctcp_timer() to
- * resubmit segments and tear down connections.
+ * resubmit segments and tear down connections. A server with worker threads
+ * calls into cTCP from each of them, each with its own connections, so this
+ * is per thread.
  */
-static ctcp_state_t *state_list;
+static __thread ctcp_state_t *state_list;
+
+/** Where connection states are allocated from. */
+static __thread slab_t state_slab = SLAB_INIT(ctcp_state_t);
+
+/* The output list is only allocated while the connection is receiving, so an
+   idle connection costs no more than its ctcp_state. Its nodes are pooled, and
+   it is kept until a timer tick finds it empty, so segments going through it
+   do no heap allocation for their nodes. */
+linked_list_t *ctcp_list(linked_list_t **list) {
+  if (*list == NULL)
+    *list = ll_create_pooled();
+  return *list;
+}
+
+void ctcp_list_release(linked_list_t **list) {
+  if (*list != NULL && ll_length(*list) == 0) {
+    ll_destroy(*list);
+    *list = NULL;
+  }
+}
 
 /* FIXME: Feel free to add as many helper functions as needed. Don't repeat
           code! Helper functions make the code clearer and cleaner. */
-void ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segment)
+/* returns -1 if the connection was destroyed, 0 otherwise */
+int ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segment)
 {
   int bytes_sent;
 
   if(wrapped_segment->num_retransmits >= 6) { /* maximum retransmission */
     wrapped_segment->num_retransmits = 0;
     ctcp_destroy(state);
-    return;
+    return -1;
   }
   /* build segment's ctcp header fields. */
   wrapped_segment->ctcp_segment.ackno = htonl(state->rx_state.last_seqno_accepted + 1);
@@ -90,41 +114,46 @@ void ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segm
 
   bytes_sent = conn_send(state->conn, &wrapped_segment->ctcp_segment, 
                           ntohs(wrapped_segment->ctcp_segment.len));
-  wrapped_segment->timestamp_of_last_send = current_time(); /* get time immediately when sending */
+  wrapped_segment->timestamp_of_last_send = current_time_ns(); /* get time immediately when sending */
+  /* wake up right when it times out, not on the next timer tick */
+  timer_at(wrapped_segment->timestamp_of_last_send +
+           state->ctcp_config.rt_timeout * 1000000ULL);
   wrapped_segment->num_retransmits++;
   if(bytes_sent < ntohs(wrapped_segment->ctcp_segment.len)) {
     fprintf(stderr, "-----CONN_SEND returned %d bytes instead of %d\n",
                     bytes_sent, ntohs(wrapped_segment->ctcp_segment.len));
-    return; /* conn_send failed */
+    return 0; /* conn_send failed */
   }
   #ifdef ENABLE_DEBUG
   fprintf(stderr, "-----CONN_SEND: ");
   print_segment_ctcp(&wrapped_segment->ctcp_segment);
   #endif
+  return 0;
 }
 
-void ctcp_send_all(ctcp_state_t* state) {
+/* returns -1 if the connection was destroyed, 0 otherwise */
+int ctcp_send_all(ctcp_state_t* state) {
   wrapped_ctcp_segment_t *wrapped_segment;
-  long ms_since_last_send;
+  uint64_t ns_since_last_send;
   unsigned int i, num_unacked_segments;
   uint32_t last_seqno_of_segment, last_allow_seqno;
-  ll_node_t *current_node;
+  ll_link_t *current_link;
 
   if(state == NULL)   
-    return;
+    return 0;
 
-  if((num_unacked_segments = state->tx_state.wrapped_unacked_segments->length) == 0)
-    return;
+  if((num_unacked_segments = ilist_length(&state->tx_state.wrapped_unacked_segments)) == 0)
+    return 0;
   #ifdef ENABLE_DEBUG
     fprintf(stderr, "number of unacked segments: %d\n", num_unacked_segments);
   #endif
   for(i = 0; i < num_unacked_segments; ++i) {
     if (i == 0) {
-      current_node = ll_front(state->tx_state.wrapped_unacked_segments);
+      current_link = ilist_front(&state->tx_state.wrapped_unacked_segments);
     } else {
-      current_node = current_node->next;
+      current_link = current_link->next;
     }
-    wrapped_segment = (wrapped_ctcp_segment_t*)current_node->object;
+    wrapped_segment = ll_entry(current_link, wrapped_ctcp_segment_t, link);
 
     /* calculating sequence number of last byte of segment */
     last_seqno_of_segment = ntohl(wrapped_segment->ctcp_segment.seqno) +
@@ -139,47 +168,51 @@ void ctcp_send_all(ctcp_state_t* state) {
     if(last_seqno_of_segment > last_allow_seqno) {
       fprintf(stderr, "last seqno of data=%u last allowable seqno=%u\n",
         last_seqno_of_segment, last_allow_seqno);
-      return;
+      return 0;
     }
     // This segment is within the send window. Any segments here that have not been sent  
     // can now be sent. The first segment can be retransmitted if it timed out
     if(wrapped_segment->num_retransmits == 0) {
-      ctcp_send_segment(state, wrapped_segment);
+      if(ctcp_send_segment(state, wrapped_segment) < 0)
+        return -1;
     } else if (i == 0) {
       /* check & see if we need to retransmits the first segment */
-      ms_since_last_send = current_time() - wrapped_segment->timestamp_of_last_send;
-      if(ms_since_last_send > state->ctcp_config.rt_timeout) { /* Time out, resend */
-        ctcp_send_segment(state, wrapped_segment);
+      ns_since_last_send = current_time_ns() - wrapped_segment->timestamp_of_last_send;
+      if(ns_since_last_send >= state->ctcp_config.rt_timeout * 1000000ULL) { /* Time out, resend */
+        if(ctcp_send_segment(state, wrapped_segment) < 0)
+          return -1;
       }
     }
   }
+  return 0;
 }
 
 void ctcp_send_ack(ctcp_state_t *state) {
-  ctcp_segment_t *segment = calloc(1, sizeof(ctcp_segment_t));
-  segment->seqno = 0; /* dont care seqno */
-  segment->ackno = htonl(state->rx_state.last_seqno_accepted + 1);
-  segment->len = ntohs((uint16_t)sizeof(ctcp_segment_t));
-  segment->flags |= TH_ACK;
-  segment->window = htons(state->ctcp_config.recv_window);
-  segment->cksum = 0;
-  segment->cksum = cksum(segment, sizeof(ctcp_segment_t));
-  conn_send(state->conn, segment, sizeof(ctcp_segment_t));
+  ctcp_segment_t segment;
+  memset(&segment, 0, sizeof(ctcp_segment_t));
+  segment.seqno = 0; /* dont care seqno */
+  segment.ackno = htonl(state->rx_state.last_seqno_accepted + 1);
+  segment.len = ntohs((uint16_t)sizeof(ctcp_segment_t));
+  segment.flags |= TH_ACK;
+  segment.window = htons(state->ctcp_config.recv_window);
+  segment.cksum = 0;
+  segment.cksum = cksum(&segment, sizeof(ctcp_segment_t));
+  conn_send(state->conn, &segment, sizeof(ctcp_segment_t));
   #ifdef ENABLE_DEBUG
   fprintf(stderr, "-----ctcp_send_ack: \n");
-  print_hdr_ctcp(segment);
+  print_hdr_ctcp(&segment);
   #endif
 }
 
 void ctcp_clear_unacked_segments(ctcp_state_t *state) {
-  ll_node_t *front_node;
+  ll_link_t *front_link;
   wrapped_ctcp_segment_t *wrapped_segment;
   uint16_t datalen;
   uint32_t last_seqno_of_data;
 
-  while(ll_length(state->tx_state.wrapped_unacked_segments) > 0) {
-    front_node = ll_front(state->tx_state.wrapped_unacked_segments);
-    wrapped_segment = (wrapped_ctcp_segment_t *) front_node->object;
+  while(ilist_length(&state->tx_state.wrapped_unacked_segments) > 0) {
+    front_link = ilist_front(&state->tx_state.wrapped_unacked_segments);
+    wrapped_segment = ll_entry(front_link, wrapped_ctcp_segment_t, link);
     datalen = ntohs(wrapped_segment->ctcp_segment.len) - sizeof(ctcp_segment_t);
     last_seqno_of_data = ntohl(wrapped_segment->ctcp_segment.seqno) + datalen - 1;
 
@@ -188,10 +221,10 @@ void ctcp_clear_unacked_segments(ctcp_state_t *state) {
       #ifdef ENABLE_DEBUG
       fprintf(stderr, "ctcp_clear_unacked_segments #seq: %u\n", ntohl(wrapped_segment->ctcp_segment.seqno));
       #endif
+      ilist_remove(&state->tx_state.wrapped_unacked_segments, front_link);
       free(wrapped_segment);
-      ll_remove(state->tx_state.wrapped_unacked_segments, front_node);
     } else {
-      return; /* segment has not been ack-ed. Done! */
+      break; /* segment has not been ack-ed. Done! */
     }
   }
 }
@@ -204,7 +237,7 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
 
   /* Established a connection. Create a new state and update the linked list
      of connection states. */
-  ctcp_state_t *state = calloc(sizeof(ctcp_state_t), 1);
+  ctcp_state_t *state = slab_alloc(&state_slab);
   state->next = state_list;
   state->prev = &state_list;
   if (state_list)
@@ -230,14 +263,14 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->tx_state.last_ackno_received = 0; /* last acknowledgememt number of tx state */
   state->tx_state.last_seqno_read = 1; /* last byte read from input */
   state->tx_state.EOF_was_read = false;
-  state->tx_state.wrapped_unacked_segments = ll_create(); /* list of unack-ed segments */
+  ilist_init(&state->tx_state.wrapped_unacked_segments); /* list of unack-ed segments */
   /* rx_state */
   state->rx_state.last_seqno_accepted = 0; /* last byte of received segment */
   state->rx_state.num_truncated_segments = 0;
   state->rx_state.num_out_of_window_segments = 0;
   state->rx_state.num_invalid_cksum = 0;
   state->rx_state.FIN_was_recv = false;
-  state->rx_state.segments_output = ll_create(); /* list of output segments */
+  state->rx_state.segments_output = NULL; /* list of output segments, created when needed */
 
   free(cfg);
   return state;
@@ -261,19 +294,19 @@ void ctcp_destroy(ctcp_state_t *state) {
                   state->rx_state.num_invalid_cksum,
                   state->rx_state.num_truncated_segments,
                   state->rx_state.num_out_of_window_segments,
-                  ll_length(state->tx_state.wrapped_unacked_segments),
+                  ilist_length(&state->tx_state.wrapped_unacked_segments),
                   ll_length(state->rx_state.segments_output));
   #endif
 
   ll_node_t *front_node;
+  ll_link_t *front_link;
   fprintf(stderr, "Freeing segments in unack-ed list... ");
   /* free all segments in unack-ed list */
-  while(ll_length(state->tx_state.wrapped_unacked_segments) > 0) {
-    front_node = ll_front(state->tx_state.wrapped_unacked_segments);
-    free(front_node->object);
-    ll_remove(state->tx_state.wrapped_unacked_segments, front_node);
+  while(ilist_length(&state->tx_state.wrapped_unacked_segments) > 0) {
+    front_link = ilist_front(&state->tx_state.wrapped_unacked_segments);
+    ilist_remove(&state->tx_state.wrapped_unacked_segments, front_link);
+    free(ll_entry(front_link, wrapped_ctcp_segment_t, link));
   }
-  ll_destroy(state->tx_state.wrapped_unacked_segments);
 
   fprintf(stderr, "done!\nFreeing segments in output list... ");
   /* free all segments in segments_output list */
@@ -285,7 +318,7 @@ void ctcp_destroy(ctcp_state_t *state) {
   ll_destroy(state->rx_state.segments_output);
   fprintf(stderr, "done!\n");
 
-  free(state);
+  slab_free(&state_slab, state);
   end_client();
 }
 
@@ -309,7 +342,7 @@ void ctcp_read(ctcp_state_t *state) {
     /* update seqno tx state. Sequence numbers start at 1, not 0. */
     state->tx_state.last_seqno_read += bytes_read; 
     /* add new ctcp segment to list of unacknowledged segments. */
-    ll_add(state->tx_state.wrapped_unacked_segments, wrapped_segment);
+    ilist_add(&state->tx_state.wrapped_unacked_segments, &wrapped_segment->link);
   }
 
   if(bytes_read == -1) { // get EOF
@@ -321,9 +354,9 @@ void ctcp_read(ctcp_state_t *state) {
     wrapped_segment->ctcp_segment.len = htons((uint16_t) sizeof(ctcp_segment_t));
     wrapped_segment->ctcp_segment.seqno = htonl(state->tx_state.last_seqno_read);
     wrapped_segment->ctcp_segment.flags |= TH_FIN; // FIN in network
-    ll_add(state->tx_state.wrapped_unacked_segments, wrapped_segment);
+    ilist_add(&state->tx_state.wrapped_unacked_segments, &wrapped_segment->link);
   }
-  ctcp_send_all(state_list);
+  ctcp_send_all(state);
 }
 
 void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
@@ -366,10 +399,10 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
     /* segment out of window */
     if(last_seqno_of_data > largest_allow_seqno || 
         ntohl(segment->seqno) < smallest_allow_seqno) { 
+      fprintf(stderr, "#seq%d OUT OF WINDOW\n", ntohl(segment->seqno));
       free(segment);
       ctcp_send_ack(state); /* send the sender our state */
       state->rx_state.num_out_of_window_segments++;
-      fprintf(stderr, "#seq%d OUT OF WINDOW\n", ntohl(segment->seqno));
       return;
     }
   }
@@ -385,6 +418,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
    * segment has not empty, or receive a FIN (which case we'll need to output EOF)
    */
   if(datalen || segment->flags & TH_FIN) {
+    ctcp_list(&state->rx_state.segments_output);
     /* taking care to throw away/free it if it's a duplicate */
     length_of_segment_output_list = ll_length(state->rx_state.segments_output);
     if(length_of_segment_output_list == 0)
@@ -445,6 +479,9 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
       }
     }
   } /* End of condition datalen || TH_FIN */
+  else {
+    free(segment); /* pure ACK, nothing to output */
+  }
 
   ctcp_output(state); /* output all received segments */
   ctcp_clear_unacked_segments(state);
@@ -493,19 +530,24 @@ void ctcp_output(ctcp_state_t *state) {
 
 void ctcp_timer() {
   /* FIXME */
-  if(state_list == NULL)    
-    return;
-  ctcp_output(state_list);
-  ctcp_send_all(state_list);
-
-  if( (state_list->tx_state.EOF_was_read) &&
-      (state_list->rx_state.FIN_was_recv) &&
-      (ll_length(state_list->tx_state.wrapped_unacked_segments) == 0) &&
-      (ll_length(state_list->rx_state.segments_output) == 0) ) {
-    if(state_list->FIN_WAIT_time_start == 0) {
-      state_list->FIN_WAIT_time_start = current_time();
-    } else if (current_time() - state_list->FIN_WAIT_time_start > 2*1000) {
-      ctcp_destroy(state_list);
+  ctcp_state_t *state, *next;
+
+  for(state = state_list; state != NULL; state = next) {
+    next = state->next; /* state may be destroyed below */
+    ctcp_output(state);
+    ctcp_list_release(&state->rx_state.segments_output);
+    if(ctcp_send_all(state) < 0)
+      continue; /* gave up on this connection */
+
+    if( (state->tx_state.EOF_was_read) &&
+        (state->rx_state.FIN_was_recv) &&
+        (ilist_length(&state->tx_state.wrapped_unacked_segments) == 0) &&
+        (ll_length(state->rx_state.segments_output) == 0) ) {
+      if(state->FIN_WAIT_time_start == 0) {
+        state->FIN_WAIT_time_start = current_time();
+      } else if (current_time() - state->FIN_WAIT_time_start > 2*1000) {
+        ctcp_destroy(state);
+      }
     }
   }
 }
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ctcp_dumper.h"
+
+/** The open pcap file. Packets are added under the lock. */
+static struct {
+  pthread_mutex_t lock;
+  int fd;                         /* -1 if not dumping */
+  char *fname;                    /* Name of the first file */
+  int snaplen;
+  long rotate;                    /* Bytes per file, or 0 for no limit */
+  int file_num;                   /* Files started so far, less one */
+  long file_size;                 /* Bytes in this file, buffered included */
+  char *buf;
+  size_t buf_len;
+} dump = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+
+/**
+ * Writes the buffer out to the file. Must hold the lock.
+ */
+static void dump_flush() {
+  char *buf = dump.buf;
+  size_t left = dump.buf_len;
+
+  while (left > 0) {
+    ssize_t w = write(dump.fd, buf, left);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      fprintf(stderr, "[ERROR] Could not write pcap file: %s\n",
+              strerror(errno));
+      break;
+    }
+    buf += w;
+    left -= w;
+  }
+  dump.buf_len = 0;
+}
+
+/**
+ * Opens the next file and writes its header. Must hold the lock.
+ *
+ * returns: 0 on success, -1 on failure.
+ */
+static int dump_start_file() {
+  struct pcap_file_header hdr;
+  char fname[PATH_MAX];
+
+  /* Named like tcpdump -C names them. */
+  if (dump.file_num == 0)
+    snprintf(fname, sizeof(fname), "%s", dump.fname);
+  else
+    snprintf(fname, sizeof(fname), "%s%d", dump.fname, dump.file_num);
+
+  dump.fd = open(fname, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (dump.fd < 0) {
+    fprintf(stderr, "[ERROR] Could not open pcap file %s: %s\n", fname,
+            strerror(errno));
+    return -1;
+  }
+
+  hdr.magic = TCPDUMP_MAGIC;
+  hdr.version_major = PCAP_VERSION_MAJOR;
+  hdr.version_minor = PCAP_VERSION_MINOR;
+  hdr.thiszone = 0;
+  hdr.sigfigs = 0;
+  hdr.snaplen = dump.snaplen;
+  hdr.linktype = LINKTYPE_RAW;
+  memcpy(dump.buf, &hdr, sizeof(hdr));
+  dump.buf_len = sizeof(hdr);
+  dump.file_size = sizeof(hdr);
+  return 0;
+}
+
+int dump_open(const char *fname, int snaplen, long rotate) {
+  pthread_mutex_lock(&dump.lock);
+  dump.fname = strdup(fname);
+  dump.snaplen = snaplen;
+  dump.rotate = rotate;
+  dump.file_num = 0;
+  dump.buf = malloc(PCAP_BUF_SIZE);
+  int r = dump_start_file();
+  pthread_mutex_unlock(&dump.lock);
+  return r;
+}
+
+bool dump_enabled() {
+  return dump.fd >= 0;
+}
+
+void dump_packet(const void *buf, size_t len) {
+  struct pcap_sf_pkthdr sf_hdr;
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  sf_hdr.ts.tv_sec = tv.tv_sec;
+  sf_hdr.ts.tv_usec = tv.tv_usec;
+  sf_hdr.caplen = len < dump.snaplen ? len : dump.snaplen;
+  sf_hdr.len = len;
+  size_t rec_len = sizeof(sf_hdr) + sf_hdr.caplen;
+
+  pthread_mutex_lock(&dump.lock);
+  if (dump.fd < 0) {
+    pthread_mutex_unlock(&dump.lock);
+    return;
+  }
+
+  /* Go on to the next file once this one is full. Every file gets at least
+     one packet. */
+  if (dump.rotate > 0 && dump.file_size + rec_len > dump.rotate &&
+      dump.file_size > sizeof(struct pcap_file_header)) {
+    dump_flush();
+    close(dump.fd);
+    dump.file_num++;
+    if (dump_start_file() < 0) {
+      pthread_mutex_unlock(&dump.lock);
+      return;
+    }
+  }
+
+  if (dump.buf_len + rec_len > PCAP_BUF_SIZE)
+    dump_flush();
+  memcpy(dump.buf + dump.buf_len, &sf_hdr, sizeof(sf_hdr));
+  memcpy(dump.buf + dump.buf_len + sizeof(sf_hdr), buf, sf_hdr.caplen);
+  dump.buf_len += rec_len;
+  dump.file_size += rec_len;
+  pthread_mutex_unlock(&dump.lock);
+}
+
+void dump_close() {
+  pthread_mutex_lock(&dump.lock);
+  if (dump.fd >= 0) {
+    dump_flush();
+    close(dump.fd);
+    dump.fd = -1;
+  }
+  pthread_mutex_unlock(&dump.lock);
+}
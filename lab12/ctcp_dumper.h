@@ -0,0 +1,88 @@
+/******************************************************************************
+ * ctcp_dumper.h
+ * -------------
+ * Writes the IPv4/TCP datagrams a host sends and receives to a pcap file, for
+ * --pcap. The file format is the same as the router's sr_dumper, except that
+ * datagrams start at the IP header (LINKTYPE_RAW), since cTCP has no link
+ * layer. Packets are collected in a buffer and written out in large chunks.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_DUMPER_H
+#define CTCP_DUMPER_H
+
+#include "ctcp_sys.h"
+
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+
+#define TCPDUMP_MAGIC 0xa1b2c3d4
+
+#define LINKTYPE_RAW 101
+
+/** Default most bytes saved from each datagram. */
+#define PCAP_SNAPLEN 65535
+
+/** Size of the buffer packets are collected in before being written. */
+#define PCAP_BUF_SIZE (256 * 1024)
+
+/* file header */
+struct pcap_file_header {
+  uint32_t magic;           /* magic number */
+  uint16_t version_major;   /* version number major */
+  uint16_t version_minor;   /* version number minor */
+  int thiszone;             /* gmt to local correction */
+  uint32_t sigfigs;         /* accuracy of timestamps */
+  uint32_t snaplen;         /* max length saved portion of each pkt */
+  uint32_t linktype;        /* data link type (LINKTYPE_*) */
+};
+
+/*
+ * This is a timeval as stored in disk in a dumpfile.
+ * It has to use the same types everywhere, independent of the actual
+ * `struct timeval'
+ */
+struct pcap_timeval {
+  int tv_sec;               /* seconds */
+  int tv_usec;              /* microseconds */
+};
+
+/*
+ * How a packet header is actually stored in the dumpfile.
+ */
+struct pcap_sf_pkthdr {
+  struct pcap_timeval ts;   /* time stamp */
+  uint32_t caplen;          /* length of portion present */
+  uint32_t len;             /* length this packet (off wire) */
+};
+
+/**
+ * Starts writing datagrams to a pcap file.
+ *
+ * fname: The file. Overwritten if it exists.
+ * snaplen: Most bytes to save from each datagram.
+ * rotate: Once a file grows past this many bytes, go on to a new one named
+ *         fname1, fname2, and so on, like tcpdump -C. 0 to never rotate.
+ * returns: 0 on success, -1 if the file could not be opened.
+ */
+int dump_open(const char *fname, int snaplen, long rotate);
+
+/**
+ * Whether datagrams are being written to a file.
+ */
+bool dump_enabled();
+
+/**
+ * Adds a datagram to the file. Safe to call from any thread.
+ *
+ * buf: The datagram, starting at the IP header.
+ * len: Length of the datagram.
+ */
+void dump_packet(const void *buf, size_t len);
+
+/**
+ * Writes out everything buffered so far and closes the file.
+ */
+void dump_close();
+
+#endif /* CTCP_DUMPER_H */
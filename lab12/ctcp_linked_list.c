@@ -1,5 +1,11 @@
 #include "ctcp_linked_list.h"
 
+/** Memory a pooled list carves its nodes out of. */
+struct ll_chunk {
+  struct ll_chunk *next;
+  ll_node_t nodes[LL_POOL_CHUNK];
+};
+
 linked_list_t *ll_create() {
   linked_list_t *list = calloc(sizeof(linked_list_t), 1);
   list->head = NULL;
@@ -8,10 +14,28 @@ linked_list_t *ll_create() {
   return list;
 }
 
+linked_list_t *ll_create_pooled() {
+  linked_list_t *list = ll_create();
+  list->pooled = true;
+  return list;
+}
+
 void ll_destroy(linked_list_t *list) {
   if (list == NULL)
     return;
 
+  /* A pooled list's nodes all live in its chunks. */
+  if (list->pooled) {
+    struct ll_chunk *chunk = list->chunks;
+    while (chunk != NULL) {
+      struct ll_chunk *next = chunk->next;
+      free(chunk);
+      chunk = next;
+    }
+    free(list);
+    return;
+  }
+
   ll_node_t *curr = list->head;
   ll_node_t *next = NULL;
   while (curr != NULL) {
@@ -22,8 +46,28 @@ void ll_destroy(linked_list_t *list) {
   free(list);
 }
 
-ll_node_t *ll_create_node(void *object) {
-  ll_node_t *node = calloc(sizeof(ll_node_t), 1);
+ll_node_t *ll_create_node(linked_list_t *list, void *object) {
+  ll_node_t *node;
+
+  if (!list->pooled) {
+    node = calloc(sizeof(ll_node_t), 1);
+  }
+  else {
+    /* Out of spare nodes. Carve a new chunk up into more. */
+    if (list->spare == NULL) {
+      struct ll_chunk *chunk = malloc(sizeof(struct ll_chunk));
+      int i;
+      for (i = 0; i < LL_POOL_CHUNK - 1; i++)
+        chunk->nodes[i].next = &chunk->nodes[i + 1];
+      chunk->nodes[LL_POOL_CHUNK - 1].next = NULL;
+      chunk->next = list->chunks;
+      list->chunks = chunk;
+      list->spare = chunk->nodes;
+    }
+    node = list->spare;
+    list->spare = node->next;
+  }
+
   node->next = NULL;
   node->prev = NULL;
   node->object = object;
@@ -34,7 +78,7 @@ ll_node_t *ll_add(linked_list_t *list, void *object) {
   if (list == NULL || object == NULL)
     return NULL;
 
-  ll_node_t *node = ll_create_node(object);
+  ll_node_t *node = ll_create_node(list, object);
   /* List is empty. */
   if (list->head == NULL) {
     list->head = node;
@@ -56,7 +100,7 @@ ll_node_t *ll_add_front(linked_list_t *list, void *object) {
   if (list == NULL || object == NULL)
     return NULL;
 
-  ll_node_t *node = ll_create_node(object);
+  ll_node_t *node = ll_create_node(list, object);
   /* List is empty. */
   if (list->head == NULL) {
     list->head = node;
@@ -78,7 +122,7 @@ ll_node_t *ll_add_after(linked_list_t *list, ll_node_t *node, void *object) {
   if (list == NULL || node == NULL || object == NULL)
     return NULL;
 
-  ll_node_t *new_node = ll_create_node(object);
+  ll_node_t *new_node = ll_create_node(list, object);
   /* Update pointers. */
   new_node->prev = node;
   new_node->next = node->next;
@@ -110,8 +154,14 @@ void *ll_remove(linked_list_t *list, ll_node_t *node) {
   else
     node->next->prev = node->prev;
 
-  /* Free memory. */
-  free(node);
+  /* Free memory, or keep it for the next node. */
+  if (list->pooled) {
+    node->next = list->spare;
+    list->spare = node;
+  }
+  else {
+    free(node);
+  }
   list->length--;
 
   return object;
@@ -132,13 +182,88 @@ ll_node_t *ll_find(linked_list_t *list, void *object) {
 }
 
 ll_node_t *ll_front(linked_list_t *list) {
+  if (list == NULL)
+    return NULL;
   return list->head;
 }
 
 ll_node_t *ll_back(linked_list_t *list) {
+  if (list == NULL)
+    return NULL;
   return list->tail;
 }
 
 unsigned int ll_length(linked_list_t *list) {
+  if (list == NULL)
+    return 0;
+  return list->length;
+}
+
+/////////////////////////////// INTRUSIVE LISTS ///////////////////////////////
+
+void ilist_init(ilist_t *list) {
+  list->head = NULL;
+  list->tail = NULL;
+  list->length = 0;
+}
+
+void ilist_add(ilist_t *list, ll_link_t *link) {
+  link->next = NULL;
+  link->prev = list->tail;
+  if (list->tail != NULL)
+    list->tail->next = link;
+  else
+    list->head = link;
+  list->tail = link;
+  list->length++;
+}
+
+void ilist_add_front(ilist_t *list, ll_link_t *link) {
+  link->prev = NULL;
+  link->next = list->head;
+  if (list->head != NULL)
+    list->head->prev = link;
+  else
+    list->tail = link;
+  list->head = link;
+  list->length++;
+}
+
+void ilist_add_after(ilist_t *list, ll_link_t *after, ll_link_t *link) {
+  link->prev = after;
+  link->next = after->next;
+  if (after->next != NULL)
+    after->next->prev = link;
+  else
+    list->tail = link;
+  after->next = link;
+  list->length++;
+}
+
+void ilist_remove(ilist_t *list, ll_link_t *link) {
+  if (link->prev != NULL)
+    link->prev->next = link->next;
+  else
+    list->head = link->next;
+
+  if (link->next != NULL)
+    link->next->prev = link->prev;
+  else
+    list->tail = link->prev;
+
+  link->next = NULL;
+  link->prev = NULL;
+  list->length--;
+}
+
+ll_link_t *ilist_front(ilist_t *list) {
+  return list->head;
+}
+
+ll_link_t *ilist_back(ilist_t *list) {
+  return list->tail;
+}
+
+unsigned int ilist_length(ilist_t *list) {
   return list->length;
 }
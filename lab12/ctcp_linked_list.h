@@ -8,6 +8,8 @@
 #ifndef CTCP_LINKED_LIST_H
 #define CTCP_LINKED_LIST_H
 
+#include <stddef.h>
+
 #include "ctcp_sys.h"
 
 /** Node in the linked list. */
@@ -18,14 +20,49 @@ struct ll_node {
 };
 typedef struct ll_node ll_node_t;
 
+/** Number of nodes a pooled list allocates at a time. */
+#define LL_POOL_CHUNK 32
+
 /** A linked list. */
 struct linked_list {
   ll_node_t *head;
   ll_node_t *tail;
   unsigned int length;
+  bool pooled;                 /* Nodes come from the list's own pool */
+  ll_node_t *spare;            /* [Pooled] Free nodes, linked through next */
+  void *chunks;                /* [Pooled] Memory the nodes are carved from */
 };
 typedef struct linked_list linked_list_t;
 
+/**
+ * Links embedded in an object, so that it can be put on an intrusive list
+ * without allocating a node for it. An object can be on as many intrusive
+ * lists as it has links.
+ */
+struct ll_link {
+  struct ll_link *next;
+  struct ll_link *prev;
+};
+typedef struct ll_link ll_link_t;
+
+/** An intrusive list. Zeroed, or set up with ilist_init(), it is empty. */
+struct ilist {
+  ll_link_t *head;
+  ll_link_t *tail;
+  unsigned int length;
+};
+typedef struct ilist ilist_t;
+
+/**
+ * Gets the object a link is embedded in.
+ *
+ * link: The link.
+ * type: Type of the object.
+ * member: Name of the link within the object.
+ */
+#define ll_entry(link, type, member) \
+  ((type *) ((char *) (link) - offsetof(type, member)))
+
 
 /**
  * Creates a new linked list and returns it. This must be freed later with
@@ -35,6 +72,17 @@ typedef struct linked_list linked_list_t;
  */
 linked_list_t *ll_create();
 
+/**
+ * Creates a new linked list whose nodes come from a pool of its own. Nodes are
+ * allocated LL_POOL_CHUNK at a time, and removed nodes are kept to be reused,
+ * so adding and removing do no heap allocation once the list has been as long
+ * as it gets. The pool is freed along with the list by ll_destroy(). Otherwise
+ * works like a list from ll_create().
+ *
+ * returns: The new linked list.
+ */
+linked_list_t *ll_create_pooled();
+
 /**
  * Destroys a linked list. This will free up its memory and the memory taken
  * by its nodes. This DOES NOT free up the memory taken up by the objects
@@ -106,18 +154,76 @@ void *ll_remove(linked_list_t *list, ll_node_t *node);
 ll_node_t *ll_find(linked_list_t *list, void *object);
 
 /**
- * Returns the first element in the list.
+ * Returns the first element in the list, or NULL if the list is NULL.
  */
 ll_node_t *ll_front(linked_list_t *list);
 
 /**
- * Returns the last element in the list.
+ * Returns the last element in the list, or NULL if the list is NULL.
  */
 ll_node_t *ll_back(linked_list_t *list);
 
 /**
- * Returns the length of the list.
+ * Returns the length of the list. A NULL list has length 0.
  */
 unsigned int ll_length(linked_list_t *list);
 
+
+/////////////////////////////// INTRUSIVE LISTS ///////////////////////////////
+
+/**
+ * Empties an intrusive list. The objects on it are not touched.
+ *
+ * list: The list.
+ */
+void ilist_init(ilist_t *list);
+
+/**
+ * Adds an object to the back of an intrusive list.
+ *
+ * list: The list to add to.
+ * link: The object's link. Must not be on a list already.
+ */
+void ilist_add(ilist_t *list, ll_link_t *link);
+
+/**
+ * Adds an object to the front of an intrusive list.
+ *
+ * list: The list to add to.
+ * link: The object's link. Must not be on a list already.
+ */
+void ilist_add_front(ilist_t *list, ll_link_t *link);
+
+/**
+ * Adds an object to an intrusive list after another one.
+ *
+ * list: The list to add to.
+ * after: Link of the object to add after. Must be on the list.
+ * link: The object's link. Must not be on a list already.
+ */
+void ilist_add_after(ilist_t *list, ll_link_t *after, ll_link_t *link);
+
+/**
+ * Removes an object from an intrusive list. Nothing is freed.
+ *
+ * list: The list to remove from.
+ * link: The object's link. Must be on the list.
+ */
+void ilist_remove(ilist_t *list, ll_link_t *link);
+
+/**
+ * Returns the first link in the list, or NULL if it is empty.
+ */
+ll_link_t *ilist_front(ilist_t *list);
+
+/**
+ * Returns the last link in the list, or NULL if it is empty.
+ */
+ll_link_t *ilist_back(ilist_t *list);
+
+/**
+ * Returns the length of the list.
+ */
+unsigned int ilist_length(ilist_t *list);
+
 #endif /* CTCP_LINKED_LIST_H */
@@ -0,0 +1,1003 @@
+/******************************************************************************
+ * ctcp_load.c
+ * -----------
+ * Load generator for a cTCP server, built as ctcp_load. Opens many client
+ * connections from one process, each with its own cTCP state (ctcp.c) and its
+ * own Unix socket, and times them. It speaks the same protocol as a ctcp
+ * client over --transport unix: a TCP handshake, then cTCP segments carried in
+ * IP packets, so any server started with --transport unix can be loaded.
+ *
+ * Two patterns:
+ *   rr     Each connection sends --requests requests of --size bytes, one at
+ *          a time, waiting for --response bytes back (and --think ms) before
+ *          sending the next. The server must run a program that answers,
+ *          e.g. cat to echo. A request's latency runs from when it is handed
+ *          to cTCP to when the last byte of its response comes out.
+ *   bulk   Each connection sends --size bytes in one go, then closes. Its
+ *          latency runs from when it is connected to when the server has
+ *          acknowledged all of it, and the FIN.
+ *
+ * A connection closes once it is done, without waiting for the server to
+ * close too: a server running a program per connection only closes when the
+ * program exits, which cat never does.
+ *
+ * Connections are opened at --rate per second, with random (exponential) gaps
+ * between them like independent clients, or all at once. Prints the latency
+ * percentiles of connecting and of requests, and throughput, over all
+ * connections. --per-conn writes the same for each connection to a file.
+ *
+ * Usage, against a server that echoes:
+ *   sudo ./ctcp -s -p 8888 --transport unix -- cat
+ *   sudo ./ctcp_load -c 8888 -n 1000 --rate 500 --requests 100 --size 64
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "ctcp.h"
+#include "ctcp_linked_list.h"
+#include "ctcp_timers.h"
+#include "ctcp_utils.h"
+#include "inet_cksum.h"
+
+/** Most bytes a connection hands to cTCP before the server acknowledges
+    them, like a socket send buffer. Keeps cTCP from reading a bulk transfer
+    all at once. */
+#define LOAD_SNDBUF (64 * 1024)
+
+/** Period of the generated streams. Prime, so it never lines up with
+    segments. */
+#define LOAD_PATTERN_LEN 65521
+
+/** Largest packet: IP and TCP headers and a full segment. */
+#define LOAD_MAX_PACKET (sizeof(struct iphdr) + sizeof(struct tcphdr) + \
+                         MAX_SEG_DATA_SIZE)
+#define LOAD_HDR_SIZE (sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+/** Localhost IP address in network order, as in the library. */
+#define LOAD_LOCALHOST 16777343
+
+/** Most packets a connection holds while the server's socket is full. Past
+    this, more are dropped, and cTCP retransmits them. */
+#define LOAD_MAX_PENDING 64
+
+/** Events handled per wakeup. */
+#define LOAD_MAX_EVENTS 256
+
+/** Workload patterns. */
+enum { LOAD_RR, LOAD_BULK };
+
+/** Where a connection is. */
+enum { LOAD_IDLE, LOAD_SYN_SENT, LOAD_ESTABLISHED, LOAD_CLOSED };
+
+/** A packet waiting for room in the server's socket. */
+typedef struct {
+  ll_link_t link;
+  uint16_t len;
+  char data[];
+} pending_pkt_t;
+
+/** One client connection. */
+struct conn {
+  int index;
+  int port;
+  int fd;
+  ctcp_state_t *state;
+  uint8_t hs_state;
+  int hs_retries;
+  long hs_rto;               /* Handshake retransmission timeout, in ms */
+  uint64_t hs_sent;          /* When the SYN was last sent, in ns */
+  uint32_t init_seqno;
+  uint32_t their_init_seqno;
+  ilist_t pending;           /* Packets not sent yet, oldest first */
+  ll_link_t link;            /* On the handshake list or the think queue */
+  struct conn *ready_next;   /* On the ready list */
+  bool on_ready;
+
+  uint64_t in_len;           /* Bytes this connection sends in all */
+  uint64_t in_avail;         /* Bytes that may be handed to cTCP by now */
+  uint64_t in_pos;           /* Bytes handed to cTCP so far */
+  uint64_t acked;            /* Bytes the server has acknowledged */
+  bool input_blocked;        /* conn_input() held back for LOAD_SNDBUF */
+  bool read_eof;
+  bool fin_acked;            /* The server has acknowledged our FIN */
+
+  uint64_t out_pos;          /* Bytes output by cTCP so far */
+  bool out_eof;
+  bool out_bad;              /* Output did not match what was sent */
+
+  int requests_done;
+  uint64_t request_ns;       /* When the current request was issued */
+  uint64_t think_until;      /* When the next request is issued */
+  uint64_t *latencies;       /* Of each request, in ns */
+
+  uint64_t start_ns;         /* When the SYN was first sent */
+  uint64_t connected_ns;     /* When the SYN-ACK came back */
+  uint64_t done_ns;          /* When the last response came back, or in
+                                bulk, when the FIN was acknowledged */
+  bool failed;
+};
+
+/** Options. */
+static int pattern_kind = LOAD_RR;
+static int num_conns = 100;
+static int num_requests = 100;
+static uint64_t request_size = 64;
+static uint64_t response_size = 0;
+static long think_ms = 0;
+static double rate = 0;
+static int window = 1;
+static bool verify = false;
+
+static int server_port = -1;
+static struct sockaddr_un server_addr;
+static int epoll_fd;
+static conn_t *conns;
+static char pattern[2 * LOAD_PATTERN_LEN];
+
+/** Connections waiting on a SYN-ACK, and waiting to send their next request
+    (in order of when it is due, since --think is the same for all). */
+static ilist_t hs_list, think_queue;
+
+/** Connections with input for cTCP to read. */
+static conn_t *ready_list = NULL;
+
+/** When ctcp_timer() was asked to be called by timer_at(), in ns. 0 if not. */
+static uint64_t timer_deadline = 0;
+
+static int num_live = 0, max_live = 0, num_closed = 0;
+
+/** Errors go here, since cTCP's chatter on stderr is thrown away. */
+static FILE *err;
+
+
+/////////////////////////////// LIBRARY FUNCTIONS /////////////////////////////
+
+/**
+ * Sends a packet to the server. If the server's socket is full, the packet
+ * waits until there is room (see conn_flush()), the way a blocking send
+ * would, without holding up the other connections.
+ *
+ * returns: 0 if sent or queued, -1 on error.
+ */
+static int send_packet(conn_t *conn, const char *pkt, uint16_t len) {
+  if (ilist_length(&conn->pending) == 0) {
+    if (send(conn->fd, pkt, len, 0) == len)
+      return 0;
+    if (errno != EAGAIN)
+      return -1;
+  }
+
+  if (ilist_length(&conn->pending) < LOAD_MAX_PENDING) {
+    pending_pkt_t *p = malloc(sizeof(pending_pkt_t) + len);
+    p->len = len;
+    memcpy(p->data, pkt, len);
+    ilist_add(&conn->pending, &p->link);
+  }
+  return 0;
+}
+
+/**
+ * Sends the packets that were waiting, until the server's socket is full
+ * again.
+ */
+static void conn_flush(conn_t *conn) {
+  ll_link_t *link;
+
+  while ((link = ilist_front(&conn->pending)) != NULL) {
+    pending_pkt_t *p = ll_entry(link, pending_pkt_t, link);
+    if (send(conn->fd, p->data, p->len, 0) < 0 && errno == EAGAIN)
+      return;
+    ilist_remove(&conn->pending, link);
+    free(p);
+  }
+}
+
+/**
+ * Whether or not a connection has nothing left to send: all its data has been
+ * handed to cTCP, and for rr, all the responses have come back too.
+ */
+static bool input_finished(conn_t *conn) {
+  return conn->in_pos == conn->in_len &&
+         (pattern_kind == LOAD_BULK || conn->requests_done == num_requests);
+}
+
+int conn_input(conn_t *conn, void *buf, size_t len) {
+  if (input_finished(conn)) {
+    conn->read_eof = true;
+    return -1;
+  }
+
+  /* Nothing issued yet, or send buffer full. */
+  uint64_t unacked = conn->in_pos - conn->acked;
+  if (conn->in_pos == conn->in_avail)
+    return 0;
+  if (unacked >= LOAD_SNDBUF) {
+    conn->input_blocked = true;
+    return 0;
+  }
+  if (len > LOAD_SNDBUF - unacked)
+    len = LOAD_SNDBUF - unacked;
+  if (len > conn->in_avail - conn->in_pos)
+    len = conn->in_avail - conn->in_pos;
+
+  /* Each connection sends the stream from its own offset. */
+  memcpy(buf, pattern + (conn->in_pos + conn->index * 131) % LOAD_PATTERN_LEN,
+         len);
+  conn->in_pos += len;
+  return len;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  char pkt[LOAD_MAX_PACKET];
+  struct iphdr *ip_hdr = (struct iphdr *) pkt;
+  struct tcphdr *tcp_hdr = (struct tcphdr *) (pkt + sizeof(struct iphdr));
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+
+  if (conn->hs_state != LOAD_ESTABLISHED || len < sizeof(ctcp_segment_t) ||
+      data_len > MAX_SEG_DATA_SIZE)
+    return -1;
+
+  /* Same translation as convert_to_datagram() in the library: the data is
+     summed once, for both checksums, and a wrong cTCP checksum makes for a
+     wrong TCP checksum. */
+  uint64_t data_sum = inet_sum_copy(pkt + LOAD_HDR_SIZE, segment->data,
+                                    data_len, 0);
+  uint16_t sum = segment->cksum;
+  segment->cksum = 0;
+  uint16_t correct_sum = inet_fold(inet_sum(segment, sizeof(ctcp_segment_t),
+                                            data_sum));
+  segment->cksum = sum;
+
+  memset(pkt, 0, LOAD_HDR_SIZE);
+  ip_hdr->ihl = 5;
+  ip_hdr->version = 4;
+  ip_hdr->tot_len = htons(LOAD_HDR_SIZE + data_len);
+  ip_hdr->id = htons(144);
+  ip_hdr->ttl = 64;
+  ip_hdr->protocol = IPPROTO_TCP;
+  ip_hdr->saddr = LOAD_LOCALHOST;
+  ip_hdr->daddr = LOAD_LOCALHOST;
+  ip_hdr->check = cksum(ip_hdr, sizeof(struct iphdr));
+
+  tcp_hdr->th_sport = htons(conn->port);
+  tcp_hdr->th_dport = htons(server_port);
+  tcp_hdr->th_seq = htonl(ntohl(segment->seqno) + conn->init_seqno);
+  tcp_hdr->th_ack = htonl(ntohl(segment->ackno) + conn->their_init_seqno);
+  tcp_hdr->th_off = sizeof(struct tcphdr) / 4;
+  tcp_hdr->th_flags = segment->flags;
+  tcp_hdr->th_win = segment->window;
+  uint64_t tcp_sum = inet_sum_pseudo(ip_hdr->saddr, ip_hdr->daddr,
+                                     IPPROTO_TCP,
+                                     sizeof(struct tcphdr) + data_len,
+                                     data_sum);
+  tcp_hdr->th_sum = inet_fold(inet_sum(tcp_hdr, sizeof(struct tcphdr),
+                                       tcp_sum));
+  tcp_hdr->th_sum += (correct_sum - sum);
+
+  return send_packet(conn, pkt, LOAD_HDR_SIZE + data_len) < 0 ? -1 : len;
+}
+
+/**
+ * Puts a connection on the ready list, for cTCP to read its input.
+ */
+static void input_ready(conn_t *conn) {
+  if (conn->on_ready || conn->state == NULL || conn->read_eof)
+    return;
+  conn->on_ready = true;
+  conn->ready_next = ready_list;
+  ready_list = conn;
+}
+
+/**
+ * Makes the next request of a connection available to cTCP.
+ */
+static void issue_request(conn_t *conn, uint64_t now) {
+  conn->request_ns = now;
+  conn->in_avail += request_size;
+  input_ready(conn);
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  uint64_t now = current_time_ns();
+
+  if (conn->out_eof)
+    return 0;
+  if (len == 0) {
+    conn->out_eof = true;
+    return 0;
+  }
+
+  /* With an echo server, the output is the stream that was sent. */
+  uint64_t pos = conn->out_pos + conn->index * 131;
+  if (verify && (conn->out_pos + len > conn->in_pos ||
+                 memcmp(buf, pattern + pos % LOAD_PATTERN_LEN, len)))
+    conn->out_bad = true;
+  conn->out_pos += len;
+
+  /* Responses that are complete. The next request goes out now, or after
+     thinking about it. */
+  while (pattern_kind == LOAD_RR && conn->requests_done < num_requests &&
+         conn->out_pos >= (conn->requests_done + 1) * response_size) {
+    conn->latencies[conn->requests_done++] = now - conn->request_ns;
+    if (conn->requests_done == num_requests) {
+      conn->done_ns = now;
+      input_ready(conn);
+    }
+    else if (think_ms > 0) {
+      conn->think_until = now + think_ms * 1000000ULL;
+      ilist_add(&think_queue, &conn->link);
+    }
+    else {
+      issue_request(conn, now);
+    }
+  }
+  return len;
+}
+
+/** Output is only counted, so there is always room. */
+size_t conn_bufspace(conn_t *conn) {
+  return LOAD_SNDBUF;
+}
+
+void conn_remove(conn_t *conn) {
+  ll_link_t *link;
+
+  while ((link = ilist_front(&conn->pending)) != NULL) {
+    ilist_remove(&conn->pending, link);
+    free(ll_entry(link, pending_pkt_t, link));
+  }
+  conn->state = NULL;
+  conn->hs_state = LOAD_CLOSED;
+  close(conn->fd);
+  num_live--;
+  num_closed++;
+}
+
+void timer_at(uint64_t when) {
+  if (timer_deadline == 0 || when < timer_deadline)
+    timer_deadline = when;
+}
+
+void end_client() {
+}
+
+
+///////////////////////////////// CONNECTIONS /////////////////////////////////
+
+/**
+ * Sends a handshake segment, which has no data: the SYN, or the ACK to the
+ * SYN-ACK.
+ */
+static void send_handshake(conn_t *conn, uint8_t flags) {
+  char pkt[LOAD_HDR_SIZE];
+  struct iphdr *ip_hdr = (struct iphdr *) pkt;
+  struct tcphdr *tcp_hdr = (struct tcphdr *) (pkt + sizeof(struct iphdr));
+
+  memset(pkt, 0, sizeof(pkt));
+  ip_hdr->ihl = 5;
+  ip_hdr->version = 4;
+  ip_hdr->tot_len = htons(LOAD_HDR_SIZE);
+  ip_hdr->id = htons(144);
+  ip_hdr->ttl = 64;
+  ip_hdr->protocol = IPPROTO_TCP;
+  ip_hdr->saddr = LOAD_LOCALHOST;
+  ip_hdr->daddr = LOAD_LOCALHOST;
+  ip_hdr->check = cksum(ip_hdr, sizeof(struct iphdr));
+
+  tcp_hdr->th_sport = htons(conn->port);
+  tcp_hdr->th_dport = htons(server_port);
+  if (flags & TH_SYN) {
+    tcp_hdr->th_seq = htonl(conn->init_seqno);
+  }
+  else {
+    tcp_hdr->th_seq = htonl(conn->init_seqno + 1);
+    tcp_hdr->th_ack = htonl(conn->their_init_seqno + 1);
+  }
+  tcp_hdr->th_off = sizeof(struct tcphdr) / 4;
+  tcp_hdr->th_flags = flags;
+  tcp_hdr->th_win = htons(window * MAX_SEG_DATA_SIZE);
+  tcp_hdr->th_sum = inet_fold(inet_sum(tcp_hdr, sizeof(struct tcphdr),
+                              inet_sum_pseudo(ip_hdr->saddr, ip_hdr->daddr,
+                                              IPPROTO_TCP,
+                                              sizeof(struct tcphdr), 0)));
+
+  send_packet(conn, pkt, sizeof(pkt));
+  if (flags & TH_SYN)
+    conn->hs_sent = current_time_ns();
+}
+
+/**
+ * Marks a connection as failed. It is closed if cTCP was not started yet;
+ * otherwise cTCP is torn down, which closes it.
+ */
+static void conn_fail(conn_t *conn) {
+  conn->failed = true;
+  if (conn->state != NULL) {
+    ctcp_destroy(conn->state);
+  }
+  else if (conn->hs_state != LOAD_CLOSED) {
+    if (conn->hs_state == LOAD_SYN_SENT)
+      ilist_remove(&hs_list, &conn->link);
+    conn_remove(conn);
+  }
+}
+
+/**
+ * Opens a connection: sets up its socket and sends the SYN.
+ *
+ * returns: 0 on success, -1 if the socket could not be set up.
+ */
+static int conn_start(conn_t *conn, int port) {
+  struct sockaddr_un addr;
+
+  conn->port = port;
+  conn->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/%d", port);
+  unlink(addr.sun_path);
+  /* Connected to the server, so that EPOLLOUT says when its socket has
+     room. */
+  if (conn->fd < 0 ||
+      bind(conn->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      connect(conn->fd, (struct sockaddr *) &server_addr,
+              sizeof(server_addr)) < 0) {
+    fprintf(err, "[ERROR] Could not connect from port %d: %s\n", port,
+            strerror(errno));
+    if (conn->fd >= 0)
+      close(conn->fd);
+    conn->failed = true;
+    conn->hs_state = LOAD_CLOSED;
+    num_closed++;
+    return -1;
+  }
+
+  struct epoll_event ev = { EPOLLIN | EPOLLOUT | EPOLLET, { .ptr = conn } };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+  if (++num_live > max_live)
+    max_live = num_live;
+
+  conn->init_seqno = rand();
+  conn->hs_state = LOAD_SYN_SENT;
+  conn->hs_rto = SYN_RTO_INIT;
+  ilist_add(&hs_list, &conn->link);
+  send_handshake(conn, TH_SYN);
+  conn->start_ns = conn->hs_sent;
+  return 0;
+}
+
+/**
+ * Resends SYNs that have not been answered, backing off exponentially. Gives
+ * up on a connection after SYN_MAX_RETRIES tries.
+ */
+static void handshake_timer(uint64_t now) {
+  ll_link_t *link, *next;
+
+  for (link = ilist_front(&hs_list); link != NULL; link = next) {
+    conn_t *conn = ll_entry(link, conn_t, link);
+    next = link->next;
+    if (now - conn->hs_sent < conn->hs_rto * 1000000ULL)
+      continue;
+
+    if (conn->hs_retries >= SYN_MAX_RETRIES) {
+      conn_fail(conn);
+      continue;
+    }
+    conn->hs_retries++;
+    conn->hs_rto *= 2;
+    if (conn->hs_rto > SYN_RTO_MAX)
+      conn->hs_rto = SYN_RTO_MAX;
+    send_handshake(conn, TH_SYN);
+  }
+}
+
+/**
+ * Handles the server's SYN-ACK: sends the ACK and starts cTCP.
+ */
+static void conn_established(conn_t *conn, struct tcphdr *synack) {
+  /* Our ACK was lost, and the server resent its SYN-ACK. */
+  if (conn->hs_state == LOAD_ESTABLISHED) {
+    send_handshake(conn, TH_ACK);
+    return;
+  }
+  if (conn->hs_state != LOAD_SYN_SENT ||
+      ntohl(synack->th_ack) != conn->init_seqno + 1)
+    return;
+
+  ilist_remove(&hs_list, &conn->link);
+  conn->their_init_seqno = ntohl(synack->th_seq);
+  conn->hs_state = LOAD_ESTABLISHED;
+  conn->connected_ns = current_time_ns();
+  send_handshake(conn, TH_ACK);
+
+  ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+  cfg->recv_window = window * MAX_SEG_DATA_SIZE;
+  cfg->send_window = ntohs(synack->th_win);
+  cfg->timer = TIMER_INTERVAL;
+  cfg->rt_timeout = RT_INTERVAL;
+  conn->state = ctcp_init(conn, cfg);
+  if (conn->state == NULL) {
+    conn_fail(conn);
+    return;
+  }
+
+  if (pattern_kind == LOAD_BULK) {
+    conn->in_avail = conn->in_len;
+    input_ready(conn);
+  }
+  else {
+    issue_request(conn, conn->connected_ns);
+  }
+}
+
+/**
+ * Handles a packet from the server.
+ */
+static void handle_packet(conn_t *conn, char *pkt, int len) {
+  struct iphdr *ip_hdr = (struct iphdr *) pkt;
+  struct tcphdr *tcp_hdr = (struct tcphdr *) (pkt + sizeof(struct iphdr));
+
+  if (len < LOAD_HDR_SIZE || ntohs(ip_hdr->tot_len) > len ||
+      ntohs(ip_hdr->tot_len) < LOAD_HDR_SIZE)
+    return;
+
+  /* The server gave up on the connection. */
+  if (tcp_hdr->th_flags & TH_RST) {
+    conn_fail(conn);
+    return;
+  }
+  if (tcp_hdr->th_flags & TH_SYN) {
+    if (tcp_hdr->th_flags & TH_ACK)
+      conn_established(conn, tcp_hdr);
+    return;
+  }
+  if (conn->state == NULL)
+    return;
+
+  /* Same translation as convert_to_ctcp() in the library. */
+  uint16_t data_len = ntohs(ip_hdr->tot_len) - LOAD_HDR_SIZE;
+  uint16_t seg_len = sizeof(ctcp_segment_t) + data_len;
+  ctcp_segment_t *segment = calloc(seg_len, 1);
+  segment->seqno = htonl(ntohl(tcp_hdr->th_seq) - conn->their_init_seqno);
+  segment->ackno = htonl(ntohl(tcp_hdr->th_ack) - conn->init_seqno);
+  segment->len = htons(seg_len);
+  segment->flags = tcp_hdr->th_flags;
+  segment->window = tcp_hdr->th_win;
+  uint64_t data_sum = inet_sum_copy(segment->data, pkt + LOAD_HDR_SIZE,
+                                    data_len, 0);
+  segment->cksum = inet_fold(inet_sum(segment, sizeof(ctcp_segment_t),
+                                      data_sum));
+
+  uint16_t sum = tcp_hdr->th_sum;
+  tcp_hdr->th_sum = 0;
+  uint16_t correct_sum = inet_fold(inet_sum(tcp_hdr, sizeof(struct tcphdr),
+                                   inet_sum_pseudo(ip_hdr->saddr,
+                                                   ip_hdr->daddr, IPPROTO_TCP,
+                                                   sizeof(struct tcphdr) +
+                                                   data_len, data_sum)));
+  segment->cksum += (correct_sum - sum);
+
+  /* What the server has acknowledged makes room in the send buffer. Sequence
+     numbers start at 1, and the FIN takes one too. */
+  uint32_t ackno = ntohl(segment->ackno);
+  if ((segment->flags & TH_ACK) && sum == correct_sum && ackno > 0 &&
+      ackno - 1 > conn->acked) {
+    conn->acked = ackno - 1 < conn->in_pos ? ackno - 1 : conn->in_pos;
+    if (conn->input_blocked) {
+      conn->input_blocked = false;
+      input_ready(conn);
+    }
+  }
+  if ((segment->flags & TH_ACK) && sum == correct_sum && conn->read_eof &&
+      ackno - 1 > conn->in_pos && !conn->fin_acked) {
+    conn->fin_acked = true;
+    if (pattern_kind == LOAD_BULK) {
+      conn->latencies[0] = current_time_ns() - conn->connected_ns;
+      conn->requests_done = 1;
+      conn->done_ns = current_time_ns();
+    }
+  }
+
+  ctcp_receive(conn->state, segment, seg_len);
+
+  /* Done, so close without waiting for the server to. */
+  if (conn->state != NULL && conn->done_ns != 0 && conn->fin_acked)
+    ctcp_destroy(conn->state);
+}
+
+/**
+ * Reads every packet waiting on a connection's socket.
+ */
+static void conn_recv(conn_t *conn) {
+  char pkt[LOAD_MAX_PACKET];
+  int r;
+
+  while (conn->hs_state != LOAD_CLOSED &&
+         (r = recv(conn->fd, pkt, sizeof(pkt), 0)) >= 0)
+    handle_packet(conn, pkt, r);
+}
+
+
+//////////////////////////////////// REPORT ///////////////////////////////////
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Gets a percentile of sorted values, by nearest rank, in us.
+ */
+static double percentile_us(uint64_t *sorted, size_t n, double p) {
+  if (n == 0)
+    return 0;
+  size_t rank = ceil(p / 100 * n);
+  return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+/**
+ * Prints the percentiles of some latencies, as key: value lines starting with
+ * name. Sorts them.
+ */
+static void print_percentiles(const char *name, uint64_t *values, size_t n) {
+  static const double ps[] = { 50, 90, 99, 99.9 };
+  static const char *p_names[] = { "p50", "p90", "p99", "p999" };
+  uint64_t total = 0;
+  size_t i;
+
+  qsort(values, n, sizeof(uint64_t), cmp_u64);
+  for (i = 0; i < n; i++)
+    total += values[i];
+  for (i = 0; i < sizeof(ps) / sizeof(ps[0]); i++)
+    printf("%s_%s_us: %.1f\n", name, p_names[i], percentile_us(values, n,
+                                                               ps[i]));
+  printf("%s_max_us: %.1f\n", name, n ? values[n - 1] / 1000.0 : 0);
+  printf("%s_mean_us: %.1f\n", name, n ? (double) total / n / 1000.0 : 0);
+}
+
+/**
+ * Whether or not a connection did all it was meant to.
+ */
+static bool conn_ok(conn_t *conn) {
+  return !conn->failed && !conn->out_bad && conn->done_ns != 0;
+}
+
+/**
+ * Writes a tab-separated line per connection, with its own percentiles.
+ */
+static int write_per_conn(const char *path) {
+  FILE *f = fopen(path, "w");
+  int i;
+
+  if (f == NULL) {
+    fprintf(err, "[ERROR] Could not open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fprintf(f, "conn\tport\tresult\trequests\tsent_bytes\treceived_bytes\t"
+             "connect_us\tp50_us\tp99_us\tmax_us\tduration_ms\n");
+  for (i = 0; i < num_conns; i++) {
+    conn_t *conn = &conns[i];
+    uint64_t *lat = conn->latencies;
+    size_t n = conn->requests_done;
+
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    fprintf(f, "%d\t%d\t%s\t%zu\t%llu\t%llu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+            i, conn->port, conn_ok(conn) ? "ok" : (conn->out_bad ? "corrupt" :
+                                                   "failed"),
+            n, (unsigned long long) conn->acked,
+            (unsigned long long) conn->out_pos,
+            conn->connected_ns ? (conn->connected_ns - conn->start_ns) /
+                                 1000.0 : 0,
+            percentile_us(lat, n, 50), percentile_us(lat, n, 99),
+            n ? lat[n - 1] / 1000.0 : 0,
+            conn->done_ns ? (conn->done_ns - conn->start_ns) / 1e6 : 0);
+  }
+  fclose(f);
+  return 0;
+}
+
+
+///////////////////////////////////// MAIN ////////////////////////////////////
+
+/**
+ * Random gap until the next connection, for arrivals at the given rate.
+ */
+static uint64_t arrival_gap(double per_sec) {
+  double u = (rand() + 1.0) / ((double) RAND_MAX + 2.0);
+  return -log(u) / per_sec * 1e9;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   -c server_port\n"
+    "   [-n connections]\n"
+    "   [-p first_client_port]\n"
+    "   [--pattern rr|bulk]\n"
+    "   [--rate connections_per_second]\n"
+    "   [--requests requests_per_connection]  [rr only]\n"
+    "   [--size bytes]\n"
+    "   [--response bytes]                    [rr only]\n"
+    "   [--think ms]                          [rr only]\n"
+    "   [-w window_size]\n"
+    "   [--verify]\n"
+    "   [--per-conn file]\n"
+    "   [--seed seed]\n"
+    "   [--time-limit seconds]\n"
+    "   [-d]\n\n",
+    progname
+  );
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = argv[0];
+  int first_port = 20000;
+  unsigned long seed = 144;
+  long time_limit = 60;
+  const char *per_conn_path = NULL;
+  bool debug = false;
+  int opt, i;
+
+  static struct option o[] = {
+    { "server", required_argument, NULL, 'c' },
+    { "conns", required_argument, NULL, 'n' },
+    { "port", required_argument, NULL, 'p' },
+    { "pattern", required_argument, NULL, 'P' },
+    { "rate", required_argument, NULL, 'r' },
+    { "requests", required_argument, NULL, 'q' },
+    { "size", required_argument, NULL, 's' },
+    { "response", required_argument, NULL, 'R' },
+    { "think", required_argument, NULL, 't' },
+    { "window", required_argument, NULL, 'w' },
+    { "verify", no_argument, NULL, 'v' },
+    { "per-conn", required_argument, NULL, 'o' },
+    { "seed", required_argument, NULL, 'e' },
+    { "time-limit", required_argument, NULL, 'l' },
+    { "debug", no_argument, NULL, 'd' },
+    { NULL, 0, NULL, 0 }
+  };
+  while ((opt = getopt_long(argc, argv, "c:n:p:w:d", o, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      /* Unix sockets only reach this machine, so only the port matters. */
+      server_port = atoi(strchr(optarg, ':') ? strchr(optarg, ':') + 1 :
+                         optarg);
+      break;
+    case 'n':
+      num_conns = atoi(optarg);
+      break;
+    case 'p':
+      first_port = atoi(optarg);
+      break;
+    case 'P':
+      if (strcmp(optarg, "rr") == 0)
+        pattern_kind = LOAD_RR;
+      else if (strcmp(optarg, "bulk") == 0)
+        pattern_kind = LOAD_BULK;
+      else
+        usage(progname);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'q':
+      num_requests = atoi(optarg);
+      break;
+    case 's':
+      request_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'R':
+      response_size = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      think_ms = atol(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'v':
+      verify = true;
+      break;
+    case 'o':
+      per_conn_path = optarg;
+      break;
+    case 'e':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      time_limit = atol(optarg);
+      break;
+    case 'd':
+      debug = true;
+      break;
+    default:
+      usage(progname);
+    }
+  }
+  if (response_size == 0)
+    response_size = request_size;
+  if (pattern_kind == LOAD_BULK)
+    num_requests = 1;
+  if (server_port <= 0 || server_port > 65535 || num_conns <= 0 ||
+      first_port <= 0 || first_port + num_conns - 1 > 65535 ||
+      (server_port >= first_port && server_port < first_port + num_conns) ||
+      num_requests <= 0 || request_size == 0 || rate < 0 || think_ms < 0 ||
+      window <= 0 || window * MAX_SEG_DATA_SIZE > UINT16_MAX ||
+      time_limit <= 0)
+    usage(progname);
+
+  /* One socket per connection. */
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  if (rl.rlim_cur < (rlim_t) num_conns + 16) {
+    fprintf(stderr, "[ERROR] Can only open %llu files, not enough for %d "
+                    "connections\n", (unsigned long long) rl.rlim_cur,
+            num_conns);
+    return 2;
+  }
+
+  /* The streams, twice over so any run of them can be copied in one go. */
+  uint64_t x = seed;
+  for (i = 0; i < LOAD_PATTERN_LEN; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    pattern[i] = pattern[i + LOAD_PATTERN_LEN] = x >> 56;
+  }
+  srand(seed);
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sun_family = AF_UNIX;
+  snprintf(server_addr.sun_path, sizeof(server_addr.sun_path), "/%d",
+           server_port);
+
+  conns = calloc(num_conns, sizeof(conn_t));
+  for (i = 0; i < num_conns; i++) {
+    conns[i].index = i;
+    conns[i].fd = -1;
+    ilist_init(&conns[i].pending);
+    conns[i].in_len = request_size * num_requests;
+    conns[i].latencies = calloc(num_requests, sizeof(uint64_t));
+  }
+  ilist_init(&hs_list);
+  ilist_init(&think_queue);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  signal(SIGPIPE, SIG_IGN);
+
+  /* cTCP is chatty on stderr. */
+  err = fdopen(dup(STDERR_FILENO), "w");
+  setvbuf(err, NULL, _IONBF, 0);
+  if (!debug)
+    freopen("/dev/null", "w", stderr);
+
+  struct epoll_event evs[LOAD_MAX_EVENTS];
+  uint64_t start = current_time_ns();
+  uint64_t end_by = start + time_limit * 1000000000ULL;
+  uint64_t next_arrival = start;
+  uint64_t next_timer = start + TIMER_INTERVAL * 1000000ULL;
+  int num_started = 0;
+
+  while (num_closed < num_conns) {
+    uint64_t now = current_time_ns();
+    if (now >= end_by)
+      break;
+
+    /* New connections, all at once or at the rate asked for. */
+    while (num_started < num_conns && now >= next_arrival) {
+      conn_start(&conns[num_started], first_port + num_started);
+      num_started++;
+      if (rate > 0)
+        next_arrival += arrival_gap(rate);
+    }
+
+    /* Requests done thinking. */
+    ll_link_t *link;
+    while ((link = ilist_front(&think_queue)) != NULL &&
+           ll_entry(link, conn_t, link)->think_until <= now) {
+      conn_t *conn = ll_entry(link, conn_t, link);
+      ilist_remove(&think_queue, link);
+      if (conn->state != NULL)
+        issue_request(conn, conn->think_until);
+    }
+
+    /* Input for cTCP. */
+    while (ready_list != NULL) {
+      conn_t *conn = ready_list;
+      ready_list = conn->ready_next;
+      conn->on_ready = false;
+      if (conn->state != NULL)
+        ctcp_read(conn->state);
+    }
+
+    /* The regular timer, or one asked for with timer_at(). */
+    now = current_time_ns();
+    if (now >= next_timer || (timer_deadline != 0 && now >= timer_deadline)) {
+      if (now >= next_timer) {
+        handshake_timer(now);
+        next_timer = now + TIMER_INTERVAL * 1000000ULL;
+      }
+      timer_deadline = 0;
+      ctcp_timer();
+      continue;
+    }
+
+    /* Sleep until the next of those is due. */
+    uint64_t deadline = next_timer;
+    if (timer_deadline != 0 && timer_deadline < deadline)
+      deadline = timer_deadline;
+    if (num_started < num_conns && next_arrival < deadline)
+      deadline = next_arrival;
+    if ((link = ilist_front(&think_queue)) != NULL &&
+        ll_entry(link, conn_t, link)->think_until < deadline)
+      deadline = ll_entry(link, conn_t, link)->think_until;
+    int timeout = ready_list ? 0 : (deadline - now + 999999) / 1000000;
+
+    int n = epoll_wait(epoll_fd, evs, LOAD_MAX_EVENTS, timeout);
+    for (i = 0; i < n; i++) {
+      conn_t *conn = evs[i].data.ptr;
+      if ((evs[i].events & EPOLLOUT) && conn->hs_state != LOAD_CLOSED)
+        conn_flush(conn);
+      if (evs[i].events & EPOLLIN)
+        conn_recv(conn);
+    }
+  }
+  uint64_t end = current_time_ns();
+
+  /* Totals. The run lasts from the first SYN until the last response; the
+     wait for connections to close is left out. */
+  uint64_t first = 0, last = 0, sent = 0, received = 0;
+  size_t num_lat = 0, num_connected = 0;
+  int num_ok = 0, num_corrupt = 0;
+  uint64_t *all_lat = malloc(((size_t) num_conns * num_requests + 1) *
+                             sizeof(uint64_t));
+  uint64_t *connect_lat = malloc((num_conns + 1) * sizeof(uint64_t));
+  for (i = 0; i < num_conns; i++) {
+    conn_t *conn = &conns[i];
+    if (conn->start_ns && (first == 0 || conn->start_ns < first))
+      first = conn->start_ns;
+    if (conn->done_ns > last)
+      last = conn->done_ns;
+    if (conn->connected_ns)
+      connect_lat[num_connected++] = conn->connected_ns - conn->start_ns;
+    memcpy(all_lat + num_lat, conn->latencies,
+           conn->requests_done * sizeof(uint64_t));
+    num_lat += conn->requests_done;
+    sent += conn->acked;
+    received += conn->out_pos;
+    num_ok += conn_ok(conn);
+    num_corrupt += conn->out_bad;
+  }
+  if (last == 0)
+    last = end;
+  double duration = first ? (last - first) / 1e9 : 0;
+
+  printf("pattern: %s\n", pattern_kind == LOAD_RR ? "rr" : "bulk");
+  printf("connections: %d\n", num_conns);
+  printf("connections_ok: %d\n", num_ok);
+  printf("connections_failed: %d\n", num_conns - num_ok);
+  if (verify)
+    printf("connections_corrupt: %d\n", num_corrupt);
+  printf("max_concurrent: %d\n", max_live);
+  printf("requests: %zu\n", num_lat);
+  printf("duration_s: %.3f\n", duration);
+  printf("requests_per_s: %.1f\n", duration > 0 ? num_lat / duration : 0);
+  printf("sent_mbps: %.3f\n", duration > 0 ? sent * 8 / duration / 1e6 : 0);
+  printf("received_mbps: %.3f\n",
+         duration > 0 ? received * 8 / duration / 1e6 : 0);
+  print_percentiles("connect", connect_lat, num_connected);
+  print_percentiles("latency", all_lat, num_lat);
+  if (end >= end_by)
+    printf("time_limit_reached: %d connections not closed\n",
+           num_conns - num_closed);
+
+  if (per_conn_path != NULL && write_per_conn(per_conn_path) < 0)
+    return 2;
+  return num_ok == num_conns ? 0 : 1;
+}
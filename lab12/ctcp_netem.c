@@ -0,0 +1,340 @@
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
+
+#include "ctcp_netem.h"
+
+/** A packet waiting to be sent. */
+struct netem_pkt {
+  long due;                       /* When to send it, in ms */
+  unsigned long order;            /* Keeps packets due at once in order */
+  size_t len;
+  socklen_t addr_len;
+  struct sockaddr_storage addr;
+  char buf[1];
+};
+typedef struct netem_pkt netem_pkt_t;
+
+struct netem {
+  netem_config_t cfg;
+  netem_stats_t stats;
+  uint64_t rand_state;            /* xorshift64* state */
+  bool bad_state;                 /* Gilbert-Elliott state */
+  double link_free;               /* When the rate-limited link is idle, in ms */
+  unsigned long order;
+
+  /* Packets waiting, as a min-heap on (due, order). */
+  netem_pkt_t **heap;
+  int count;
+  int size;
+};
+
+
+////////////////////////////////// RANDOMNESS /////////////////////////////////
+
+/**
+ * Returns a random number in [0, 1). The emulator has its own generator so that
+ * runs with the same seed are the same, whatever else calls rand().
+ */
+static double netem_rand(netem_t *netem) {
+  netem->rand_state ^= netem->rand_state >> 12;
+  netem->rand_state ^= netem->rand_state << 25;
+  netem->rand_state ^= netem->rand_state >> 27;
+  return ((netem->rand_state * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+/**
+ * Returns true with the given chance.
+ *
+ * percent: The chance, out of 100.
+ */
+static bool netem_chance(netem_t *netem, double percent) {
+  return percent > 0 && netem_rand(netem) * 100 < percent;
+}
+
+/**
+ * Picks a delay for a packet from the model.
+ *
+ * returns: The delay, in ms. Never negative.
+ */
+static double netem_delay(netem_t *netem) {
+  netem_config_t *cfg = &netem->cfg;
+  double d = cfg->delay;
+  double u;
+
+  if (cfg->jitter) {
+    switch (cfg->dist) {
+    case NETEM_UNIFORM:
+      d += cfg->jitter * (2 * netem_rand(netem) - 1);
+      break;
+    /* Box-Muller. */
+    case NETEM_NORMAL:
+      u = 1 - netem_rand(netem);
+      d += cfg->jitter * sqrt(-2 * log(u)) * cos(2 * M_PI * netem_rand(netem));
+      break;
+    /* Shape 3, shifted to start at 0, so the mean of the tail is jitter/2. */
+    case NETEM_PARETO:
+      u = 1 - netem_rand(netem);
+      d += cfg->jitter * (pow(u, -1.0 / 3) - 1);
+      break;
+    }
+  }
+  return d > 0 ? d : 0;
+}
+
+/**
+ * Decides whether the next packet is lost, moving the Gilbert-Elliott chain a
+ * step if it is in use.
+ */
+static bool netem_lost(netem_t *netem) {
+  netem_config_t *cfg = &netem->cfg;
+
+  if (cfg->ge_p == 0)
+    return netem_chance(netem, cfg->loss);
+
+  if (netem->bad_state ? netem_chance(netem, cfg->ge_r) :
+                         netem_chance(netem, cfg->ge_p))
+    netem->bad_state = !netem->bad_state;
+  return netem_chance(netem, netem->bad_state ? cfg->ge_loss_bad :
+                                                cfg->ge_loss_good);
+}
+
+
+///////////////////////////////// DELAY QUEUE /////////////////////////////////
+
+static inline bool pkt_before(netem_pkt_t *a, netem_pkt_t *b) {
+  return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+int netem_schedule(netem_t *netem, long due, const void *buf, size_t len,
+                   const struct sockaddr *addr, socklen_t addr_len) {
+  if (netem->count == netem->size) {
+    int size = netem->size ? netem->size * 2 : 64;
+    netem_pkt_t **heap = realloc(netem->heap, size * sizeof(netem_pkt_t *));
+    if (heap == NULL)
+      return -1;
+    netem->heap = heap;
+    netem->size = size;
+  }
+
+  netem_pkt_t *pkt = malloc(offsetof(netem_pkt_t, buf) + len);
+  if (pkt == NULL)
+    return -1;
+  pkt->due = due;
+  pkt->order = netem->order++;
+  pkt->len = len;
+  pkt->addr_len = addr_len;
+  memcpy(&pkt->addr, addr, addr_len);
+  memcpy(pkt->buf, buf, len);
+
+  /* Sift up. */
+  int i = netem->count++;
+  while (i > 0 && pkt_before(pkt, netem->heap[(i - 1) / 2])) {
+    netem->heap[i] = netem->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  netem->heap[i] = pkt;
+  return 0;
+}
+
+/**
+ * Removes the packet that is due first.
+ */
+static netem_pkt_t *netem_pop(netem_t *netem) {
+  netem_pkt_t *top = netem->heap[0];
+  netem_pkt_t *last = netem->heap[--netem->count];
+  int i = 0;
+
+  /* Sift down. */
+  while (2 * i + 1 < netem->count) {
+    int child = 2 * i + 1;
+    if (child + 1 < netem->count &&
+        pkt_before(netem->heap[child + 1], netem->heap[child]))
+      child++;
+    if (!pkt_before(netem->heap[child], last))
+      break;
+    netem->heap[i] = netem->heap[child];
+    i = child;
+  }
+  netem->heap[i] = last;
+  return top;
+}
+
+long netem_run(netem_t *netem, long now, netem_send_t send) {
+  while (netem->count > 0 && netem->heap[0]->due <= now) {
+    netem_pkt_t *pkt = netem_pop(netem);
+    send(pkt->buf, pkt->len, (struct sockaddr *) &pkt->addr, pkt->addr_len);
+    free(pkt);
+  }
+  return netem->count > 0 ? netem->heap[0]->due - now : -1;
+}
+
+
+//////////////////////////////////// MODEL ////////////////////////////////////
+
+int netem_enqueue(netem_t *netem, long now, const void *buf, size_t len,
+                  const struct sockaddr *addr, socklen_t addr_len) {
+  netem_config_t *cfg = &netem->cfg;
+  int copies = netem_chance(netem, cfg->duplicate) ? 2 : 1;
+  int queued = 0;
+
+  if (copies == 2)
+    netem->stats.duplicated++;
+
+  while (copies--) {
+    if (netem_lost(netem) || netem->count >= cfg->limit) {
+      netem->stats.dropped++;
+      continue;
+    }
+
+    /* Sent right away, ahead of the packets still being delayed. */
+    double due = now;
+    if (netem_chance(netem, cfg->reorder)) {
+      netem->stats.reordered++;
+    }
+    else {
+      /* Wait for the link, take the time to put the packet on it, then
+         travel. */
+      if (cfg->rate) {
+        if (netem->link_free < now)
+          netem->link_free = now;
+        netem->link_free += (double) len * 8 / cfg->rate;
+        due = netem->link_free;
+      }
+      due += netem_delay(netem);
+    }
+
+    if (netem_schedule(netem, (long) due, buf, len, addr, addr_len) < 0) {
+      netem->stats.dropped++;
+      continue;
+    }
+    netem->stats.queued++;
+    queued++;
+  }
+  return queued;
+}
+
+int netem_parse(const char *spec, netem_config_t *cfg) {
+  char copy[256];
+  char *save, *word;
+
+  memset(cfg, 0, sizeof(netem_config_t));
+  cfg->limit = NETEM_LIMIT;
+  cfg->ge_loss_bad = 100;
+  if (strlen(spec) >= sizeof(copy))
+    return -1;
+  strcpy(copy, spec);
+
+/* Whether the word is a number. */
+#define IS_NUM() (word != NULL && (isdigit(word[0]) || word[0] == '.'))
+/* Moves on to the next word, which is NULL at the end. */
+#define NEXT() (word = strtok_r(NULL, " ,", &save))
+/* Moves on to the next word and checks it is a number. */
+#define NEXT_NUM() (NEXT(), IS_NUM())
+
+  word = strtok_r(copy, " ,", &save);
+  while (word != NULL) {
+    if (!strcmp(word, "delay")) {
+      if (!NEXT_NUM())
+        return -1;
+      cfg->delay = atoi(word);
+      if (!NEXT_NUM())
+        continue;
+      cfg->jitter = atoi(word);
+      if (!NEXT())
+        break;
+      if (!strcmp(word, "uniform"))
+        cfg->dist = NETEM_UNIFORM;
+      else if (!strcmp(word, "normal"))
+        cfg->dist = NETEM_NORMAL;
+      else if (!strcmp(word, "pareto"))
+        cfg->dist = NETEM_PARETO;
+      else
+        continue;
+      NEXT();
+    }
+    else if (!strcmp(word, "rate") || !strcmp(word, "limit")) {
+      int *field = word[0] == 'r' ? &cfg->rate : &cfg->limit;
+      if (!NEXT_NUM())
+        return -1;
+      *field = atoi(word);
+      NEXT();
+    }
+    else if (!strcmp(word, "duplicate") || !strcmp(word, "reorder")) {
+      double *field = word[0] == 'd' ? &cfg->duplicate : &cfg->reorder;
+      if (!NEXT_NUM())
+        return -1;
+      *field = atof(word);
+      NEXT();
+    }
+    else if (!strcmp(word, "loss")) {
+      if (NEXT_NUM()) {
+        cfg->loss = atof(word);
+        NEXT();
+        continue;
+      }
+      if (word == NULL || strcmp(word, "gemodel"))
+        return -1;
+
+      /* P, then optionally R (default 100 - P), 1-H and 1-K. */
+      if (!NEXT_NUM())
+        return -1;
+      cfg->ge_p = atof(word);
+      cfg->ge_r = 100 - cfg->ge_p;
+      if (NEXT_NUM()) {
+        cfg->ge_r = atof(word);
+        if (NEXT_NUM()) {
+          cfg->ge_loss_bad = atof(word);
+          if (NEXT_NUM()) {
+            cfg->ge_loss_good = atof(word);
+            NEXT();
+          }
+        }
+      }
+    }
+    else {
+      return -1;
+    }
+  }
+
+#undef IS_NUM
+#undef NEXT
+#undef NEXT_NUM
+  return cfg->delay < 0 || cfg->jitter < 0 || cfg->rate < 0 ||
+         cfg->limit <= 0 ? -1 : 0;
+}
+
+
+////////////////////////////////// LIFETIME ///////////////////////////////////
+
+netem_t *netem_new(const netem_config_t *cfg, unsigned long seed) {
+  netem_t *netem = calloc(sizeof(netem_t), 1);
+  if (netem == NULL)
+    return NULL;
+  netem->cfg = *cfg;
+  if (netem->cfg.limit <= 0)
+    netem->cfg.limit = NETEM_LIMIT;
+
+  /* xorshift must not start at 0. */
+  netem->rand_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  return netem;
+}
+
+void netem_free(netem_t *netem) {
+  if (netem == NULL)
+    return;
+  while (netem->count > 0)
+    free(netem->heap[--netem->count]);
+  free(netem->heap);
+  free(netem);
+}
+
+bool netem_enabled(netem_t *netem) {
+  netem_config_t *cfg = &netem->cfg;
+  return cfg->delay || cfg->jitter || cfg->rate || cfg->reorder ||
+         cfg->duplicate || cfg->loss || cfg->ge_p;
+}
+
+const netem_stats_t *netem_stats(netem_t *netem) {
+  return &netem->stats;
+}
@@ -0,0 +1,154 @@
+/******************************************************************************
+ * ctcp_netem.h
+ * ------------
+ * A network emulator that sits between cTCP and the socket, in the spirit of
+ * Linux's tc-netem. Packets handed to it are dropped, duplicated, delayed,
+ * reordered and rate limited according to a model, then given back to be sent
+ * once they are due. It never looks at the clock itself: the caller passes in
+ * the time and runs it from its own event loop.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_NETEM_H
+#define CTCP_NETEM_H
+
+#include "ctcp_sys.h"
+
+/** Most packets waiting in the emulator, unless a limit is given. */
+#define NETEM_LIMIT 1000
+
+/** Distribution of the delay around its mean. */
+typedef enum {
+  NETEM_UNIFORM,    /* Evenly spread within delay +/- jitter */
+  NETEM_NORMAL,     /* Normal, with jitter as the standard deviation */
+  NETEM_PARETO      /* At least delay, with a heavy tail scaled by jitter */
+} netem_dist_t;
+
+/**
+ * The model. Percentages are out of 100. Zero everywhere means packets go
+ * straight through.
+ */
+struct netem_config {
+  int delay;            /* Mean one-way delay, in ms */
+  int jitter;           /* Spread of the delay, in ms */
+  netem_dist_t dist;    /* Distribution of the delay */
+  int rate;             /* Bandwidth limit, in kbit/s (0 for none) */
+  int limit;            /* Most packets waiting at once */
+  double reorder;       /* Chance a packet skips the delay */
+  double duplicate;     /* Chance a packet is sent twice */
+  double loss;          /* Chance a packet is lost, if not using gemodel */
+
+  /* Gilbert-Elliott bursty loss. Used if ge_p is set. */
+  double ge_p;          /* Chance of going from the good to the bad state */
+  double ge_r;          /* Chance of going from the bad to the good state */
+  double ge_loss_bad;   /* Chance of loss in the bad state (1-h) */
+  double ge_loss_good;  /* Chance of loss in the good state (1-k) */
+};
+typedef struct netem_config netem_config_t;
+
+/** What the emulator did to the packets handed to it. */
+struct netem_stats {
+  unsigned long queued;
+  unsigned long dropped;
+  unsigned long duplicated;
+  unsigned long reordered;
+};
+typedef struct netem_stats netem_stats_t;
+
+typedef struct netem netem_t;
+
+/**
+ * Called to send a packet once it is due.
+ *
+ * buf: The packet.
+ * len: Length of the packet.
+ * addr: Where the packet goes.
+ * addr_len: Length of the address.
+ */
+typedef void (*netem_send_t)(const void *buf, size_t len,
+                             const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Parses a model written like the arguments to tc-netem, e.g.
+ *   "delay 50 10 normal rate 1000 loss gemodel 1 25 reorder 5"
+ *
+ * Understood are:
+ *   delay MS [JITTER [uniform|normal|pareto]]
+ *   rate KBIT
+ *   limit PACKETS
+ *   loss PERCENT
+ *   loss gemodel P [R [1-H [1-K]]]
+ *   duplicate PERCENT
+ *   reorder PERCENT
+ *
+ * spec: The model.
+ * cfg: Return parameter. Filled in from the model.
+ * returns: 0 on success, -1 if the model could not be parsed.
+ */
+int netem_parse(const char *spec, netem_config_t *cfg);
+
+/**
+ * Creates an emulator.
+ *
+ * cfg: The model. Copied.
+ * seed: Seed for the emulator's own random numbers, so runs can be repeated.
+ * returns: The emulator, or NULL if out of memory.
+ */
+netem_t *netem_new(const netem_config_t *cfg, unsigned long seed);
+
+/**
+ * Frees an emulator and every packet still waiting in it.
+ */
+void netem_free(netem_t *netem);
+
+/**
+ * Whether the model does anything to packets. If not, there is no need to
+ * pass packets through netem_enqueue.
+ */
+bool netem_enabled(netem_t *netem);
+
+/**
+ * Passes a packet through the model. It may be lost, or queued once or twice
+ * to be sent later by netem_run.
+ *
+ * netem: The emulator.
+ * now: The current time, in ms.
+ * buf: The packet. Copied.
+ * len: Length of the packet.
+ * addr: Where the packet goes. Copied.
+ * addr_len: Length of the address.
+ * returns: The number of copies queued.
+ */
+int netem_enqueue(netem_t *netem, long now, const void *buf, size_t len,
+                  const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Queues a packet to be sent at a given time, leaving out the model.
+ *
+ * netem: The emulator.
+ * due: When to send the packet, in ms.
+ * buf: The packet. Copied.
+ * len: Length of the packet.
+ * addr: Where the packet goes. Copied.
+ * addr_len: Length of the address.
+ * returns: 0 on success, -1 if out of memory.
+ */
+int netem_schedule(netem_t *netem, long due, const void *buf, size_t len,
+                   const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Sends every packet that is due.
+ *
+ * netem: The emulator.
+ * now: The current time, in ms.
+ * send: Called for each packet, in the order they are due.
+ * returns: Time until the next packet is due, in ms, or -1 if none are left.
+ */
+long netem_run(netem_t *netem, long now, netem_send_t send);
+
+/**
+ * What the emulator has done so far.
+ */
+const netem_stats_t *netem_stats(netem_t *netem);
+
+#endif /* CTCP_NETEM_H */
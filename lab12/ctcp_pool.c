@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include "ctcp_pool.h"
+
+extern char **environ;
+
+/** How long to wait before starting an instance again after one could not be
+    started, in ms. Doubles each time, up to POOL_BACKOFF_MAX. */
+#define POOL_BACKOFF_MIN 10
+#define POOL_BACKOFF_MAX 1000
+
+/** Instances ready to be taken, as a stack. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t taken;        /* Signalled when an instance is taken */
+  const char *program;
+  char **argv;
+  int size;                    /* Instances to keep ready */
+  int count;                   /* Instances ready */
+  program_t progs[POOL_MAX];
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+int program_spawn(const char *program, char **argv, program_t *prog) {
+  int to_child[2], from_child[2];
+  posix_spawn_file_actions_t actions;
+
+  prog->pid = -1;
+  prog->stdin = prog->stdout = -1;
+  if (pipe2(to_child, O_CLOEXEC) < 0)
+    return -1;
+  if (pipe2(from_child, O_CLOEXEC) < 0) {
+    close(to_child[0]);
+    close(to_child[1]);
+    return -1;
+  }
+
+  /* The child gets the pipes as STDIN, STDOUT and STDERR. dup2 clears
+     O_CLOEXEC on the copies, and every other pipe end is closed on exec. */
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, to_child[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, from_child[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, from_child[1], STDERR_FILENO);
+
+  /* posix_spawn does not copy the parent's memory like fork does, so it takes
+     about as long however big the server is. */
+  int r = posix_spawnp(&prog->pid, program, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (r != 0) {
+    fprintf(stderr, "[ERROR] Could not start %s: %s\n", program, strerror(r));
+    prog->pid = -1;
+  }
+
+  /* Close fds not required by parent. */
+  close(to_child[0]);
+  close(from_child[1]);
+  prog->stdin = to_child[1];
+  prog->stdout = from_child[0];
+  return r == 0 ? 0 : -1;
+}
+
+/**
+ * Keeps the pool full. If an instance cannot be started (e.g. out of fds),
+ * waits a while before trying again, longer each time it keeps failing.
+ */
+static void *pool_main(void *arg) {
+  struct sched_param param = { 0 };
+  long backoff = 0;
+  program_t prog;
+
+  /* Refilling is background work. Don't let it preempt the event loop as
+     soon as an instance is taken. */
+  pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+
+  pthread_mutex_lock(&pool.lock);
+  while (true) {
+    while (pool.count >= pool.size)
+      pthread_cond_wait(&pool.taken, &pool.lock);
+
+    /* Start one without holding the lock, so instances can still be
+       taken. */
+    pthread_mutex_unlock(&pool.lock);
+    if (program_spawn(pool.program, pool.argv, &prog) < 0) {
+      if (prog.stdin >= 0)
+        close(prog.stdin);
+      if (prog.stdout >= 0)
+        close(prog.stdout);
+      backoff = backoff ? backoff * 2 : POOL_BACKOFF_MIN;
+      if (backoff > POOL_BACKOFF_MAX)
+        backoff = POOL_BACKOFF_MAX;
+      usleep(backoff * 1000);
+      pthread_mutex_lock(&pool.lock);
+      continue;
+    }
+    backoff = 0;
+    pthread_mutex_lock(&pool.lock);
+    pool.progs[pool.count++] = prog;
+  }
+  return NULL;
+}
+
+int pool_start(const char *program, char **argv, int size) {
+  pthread_t thread;
+
+  if (size <= 0 || size > POOL_MAX)
+    return -1;
+  pool.program = program;
+  pool.argv = argv;
+  pool.size = size;
+  if (pthread_create(&thread, NULL, pool_main, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+  return 0;
+}
+
+int pool_take(program_t *prog) {
+  int r = -1;
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.count > 0) {
+    *prog = pool.progs[--pool.count];
+    pthread_cond_signal(&pool.taken);
+    r = 0;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return r;
+}
@@ -0,0 +1,60 @@
+/******************************************************************************
+ * ctcp_pool.h
+ * -----------
+ * Starting the program a server runs for its clients, and keeping a pool of
+ * instances started ahead of time (--prefork). Forking and exec'ing takes
+ * milliseconds, which would hold up every other connection if done when a
+ * client connects. With a pool, a new connection takes an instance that is
+ * already running, and a background thread starts another in its place.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_POOL_H
+#define CTCP_POOL_H
+
+#include "ctcp_sys.h"
+
+/** Most instances a pool can hold. */
+#define POOL_MAX 1024
+
+/** A running instance of the program. */
+struct program {
+  pid_t pid;                   /* -1 if it could not be started */
+  int stdin;                   /* Write end of the program's STDIN */
+  int stdout;                  /* Read end of the program's STDOUT/STDERR */
+};
+typedef struct program program_t;
+
+/**
+ * Starts an instance of a program, with pipes to its STDIN and from its
+ * STDOUT and STDERR. If the program cannot be started, the pipes are still
+ * there but already closed at the other end, as if it exited right away; if
+ * the pipes cannot be made either, the fds are -1.
+ *
+ * program: The program, looked up in PATH.
+ * argv: Its arguments, including argv[0], ending with NULL.
+ * prog: Return parameter. The instance.
+ * returns: 0 on success, -1 if the program could not be started.
+ */
+int program_spawn(const char *program, char **argv, program_t *prog);
+
+/**
+ * Starts a pool of instances, filled and kept full by a background thread.
+ *
+ * program: The program, looked up in PATH.
+ * argv: Its arguments, including argv[0], ending with NULL. Not copied.
+ * size: Instances to keep ready, up to POOL_MAX.
+ * returns: 0 on success, -1 on failure.
+ */
+int pool_start(const char *program, char **argv, int size);
+
+/**
+ * Takes an instance from the pool, to be replaced in the background. Safe to
+ * call from any thread. Never waits for an instance to start.
+ *
+ * prog: Return parameter. The instance.
+ * returns: 0 on success, -1 if the pool is empty or not started.
+ */
+int pool_take(program_t *prog);
+
+#endif /* CTCP_POOL_H */
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ctcp_shm.h"
+
+/** Most ports a peer can have. */
+#define SHM_MAX_PORTS 65536
+
+/** A packet in a ring. */
+struct shm_slot {
+  uint32_t len;
+  char buf[SHM_SLOT_SIZE];
+};
+
+/** Packets going one way. The producer only writes head, the consumer only
+    tail, and each is on its own cache line. */
+struct shm_ring {
+  _Alignas(64) atomic_uint head;   /* Next slot to fill */
+  _Alignas(64) atomic_uint tail;   /* Next slot to empty */
+  _Alignas(64) atomic_bool idle;   /* Consumer waits for an eventfd write */
+  struct shm_slot slots[SHM_RING_LEN];
+};
+
+/** The memory shared by a client and a server. */
+struct shm_region {
+  struct shm_ring to_server;
+  struct shm_ring to_client;
+};
+
+/** Message that hands a region to the server. Carries the region's memfd,
+    the server's eventfd and the client's eventfd, in that order. */
+struct shm_hello {
+  char magic[8];
+  uint32_t port;               /* The client's port */
+};
+
+/** The rings to one peer. head and tail are kept here as well, since the
+    copies in shared memory can be changed by the peer. */
+typedef struct shm_peer {
+  struct shm_region *region;
+  struct shm_ring *tx;         /* Packets to the peer */
+  struct shm_ring *rx;         /* Packets from the peer */
+  uint32_t tx_head;
+  uint32_t rx_tail;
+  int tx_efd;                  /* Written to wake up the peer */
+  int rx_efd;                  /* Written by the peer to wake up this host */
+  int port;
+  unsigned id;                 /* Tells these rings apart from earlier ones */
+  bool ready;                  /* On the ready list */
+  bool wake;                   /* On the wake list */
+  struct shm_peer *ready_next;
+  struct shm_peer *wake_next;
+} shm_peer_t;
+
+/** epoll instance for the eventfds of all peers. Only used by the event loop,
+    which is the only thread with --transport shm. */
+static int epfd = -1;
+static shm_peer_t **peers;           /* By port */
+static shm_peer_t *ready_list = NULL;  /* May have packets waiting */
+static shm_peer_t *wake_list = NULL;   /* Sent packets since shm_flush */
+static unsigned last_id = 0;
+
+
+/**
+ * Puts a peer on the ready list, to look for packets from it.
+ */
+static void peer_ready(shm_peer_t *peer) {
+  if (peer->ready)
+    return;
+  peer->ready = true;
+  peer->ready_next = ready_list;
+  ready_list = peer;
+}
+
+/**
+ * Starts using the rings to a peer, in place of any it had before.
+ *
+ * returns: The peer, or NULL on failure.
+ */
+static shm_peer_t *peer_add(struct shm_region *region, bool is_client,
+                            int tx_efd, int rx_efd, int port) {
+  struct epoll_event ev;
+
+  if (port <= 0 || port >= SHM_MAX_PORTS)
+    return NULL;
+  if (peers[port] != NULL)
+    shm_close(port, peers[port]->id);
+
+  shm_peer_t *peer = calloc(1, sizeof(shm_peer_t));
+  peer->region = region;
+  peer->tx = is_client ? &region->to_server : &region->to_client;
+  peer->rx = is_client ? &region->to_client : &region->to_server;
+  peer->tx_head = atomic_load_explicit(&peer->tx->head, memory_order_relaxed);
+  peer->rx_tail = atomic_load_explicit(&peer->rx->tail, memory_order_relaxed);
+  peer->tx_efd = tx_efd;
+  peer->rx_efd = rx_efd;
+  peer->port = port;
+  if (++last_id == 0)
+    last_id++;
+  peer->id = last_id;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = peer;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, rx_efd, &ev) < 0) {
+    free(peer);
+    return NULL;
+  }
+  peers[port] = peer;
+
+  /* Packets may have been sent before the rings were handed over. */
+  peer_ready(peer);
+  return peer;
+}
+
+int shm_init() {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  peers = calloc(SHM_MAX_PORTS, sizeof(shm_peer_t *));
+  return epfd;
+}
+
+int shm_connect(int sock, const struct sockaddr *server, socklen_t addr_len,
+                int port, int server_port) {
+  struct shm_hello hello;
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov = { &hello, sizeof(hello) };
+  struct msghdr msg;
+
+  /* Sealed at its size, so the server can map it without the client being
+     able to shrink it from under the server later on. */
+  int memfd = memfd_create("ctcp-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0 || ftruncate(memfd, sizeof(struct shm_region)) < 0 ||
+      fcntl(memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    fprintf(stderr, "[ERROR] Could not create shared memory: %s\n",
+            strerror(errno));
+    if (memfd >= 0)
+      close(memfd);
+    return -1;
+  }
+  struct shm_region *region = mmap(NULL, sizeof(struct shm_region),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED, memfd,
+                                   0);
+  if (region == MAP_FAILED) {
+    fprintf(stderr, "[ERROR] Could not map shared memory: %s\n",
+            strerror(errno));
+    close(memfd);
+    return -1;
+  }
+
+  /* Neither side is polling its ring yet. */
+  atomic_store(&region->to_server.idle, true);
+  atomic_store(&region->to_client.idle, true);
+  int server_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  /* Hand the region and both eventfds to the server. */
+  memset(&hello, 0, sizeof(hello));
+  memcpy(hello.magic, SHM_MAGIC, sizeof(hello.magic));
+  hello.port = port;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *) server;
+  msg.msg_namelen = addr_len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  int fds[3] = { memfd, server_efd, client_efd };
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int r = server_efd < 0 || client_efd < 0 ? -1 : sendmsg(sock, &msg, 0);
+  close(memfd);
+  if (r < 0 ||
+      !peer_add(region, true, server_efd, client_efd, server_port)) {
+    fprintf(stderr, "[ERROR] Could not reach server: %s\n", strerror(errno));
+    if (server_efd >= 0)
+      close(server_efd);
+    if (client_efd >= 0)
+      close(client_efd);
+    munmap(region, sizeof(struct shm_region));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Gets the port a Unix socket is bound to, from its path "/<port>".
+ *
+ * addr: Address of the socket, as given by recvmsg().
+ * addr_len: Length of the address.
+ * returns: The port, or -1 if the socket is not bound to such a path.
+ */
+static int sender_port(const struct sockaddr_un *addr, socklen_t addr_len) {
+  size_t path_len = addr_len - offsetof(struct sockaddr_un, sun_path);
+  char path[sizeof(addr->sun_path) + 1];
+  char *end;
+
+  if (addr_len <= offsetof(struct sockaddr_un, sun_path) ||
+      addr->sun_family != AF_UNIX || addr->sun_path[0] != '/')
+    return -1;
+  if (path_len > sizeof(addr->sun_path))
+    path_len = sizeof(addr->sun_path);
+  memcpy(path, addr->sun_path, path_len);
+  path[path_len] = '\0';
+  long port = strtol(path + 1, &end, 10);
+  if (end == path + 1 || *end != '\0' || port <= 0 ||
+      port >= SHM_MAX_PORTS)
+    return -1;
+  return port;
+}
+
+/**
+ * Checks that a descriptor passed by a client is an eventfd, and makes it
+ * non-blocking. Anything else (e.g. a pipe nobody reads) could block the
+ * event loop when written to.
+ *
+ * fd: The descriptor.
+ * returns: true if it is an eventfd.
+ */
+static bool check_eventfd(int fd) {
+  static const char want[] = "anon_inode:[eventfd]";
+  char path[32], target[sizeof(want)];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(path, target, sizeof(target));
+  if (n != sizeof(want) - 1 || memcmp(target, want, n) != 0)
+    return false;
+  return fcntl(fd, F_SETFL, O_NONBLOCK) == 0;
+}
+
+/**
+ * Checks that a memfd passed by a client holds a whole region and cannot be
+ * shrunk any more. Otherwise the client could truncate it once it is mapped,
+ * and the server would get SIGBUS on its next access to the rings.
+ *
+ * fd: The memfd.
+ * returns: true if it can be mapped safely.
+ */
+static bool check_memfd(int fd) {
+  struct stat st;
+
+  int seals = fcntl(fd, F_GET_SEALS);
+  return seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &st) == 0 &&
+         st.st_size >= sizeof(struct shm_region);
+}
+
+void shm_accept(int sock) {
+  struct shm_hello hello;
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov = { &hello, sizeof(hello) };
+  struct sockaddr_un from;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int i;
+
+  while (true) {
+    memset(&msg, 0, sizeof(msg));
+    memset(&from, 0, sizeof(from));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    int r = recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (r < 0)
+      return;
+
+    /* Take whatever descriptors came along, so they are not leaked if the
+       message is no good. */
+    int fds[3] = { -1, -1, -1 };
+    int num_fds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg),
+               sizeof(int) * (num_fds < 3 ? num_fds : 3));
+      }
+    }
+
+    /* The client says which port it is, but only the path the kernel gives
+       for the sender can be trusted. Otherwise any process could take over
+       another client's rings. */
+    int port = sender_port(&from, msg.msg_namelen);
+    struct shm_region *region = MAP_FAILED;
+    if (r == sizeof(hello) && num_fds == 3 &&
+        !(msg.msg_flags & MSG_CTRUNC) && port > 0 && port == hello.port &&
+        memcmp(hello.magic, SHM_MAGIC, sizeof(hello.magic)) == 0 &&
+        check_memfd(fds[0]) && check_eventfd(fds[1]) &&
+        check_eventfd(fds[2])) {
+      region = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fds[0], 0);
+    }
+    if (region == MAP_FAILED ||
+        !peer_add(region, false, fds[2], fds[1], port)) {
+      fprintf(stderr, "[ERROR] Bad shared memory request\n");
+      if (region != MAP_FAILED)
+        munmap(region, sizeof(struct shm_region));
+      for (i = 0; i < 3; i++) {
+        if (fds[i] >= 0)
+          close(fds[i]);
+      }
+      continue;
+    }
+    close(fds[0]);
+  }
+}
+
+int shm_send(int port, const void *buf, size_t len) {
+  shm_peer_t *peer = port > 0 && port < SHM_MAX_PORTS ? peers[port] : NULL;
+  if (peer == NULL || len > SHM_SLOT_SIZE)
+    return -1;
+
+  uint32_t tail = atomic_load_explicit(&peer->tx->tail, memory_order_acquire);
+  if (peer->tx_head - tail >= SHM_RING_LEN)
+    return -1;
+  struct shm_slot *slot = &peer->tx->slots[peer->tx_head & (SHM_RING_LEN - 1)];
+  memcpy(slot->buf, buf, len);
+  slot->len = len;
+  peer->tx_head++;
+  atomic_store_explicit(&peer->tx->head, peer->tx_head, memory_order_release);
+
+  if (!peer->wake) {
+    peer->wake = true;
+    peer->wake_next = wake_list;
+    wake_list = peer;
+  }
+  return 0;
+}
+
+void shm_flush() {
+  shm_peer_t *peer;
+
+  /* Pairs with the fence in shm_recv: either the peer sees the new packets
+     before going idle, or it is seen to be idle here. */
+  if (wake_list != NULL)
+    atomic_thread_fence(memory_order_seq_cst);
+  for (peer = wake_list; peer; peer = peer->wake_next) {
+    peer->wake = false;
+    if (atomic_exchange(&peer->tx->idle, false))
+      eventfd_write(peer->tx_efd, 1);
+  }
+  wake_list = NULL;
+}
+
+int shm_recv(char *bufs, size_t size, int *lens, int max) {
+  struct epoll_event evs[64];
+  int i, n = 0;
+
+  while (n < max) {
+    /* See who has woken us up once the known ones are done. */
+    if (ready_list == NULL) {
+      int k = epoll_wait(epfd, evs, 64, 0);
+      for (i = 0; i < k; i++) {
+        shm_peer_t *peer = evs[i].data.ptr;
+        eventfd_t count;
+        eventfd_read(peer->rx_efd, &count);
+        peer_ready(peer);
+      }
+      if (ready_list == NULL)
+        break;
+    }
+
+    shm_peer_t *peer = ready_list;
+    struct shm_ring *rx = peer->rx;
+    uint32_t head = atomic_load_explicit(&rx->head, memory_order_acquire);
+
+    /* Empty (or not making sense). Go idle, unless a packet came in
+       meanwhile. */
+    if (head == peer->rx_tail || head - peer->rx_tail > SHM_RING_LEN) {
+      atomic_store_explicit(&rx->idle, true, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
+      head = atomic_load_explicit(&rx->head, memory_order_acquire);
+      if (head == peer->rx_tail || head - peer->rx_tail > SHM_RING_LEN) {
+        peer->ready = false;
+        ready_list = peer->ready_next;
+      }
+      continue;
+    }
+
+    struct shm_slot *slot = &rx->slots[peer->rx_tail & (SHM_RING_LEN - 1)];
+    char *buf = bufs + n * size;
+    size_t len = slot->len;
+    if (len > SHM_SLOT_SIZE)
+      len = SHM_SLOT_SIZE;
+    if (len > size)
+      len = size;
+    memcpy(buf, slot->buf, len);
+    memset(buf + len, 0, size - len);
+    lens[n++] = len;
+    peer->rx_tail++;
+    atomic_store_explicit(&rx->tail, peer->rx_tail, memory_order_release);
+  }
+
+  /* Take turns, so that one busy peer does not hold up the others. */
+  shm_peer_t *peer = ready_list;
+  if (peer != NULL && peer->ready_next != NULL) {
+    shm_peer_t *last = peer;
+    while (last->ready_next != NULL)
+      last = last->ready_next;
+    ready_list = peer->ready_next;
+    peer->ready_next = NULL;
+    last->ready_next = peer;
+  }
+  return n;
+}
+
+unsigned shm_rings(int port) {
+  shm_peer_t *peer = port > 0 && port < SHM_MAX_PORTS ? peers[port] : NULL;
+  return peer ? peer->id : 0;
+}
+
+void shm_close(int port, unsigned rings) {
+  shm_peer_t *peer = port > 0 && port < SHM_MAX_PORTS ? peers[port] : NULL;
+  shm_peer_t **p;
+
+  if (peer == NULL || peer->id != rings)
+    return;
+  for (p = &ready_list; *p; p = &(*p)->ready_next) {
+    if (*p == peer) {
+      *p = peer->ready_next;
+      break;
+    }
+  }
+  for (p = &wake_list; *p; p = &(*p)->wake_next) {
+    if (*p == peer) {
+      *p = peer->wake_next;
+      break;
+    }
+  }
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, peer->rx_efd, NULL);
+  close(peer->rx_efd);
+  close(peer->tx_efd);
+  munmap(peer->region, sizeof(struct shm_region));
+  peers[port] = NULL;
+  free(peer);
+}
@@ -0,0 +1,108 @@
+/******************************************************************************
+ * ctcp_shm.h
+ * ----------
+ * Shared-memory transport between a client and a server on the same machine
+ * (--transport shm). The client creates a region with two rings of packet
+ * slots, one for each direction, and hands it to the server over the server's
+ * Unix socket along with two eventfds. From then on, packets are copied into
+ * and out of the rings without system calls. Each ring has a single producer
+ * and a single consumer, and an eventfd is only written when the consumer is
+ * idle.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_SHM_H
+#define CTCP_SHM_H
+
+#include "ctcp_sys.h"
+
+/** Number of packets each ring can hold. Packets sent to a full ring are
+    dropped. Must be a power of 2. */
+#define SHM_RING_LEN 256
+
+/** Largest packet a slot can hold. */
+#define SHM_SLOT_SIZE 1536
+
+/** Start of the message that hands a region to the server. */
+#define SHM_MAGIC "CTCPSHM1"
+
+/**
+ * Sets up the transport. Must be called once before anything else.
+ *
+ * returns: A file descriptor that becomes readable when a peer has sent
+ *          packets. Use shm_recv to get them. -1 on failure.
+ */
+int shm_init();
+
+/**
+ * [Client only]
+ * Creates the rings for a server and hands them to it.
+ *
+ * sock: This host's Unix socket.
+ * server: The server's Unix socket address.
+ * addr_len: Length of the address.
+ * port: This host's port, which the server sends to.
+ * server_port: The server's port, which this host sends to.
+ * returns: 0 on success, -1 on failure.
+ */
+int shm_connect(int sock, const struct sockaddr *server, socklen_t addr_len,
+                int port, int server_port);
+
+/**
+ * [Server only]
+ * Takes the rings clients have handed over on the Unix socket, until there
+ * are no more waiting. A client that hands over new rings replaces its old
+ * ones.
+ *
+ * sock: This host's Unix socket.
+ */
+void shm_accept(int sock);
+
+/**
+ * Copies a packet into the ring to a peer. The peer is woken up by
+ * shm_flush if it is idle.
+ *
+ * port: The peer's port.
+ * buf: The packet.
+ * len: Length of the packet, up to SHM_SLOT_SIZE.
+ * returns: 0 on success, -1 if there is no such peer or its ring is full.
+ */
+int shm_send(int port, const void *buf, size_t len);
+
+/**
+ * Wakes up the peers that were sent packets while idle.
+ */
+void shm_flush();
+
+/**
+ * Copies packets out of the rings from peers, up to max. Copying them out
+ * right away means a peer cannot change a packet while it is handled.
+ *
+ * bufs: Return parameter. max buffers of size bytes, one after the other.
+ *       Packets are cut to size, and the rest of each buffer is zeroed.
+ * size: Size of each buffer.
+ * lens: Return parameter. Length of each packet.
+ * max: Most packets to receive.
+ * returns: Number of packets received. Less than max once all rings are
+ *          empty, until the descriptor from shm_init is readable again.
+ */
+int shm_recv(char *bufs, size_t size, int *lens, int max);
+
+/**
+ * Tells which rings are used for a peer. A peer that hands over new rings
+ * gets a new ID.
+ *
+ * port: The peer's port.
+ * returns: The ID of the rings, or 0 if there are none.
+ */
+unsigned shm_rings(int port);
+
+/**
+ * Unmaps the rings to a peer, unless they have been replaced since.
+ *
+ * port: The peer's port.
+ * rings: ID of the rings from shm_rings.
+ */
+void shm_close(int port, unsigned rings);
+
+#endif /* CTCP_SHM_H */
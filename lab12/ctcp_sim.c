@@ -0,0 +1,344 @@
+/******************************************************************************
+ * ctcp_sim.c
+ * ----------
+ * Simulation harness for cTCP, built as ctcp_sim with -DCTCP_SIM. Runs a
+ * client and a server cTCP state in one process, connected by a simulated
+ * link in each direction (see ctcp_netem.h), under a virtual clock that jumps
+ * straight to the next event. There are no sockets, no handshake and no
+ * sleeping, so a long transfer finishes as fast as the CPU allows, and a run
+ * is the same every time for a given seed.
+ *
+ * The client sends a stream of generated bytes, and the server checks every
+ * byte it outputs against the same stream.
+ *
+ *****************************************************************************/
+
+#include <getopt.h>
+
+#include "ctcp.h"
+#include "ctcp_netem.h"
+#include "ctcp_timers.h"
+#include "ctcp_utils.h"
+
+/** Most bytes the client can read ahead of what the server has output, like
+    a socket send buffer. Keeps cTCP from reading the whole stream at once. */
+#define SIM_SNDBUF (64 * 1024)
+
+/** Period of the generated stream. Prime, so it never lines up with
+    segments. */
+#define SIM_PATTERN_LEN 65521
+
+/** Stop after this much virtual time, in ms, if not done by then. */
+#define SIM_TIME_LIMIT (24L * 3600 * 1000)
+
+/** Once one end is gone, stop when nothing has been in flight for this long,
+    in ms. The other end has given up too, or never will. */
+#define SIM_LINGER (10 * 1000)
+
+/** One end of the simulated connection. */
+struct conn {
+  ctcp_state_t *state;
+  struct conn *peer;
+  netem_t *link;          /* Link towards the peer */
+
+  uint64_t in_len;        /* Bytes this end sends */
+  uint64_t in_pos;        /* Bytes read by cTCP so far */
+  bool read_eof;
+
+  uint64_t out_pos;       /* Bytes output by cTCP so far */
+  bool out_eof;
+  bool out_bad;           /* Output did not match the stream */
+  bool removed;
+};
+
+/** The virtual clock, in ms. */
+static long sim_now = 0;
+
+/** When ctcp_timer() was asked to be called by timer_at(), in ms. -1 if not. */
+static long sim_deadline = -1;
+
+static conn_t client, server;
+static char pattern[2 * SIM_PATTERN_LEN];
+static unsigned long num_delivered = 0;
+
+
+///////////////////////////////// VIRTUAL TIME ////////////////////////////////
+
+long current_time() {
+  return sim_now;
+}
+
+uint64_t current_time_ns() {
+  return sim_now * 1000000ULL;
+}
+
+void timer_at(uint64_t when) {
+  /* Round up to the virtual clock's resolution. */
+  long ms = (when + 999999) / 1000000;
+  if (sim_deadline < 0 || ms < sim_deadline)
+    sim_deadline = ms;
+}
+
+
+/////////////////////////////// LIBRARY FUNCTIONS /////////////////////////////
+
+int conn_input(conn_t *conn, void *buf, size_t len) {
+  if (conn->in_pos == conn->in_len) {
+    conn->read_eof = true;
+    return -1;
+  }
+
+  /* Send buffer full. */
+  uint64_t unread = conn->in_pos - conn->peer->out_pos;
+  if (unread >= SIM_SNDBUF)
+    return 0;
+  if (len > SIM_SNDBUF - unread)
+    len = SIM_SNDBUF - unread;
+  if (len > conn->in_len - conn->in_pos)
+    len = conn->in_len - conn->in_pos;
+
+  memcpy(buf, pattern + conn->in_pos % SIM_PATTERN_LEN, len);
+  conn->in_pos += len;
+  return len;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  /* The link only cares about the packet, but wants somewhere to send it. */
+  struct sockaddr addr = { AF_UNSPEC };
+  netem_enqueue(conn->link, sim_now, segment, len, &addr, sizeof(addr));
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  if (conn->out_eof)
+    return 0;
+  if (len == 0) {
+    conn->out_eof = true;
+    return 0;
+  }
+
+  /* Check against the stream the other end sent. */
+  if (conn->out_pos + len > conn->peer->in_len ||
+      memcmp(buf, pattern + conn->out_pos % SIM_PATTERN_LEN, len))
+    conn->out_bad = true;
+  conn->out_pos += len;
+  return len;
+}
+
+/** Output is consumed right away, so there is always room. */
+size_t conn_bufspace(conn_t *conn) {
+  return SIM_SNDBUF;
+}
+
+void conn_remove(conn_t *conn) {
+  conn->removed = true;
+  conn->state = NULL;
+}
+
+void end_client() {
+}
+
+
+///////////////////////////////////// LINKS ///////////////////////////////////
+
+/**
+ * Hands a segment that came off a link to cTCP, which frees it.
+ */
+static void deliver(conn_t *conn, const void *buf, size_t len) {
+  num_delivered++;
+  if (conn->removed)
+    return;
+  ctcp_segment_t *segment = malloc(len);
+  memcpy(segment, buf, len);
+  ctcp_receive(conn->state, segment, len);
+}
+
+static void deliver_to_client(const void *buf, size_t len,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+  deliver(&client, buf, len);
+}
+
+static void deliver_to_server(const void *buf, size_t len,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+  deliver(&server, buf, len);
+}
+
+/**
+ * Delivers every segment due by now, including the ones sent in reply.
+ *
+ * returns: Time of the next delivery, or -1 if nothing is in flight.
+ */
+static long run_links() {
+  long to_server, to_client;
+  unsigned long before;
+
+  do {
+    before = num_delivered;
+    to_server = netem_run(client.link, sim_now, deliver_to_server);
+    to_client = netem_run(server.link, sim_now, deliver_to_client);
+  } while (num_delivered != before);
+
+  if (to_server < 0)
+    return to_client < 0 ? -1 : sim_now + to_client;
+  if (to_client < 0 || to_server < to_client)
+    return sim_now + to_server;
+  return sim_now + to_client;
+}
+
+
+///////////////////////////////////// MAIN ////////////////////////////////////
+
+/**
+ * Starts cTCP for one end.
+ */
+static void sim_init(conn_t *conn, conn_t *peer, netem_config_t *model,
+                     unsigned long seed, int window) {
+  conn->peer = peer;
+  conn->link = netem_new(model, seed);
+
+  ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+  cfg->recv_window = window * MAX_SEG_DATA_SIZE;
+  cfg->send_window = window * MAX_SEG_DATA_SIZE;
+  cfg->timer = TIMER_INTERVAL;
+  cfg->rt_timeout = RT_INTERVAL;
+  conn->state = ctcp_init(conn, cfg);
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-n bytes]\n"
+    "   [-w window_size]\n"
+    "   [--seed seed]\n"
+    "   [--netem model]\n"
+    "   [--time-limit seconds]\n"
+    "   [-d]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = argv[0];
+  uint64_t bytes = 1024 * 1024;
+  int window = 1;
+  unsigned long seed = 144;
+  long time_limit = SIM_TIME_LIMIT;
+  bool debug = false;
+  netem_config_t model;
+  int opt, i;
+
+  netem_parse("delay 10", &model);
+
+  static struct option o[] = {
+    { "bytes", required_argument, NULL, 'n' },
+    { "window", required_argument, NULL, 'w' },
+    { "seed", required_argument, NULL, 'e' },
+    { "netem", required_argument, NULL, 'm' },
+    { "time-limit", required_argument, NULL, 'l' },
+    { "debug", no_argument, NULL, 'd' },
+    { NULL, 0, NULL, 0 }
+  };
+  while ((opt = getopt_long(argc, argv, "n:w:d", o, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      bytes = strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'e':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      if (netem_parse(optarg, &model) < 0) {
+        fprintf(stderr, "[ERROR] Could not parse netem model: %s\n", optarg);
+        usage(progname);
+      }
+      break;
+    case 'l':
+      time_limit = atol(optarg) * 1000;
+      break;
+    case 'd':
+      debug = true;
+      break;
+    default:
+      usage(progname);
+    }
+  }
+  if (window <= 0 || window * MAX_SEG_DATA_SIZE > UINT16_MAX ||
+      time_limit <= 0)
+    usage(progname);
+
+  /* The stream, twice over so any run of it can be copied in one go. */
+  uint64_t x = seed;
+  for (i = 0; i < SIM_PATTERN_LEN; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    pattern[i] = pattern[i + SIM_PATTERN_LEN] = x >> 56;
+  }
+
+  /* cTCP is chatty on stderr. */
+  if (!debug)
+    freopen("/dev/null", "w", stderr);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  client.in_len = bytes;
+  sim_init(&client, &server, &model, seed, window);
+  sim_init(&server, &client, &model, seed + 1, window);
+
+  long next_timer = TIMER_INTERVAL;
+  long idle_since = -1;
+  while (!(client.removed && server.removed) && sim_now <= time_limit) {
+    /* Input is always there, up to the send buffer. */
+    if (!client.removed && !client.read_eof)
+      ctcp_read(client.state);
+    if (!server.removed && !server.read_eof)
+      ctcp_read(server.state);
+
+    long next = run_links();
+    long deadline = sim_deadline >= 0 && sim_deadline < next_timer ?
+                    sim_deadline : next_timer;
+    if (sim_now >= deadline) {
+      if (sim_now >= next_timer)
+        next_timer += TIMER_INTERVAL;
+      sim_deadline = -1;
+      ctcp_timer();
+      continue;
+    }
+
+    if ((client.removed || server.removed) && next < 0) {
+      if (idle_since < 0)
+        idle_since = sim_now;
+      else if (sim_now - idle_since >= SIM_LINGER)
+        break;
+    }
+    else {
+      idle_since = -1;
+    }
+
+    /* Jump to the next event. */
+    sim_now = next >= 0 && next < deadline ? next : deadline;
+  }
+
+  gettimeofday(&end, NULL);
+  double wall = (end.tv_sec - start.tv_sec) +
+                (end.tv_usec - start.tv_usec) / 1e6;
+  bool ok = server.out_pos == bytes && server.out_eof && !server.out_bad;
+  const netem_stats_t *up = netem_stats(client.link);
+  const netem_stats_t *down = netem_stats(server.link);
+
+  printf("bytes: %llu\n", (unsigned long long) server.out_pos);
+  printf("result: %s\n", ok ? "ok" : (server.out_bad ? "corrupt" :
+                                      "incomplete"));
+  printf("virtual_time_s: %.3f\n", sim_now / 1000.0);
+  printf("goodput_mbps: %.3f\n",
+         sim_now ? server.out_pos * 8 / (sim_now / 1000.0) / 1e6 : 0);
+  printf("wall_time_s: %.3f\n", wall);
+  printf("segments_sent: %lu %lu\n", up->queued + up->dropped,
+         down->queued + down->dropped);
+  printf("segments_dropped: %lu %lu\n", up->dropped, down->dropped);
+  printf("segments_reordered: %lu %lu\n", up->reordered, down->reordered);
+  return ok ? 0 : 1;
+}
@@ -129,12 +129,22 @@ size_t conn_bufspace(conn_t *conn);
  */
 void conn_remove(conn_t *conn);
 
+/**
+ * Asks for ctcp_timer() to be called once at the given time, if that is before
+ * its next regular call. Use this to retransmit as soon as a segment times out
+ * instead of on the next timer tick. Calling it again replaces the earlier
+ * time, unless that is sooner.
+ *
+ * when: Time to call ctcp_timer() at, in nanoseconds (see current_time_ns()).
+ */
+void timer_at(uint64_t when);
+
 
 /** Whether or not the tester's debugging is turned on. You can ignore this. */
-bool test_debug_on;
+extern bool test_debug_on;
 
 /** Whether or not to use in Lab 5 mode. You can ignore this. */
-bool lab5_mode;
+extern bool lab5_mode;
 
 /**
  * Library teardown for a client. You can ignore this.
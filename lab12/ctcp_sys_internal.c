@@ -10,15 +10,30 @@
  * this file.
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <time.h>
 #include <unistd.h>
-
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "ctcp_dumper.h"
+#include "ctcp_netem.h"
+#include "ctcp_pool.h"
+#include "ctcp_shm.h"
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
+#include "ctcp_trace.h"
 
 #define ASSERT_CLIENT_ONLY (assert(!SERVER))
 #define ASSERT_SERVER_ONLY (assert(SERVER))
@@ -27,6 +42,9 @@
 static bool DEBUG = false;
 static bool SERVER = false;
 
+bool test_debug_on;
+bool lab5_mode;
+
 /** Configuration information for a client or server. */
 struct config {
   int socket;                  /* Socket to send and receive out of */
@@ -39,8 +57,6 @@ struct config {
   conn_t *sconn;               /* Server connection details. */
 
   /* Server */
-  conn_t *connections;         /* Connection details for clients connected
-                                  to this server */
   char *program;               /* Program to start */
   int argc;                    /* Number of arguments to this program */
   char **argv;                 /* Array of arguments */
@@ -52,9 +68,47 @@ static ctcp_config_t *ctcp_cfg;
 /** Whether or not a Unix socket is being used instead of a normal socket. */
 static bool unix_socket = true;
 
+/** Whether or not segments are carried in UDP datagrams (--transport udp)
+    instead of raw IP, and whether the kernel splits sends (GSO) and merges
+    receives (GRO) for us. */
+static bool udp_socket = false;
+static bool udp_gso = false;
+static bool udp_gro = false;
+
+/** Whether or not segments go through shared memory rings instead of the Unix
+    socket (--transport shm). The Unix socket is then only used to hand the
+    rings over. */
+static bool shm_transport = false;
+_Static_assert(MAX_PACKET_SIZE <= SHM_SLOT_SIZE, "Packets must fit a slot");
+/* The data of a segment is summed on its own and added to the sum of the
+   header, which only works if the header has an even length. */
+_Static_assert(sizeof(ctcp_segment_t) % 2 == 0 && TCP_HDR_SIZE % 2 == 0,
+               "Headers must have even lengths");
+
+/** Whether the transport was picked with --transport, rather than from the
+    server's address. */
+static bool transport_set = false;
+
 /** Whether or not the server runs a program. */
 static bool run_program = false;
 
+/** Whether or not TCP Fast Open is on. A client sends its first segment of
+    data in the SYN if it has a cookie for the server. */
+static bool fastopen = false;
+
+/** [Server] Key for Fast Open cookies. Separate from the SYN cookie key, so
+    neither kind of cookie says anything about the other. */
+static hash_key_t tfo_cookie_key;
+
+/** [Server] Key for SYN cookies. Random, so cookies cannot be forged. */
+static hash_key_t syn_cookie_key;
+
+/** [Client] Fast Open cookie for the server, if one has been cached, and the
+    round-trip time (in ms) of the handshake it was cached with. */
+static uint8_t tfo_cookie[TFO_COOKIE_LEN];
+static bool have_tfo_cookie = false;
+static long tfo_rtt = 0;
+
 /** Options for unreliable communications. */
 static int seed = 144;
 static int opt_drop = false;
@@ -62,36 +116,193 @@ static int opt_corrupt = false;
 static int opt_delay = false;
 static int opt_duplicate = false;
 
+/** Network emulator every outgoing packet goes through, if given a model with
+    --netem. Each thread running an event loop has its own. --delay also uses
+    it to hold on to segments. */
+static netem_config_t netem_cfg;
+static __thread netem_t *netem;
+
 /** For tester, we only do the unreliability once, deterministically. This is
     set to true once it has occurred. */
 static bool tester_did_unreliable = false;
 
-/** Log file. */
-int log_file = -1;
-
-/** Port number of a new connection if a client just connected. Used to avoid
-    logging ACK segments in response to a SYN+ACK. */
-static int new_connection = 0;
+/** Whether to trace segments to a file (-l), and how many data bytes of each
+    to keep. */
+static bool opt_logging = false;
+static int trace_snaplen = 0;
+
+/** Where to write the datagrams sent and received (--pcap), the most bytes to
+    save from each, and the size to rotate files at. */
+static char *pcap_file = NULL;
+static int pcap_snaplen = PCAP_SNAPLEN;
+static long pcap_rotate = 0;
+
+/** [Client] File sent instead of STDIN (--file), mapped into memory, and how
+    much of it has been handed to cTCP. */
+static char *input_file = NULL;
+static char *input_map = NULL;
+static size_t input_size = 0;
+static size_t input_pos = 0;
+
+/** File output is written to instead of STDOUT (--output). */
+static char *output_file = NULL;
+static int output_fd = -1;
+
+/** Counters printed with --stats when the client is done, or when either
+    side is stopped with SIGINT or SIGTERM (which also flushes the trace).
+    Only kept with --stats. */
+static bool opt_stats = false;
+static volatile sig_atomic_t stop_requested = 0;
+static struct {
+  atomic_ulong segments;       /* Segments sent with data */
+  atomic_ulong retransmits;    /* Of those, ones sent before */
+  atomic_ulong acks;           /* Segments sent without data */
+  atomic_ulong bytes;          /* Data bytes sent, counting retransmissions */
+  atomic_ulong received;       /* Segments received */
+} stats;
+
+/** Adds to one of the --stats counters. */
+#define STAT_ADD(field, n) \
+  do { \
+    if (opt_stats) \
+      atomic_fetch_add_explicit(&stats.field, n, memory_order_relaxed); \
+  } while (0)
 
 /**
- * Polling configuration:
- *    0    STDIN
- *    1    STDOUT
- *    2    Network
- *    3... Program STDOUT/STDERR (if running as server)
+ * Prints the counters for --stats, as key=value pairs on one line.
  */
-static struct pollfd *events;
-
-/** When the last timer timeout occurred. */
-static struct timespec last_timeout;
+void print_stats() {
+  if (!opt_stats)
+    return;
+  fprintf(stderr, "[STATS] segments=%lu retransmits=%lu acks=%lu bytes=%lu "
+          "received=%lu\n", atomic_load(&stats.segments),
+          atomic_load(&stats.retransmits), atomic_load(&stats.acks),
+          atomic_load(&stats.bytes), atomic_load(&stats.received));
+}
 
-/** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
-static int num_connected = 0;
+/**
+ * Handles SIGINT and SIGTERM with --stats, -l or --pcap. The event loop prints
+ * the counters, flushes the trace and pcap file and exits.
+ */
+static void request_stop(int sig) {
+  stop_requested = 1;
+}
 
-/** Main thread and thread for sending rests. */
-static pthread_t thread_main;
-static pthread_t thread_resets;
-static bool handling_resets = false;
+/**
+ * Event loop. Everything is registered edge-triggered with epoll:
+ *    STDIN, STDOUT, network   data.ptr is &ev_stdin, &ev_stdout, &ev_socket
+ *    Shared memory rings      data.ptr is &ev_shm
+ *    Program pipes            data.ptr is the conn_t (if running as server)
+ *    --mux program pipes      data.ptr is &ev_mux
+ * Edges are remembered until the input is used up: stdin_ready for STDIN,
+ * shm_ready for the rings, and ready_list for connections whose program has
+ * output to read.
+ *
+ * With --threads, each worker thread runs its own event loop over its own
+ * connections, so all of the state below is per thread. The network is then
+ * the worker's rx_ring, filled by the receive thread.
+ */
+static __thread int epoll_fd = -1;
+static char ev_stdin, ev_stdout, ev_socket, ev_mux, ev_shm;
+static __thread bool stdin_ready = false;
+static __thread bool socket_ready = false;
+static __thread bool shm_ready = false;
+static __thread conn_t *ready_list = NULL;
+
+/** Where packets are copied out of the shared memory rings. */
+static __thread char *shm_bufs;
+
+/** Whether or not some connection has been scheduled for removal. */
+static __thread bool need_delete = false;
+
+/** When ctcp_timer() is next called regularly, in ns. */
+static __thread uint64_t next_timer;
+
+/** When ctcp_timer() was asked to be called by timer_at(), in ns. 0 if not. */
+static __thread uint64_t timer_deadline;
+
+/** [Server] Connections to clients. */
+static __thread conn_t *connections = NULL;
+
+/** Number of clients connected, over all threads. If backlog is set, at most
+    backlog clients can be connected (give or take one per thread). */
+static atomic_int num_connected = 0;
+static int backlog = 0;
+
+/** [Server] Half-open connections waiting for the handshake ACK. */
+static __thread syn_entry_t *syn_queue;
+static int syn_queue_len = SYN_QUEUE_LEN;
+
+/** Starting size of the output buffer of each connection. It has to fit at
+    least one segment. */
+static int out_buf_space = MAX_BUF_SPACE;
+
+/** Where conn_t objects are allocated from. */
+static __thread slab_t conn_slab = SLAB_INIT(conn_t);
+
+/** Connections by IP address and port of the other host, chained through
+    hash_next. Doubled in size whenever it holds more connections than it has
+    buckets. */
+static __thread conn_t **conn_table;
+static __thread size_t conn_table_size = 0;
+static __thread size_t conn_table_count = 0;
+
+/** Datagrams received with one recvmmsg. */
+static __thread char rx_bufs[RECV_BATCH][MAX_PACKET_SIZE];
+
+/** [UDP] The last datagram received with GRO, still to be split into
+    segments of gro_seg bytes from gro_off on, and where it came from. */
+static __thread char *gro_buf = NULL;
+static __thread int gro_len = 0;
+static __thread int gro_off = 0;
+static __thread int gro_seg = 0;
+static __thread struct sockaddr_in gro_from;
+
+/** Datagrams waiting to be sent with one sendmmsg. They are sent before the
+    main loop sleeps, or once SEND_BATCH of them are waiting. */
+static __thread struct tx_slot {
+  union {
+    struct sockaddr_in saddr;
+    struct sockaddr_un_port sunaddr;
+  };
+  socklen_t addr_len;
+  size_t len;
+  char buf[MAX_PACKET_SIZE];
+} tx_queue[SEND_BATCH];
+static __thread int tx_count = 0;
+
+/** [Server] Worker threads (--threads). The receive thread hands each packet
+    to a worker by hash of the client's IP address and port, so a connection
+    always stays on the same worker. */
+static int num_workers = 1;
+static worker_t *workers;
+static __thread worker_t *worker = NULL;
+static __thread pkt_ring_t *rx_ring = NULL;
+
+/** [Server] Program instances started ahead of time (--prefork), or one
+    long-running instance per event loop serving all of its connections over
+    frames (--mux). */
+static int prefork = 0;
+static bool mux_mode = false;
+static struct mux {
+  program_t prog;
+  uint32_t next_id;            /* ID of the next connection */
+  mux_conn_t *table[MUX_TABLE_SIZE];
+  char *out_buf;               /* Frames waiting to go to the program */
+  uint32_t out_off;            /* Start of the frames in out_buf */
+  uint32_t out_len;            /* Bytes of frames in out_buf */
+  uint32_t out_cap;            /* Size of out_buf */
+  char in_buf[sizeof(mux_hdr_t) + UINT16_MAX]; /* Holds the largest frame */
+  uint32_t in_len;             /* Bytes from the program not yet handled */
+  bool readable;               /* Program has output, until EAGAIN */
+  bool blocked;                /* A connection has no room for the next frame */
+  bool out_full;               /* Connections are waiting for room to output */
+  bool dead;                   /* Program exited */
+} __thread *mux = NULL;
+
+/** Until when packets left over from earlier connections to this port are
+    answered with RSTs. */
+static long resets_until = 0;
 
 
 /////////////////////////////// HELPER FUNCTIONS //////////////////////////////
@@ -103,10 +314,64 @@ static bool handling_resets = false;
  *          server), or to the connection to the server (for the client).
  */
 conn_t *get_connections() {
-  if (SERVER)  return config->connections;
+  if (SERVER)  return connections;
   else         return config->sconn;
 }
 
+/**
+ * Registers a fd with the event loop, edge-triggered. Regular files (and
+ * /dev/null) cannot be watched, but they never block either, so their input
+ * is just considered ready.
+ *
+ * fd: The fd to watch.
+ * events: EPOLLIN and/or EPOLLOUT.
+ * ptr: Passed to the event loop with each event.
+ * ready: Set to true if fd cannot be watched. May be NULL.
+ * returns: -1 on error, 0 otherwise.
+ */
+int watch_fd(int fd, uint32_t events, void *ptr, bool *ready) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events | EPOLLET;
+  ev.data.ptr = ptr;
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    return 0;
+  if (errno == EPERM) {
+    if (ready != NULL)
+      *ready = true;
+    return 0;
+  }
+  fprintf(stderr, "[ERROR] Could not watch fd %d: %s\n", fd, strerror(errno));
+  return -1;
+}
+
+/**
+ * Called by conn_input once the input of a connection is used up (no more data
+ * or EOF). Input is not read again until there is an event for it.
+ *
+ * conn: The connection.
+ */
+void input_done(conn_t *conn) {
+  if (run_program)
+    conn->input_ready = false;
+  else
+    stdin_ready = false;
+}
+
+/**
+ * Puts a connection on the ready list, to read its program's output.
+ *
+ * conn: The connection.
+ */
+void input_ready(conn_t *conn) {
+  if (conn->input_ready || conn->read_eof)
+    return;
+  conn->input_ready = true;
+  conn->ready_next = ready_list;
+  ready_list = conn;
+}
+
 /**
  * Set up the configuration for this host:
  *   - Create raw socket to communicate.
@@ -119,8 +384,9 @@ conn_t *get_connections() {
 int do_config(char *port) {
   /* Create raw (Unix) socket. */
   int s;
-  if (unix_socket)  s = socket(AF_UNIX, SOCK_DGRAM, 0);
-  else              s = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+  if (unix_socket)      s = socket(AF_UNIX, SOCK_DGRAM, 0);
+  else if (udp_socket)  s = socket(AF_INET, SOCK_DGRAM, 0);
+  else                  s = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
   if (s < 0) {
     fprintf(stderr, "[ERROR] Could not open socket (are you running "
                     "as sudo?)\n");
@@ -129,7 +395,7 @@ int do_config(char *port) {
 
   /* Make sure kernel knows IP header is included in packet so it doesn't add its
      own. For non-Unix socket only. */
-  if (!unix_socket) {
+  if (!unix_socket && !udp_socket) {
     int one = 1;
     if (setsockopt(s, IPPROTO_IP, IP_HDRINCL, (char *) &one, sizeof(one)) < 0) {
       fprintf(stderr, "[ERROR] Could not set IP_HDRINCL\n");
@@ -143,10 +409,23 @@ int do_config(char *port) {
     }
   }
 
+  /* Over UDP, packets are addressed by the UDP header, and the receiver fills
+     in the source address of the IP header (see udp_set_source). Older
+     kernels have no GSO or GRO, and datagrams are sent and received one by
+     one. */
+  if (udp_socket) {
+    int one = 1;
+    config->ip_addr = ip_from_self();
+    if (config->ip_addr == 0)
+      config->ip_addr = LOCALHOST;
+    udp_gso = setsockopt(s, SOL_UDP, UDP_SEGMENT, &(int){ 0 },
+                         sizeof(int)) == 0;
+    udp_gro = setsockopt(s, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+  }
+
   /* Other configuration. */
   config->port = atoi(port);
   config->socket = s;
-  config->connections = NULL;
 
   /* Set up receive timeout. */
   struct timeval tv;
@@ -169,7 +448,7 @@ int do_config(char *port) {
   }
   else {
     config->saddr.sin_family = AF_INET;
-    config->saddr.sin_addr.s_addr = config->ip_addr;
+    config->saddr.sin_addr.s_addr = udp_socket ? INADDR_ANY : config->ip_addr;
     config->saddr.sin_port = htons(config->port);
 
     addr = (struct sockaddr *) &config->saddr;
@@ -181,19 +460,10 @@ int do_config(char *port) {
     return -1;
   }
 
-  /* Handle if previous connection(s) have not ended. Send RSTs to those
-     hosts in a different thread. First create the reset thread. */
-  thread_main = pthread_self();
-  pthread_create(&thread_resets, NULL, send_resets, NULL);
-
-  /* Wait for a bit. If still handling resets, wait. */
-  sleep(RESET_THREAD_DURATION);
-  while (handling_resets);
-
-  /* Kill the thread. */
-  pthread_cancel(thread_resets);
-  pthread_join(thread_resets, NULL);
-  fprintf(stderr, "done!\n");
+  /* Previous connection(s) to this port may not have ended. The event loop
+     answers their packets with RSTs for a while (see send_reset), so the
+     socket can be used right away. */
+  resets_until = current_time() + RESET_DURATION * 1000;
   return 0;
 }
 
@@ -218,23 +488,244 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
   }
   server_port_str = strsep(&server, ":");
   server_port = atoi(server_port_str);
-  config->sconn = calloc(sizeof(conn_t), 1);
-  conn_add(config->sconn);
+  config->sconn = slab_alloc(&conn_slab);
 
   /* Get IP address of server. See if this is a server on the same machine. */
   in_addr_t dst_ip = ip_from_hostname(_server);
   if (dst_ip == 0)
     return -1;
+  else if (dst_ip != LOCALHOST && unix_socket && transport_set) {
+    fprintf(stderr, "[ERROR] Unix sockets only reach servers on this "
+                    "machine\n");
+    return -1;
+  }
   else if (dst_ip != LOCALHOST)
     unix_socket = false;
 
   /* Set up connection details. */
   int port = server_port == 0 ? DEFAULT_PORT : server_port;
   conn_setup(config->sconn, dst_ip, port, unix_socket);
+  conn_add(config->sconn);
+
+  return 0;
+}
+
+/**
+ * Mixes the bits of a 64-bit value (splitmix64 finalizer). Not keyed, and
+ * easily inverted, so only fit for spreading values out, e.g. over threads.
+ */
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * Fills a key from the kernel's random number generator. Keys are not drawn
+ * from rand(), which --seed makes predictable. Exits if none can be had.
+ *
+ * key: The key to fill.
+ */
+void random_key(hash_key_t *key) {
+  size_t got = 0;
+  while (got < sizeof(*key)) {
+    ssize_t r = getrandom((char *) key + got, sizeof(*key) - got, 0);
+    if (r < 0 && errno != EINTR) {
+      fprintf(stderr, "[ERROR] Could not get random bytes: %s\n",
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (r > 0)
+      got += r;
+  }
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do {                                   \
+  v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32);      \
+  v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;                             \
+  v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;                             \
+  v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32);      \
+} while (0)
+
+/**
+ * Keyed hash of two 64-bit words: SipHash-2-4 of their 16 bytes in
+ * little-endian order. Unlike an unkeyed mixer, its outputs give away nothing
+ * about the key, so it can make cookies that only the server can compute.
+ *
+ * key: The key.
+ * m0, m1: The words to hash.
+ * returns: The hash.
+ */
+uint64_t keyed_hash(const hash_key_t *key, uint64_t m0, uint64_t m1) {
+  uint64_t v0 = key->k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key->k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key->k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key->k1 ^ 0x7465646279746573ULL;
+  uint64_t m[3] = { m0, m1, (uint64_t) 16 << 56 };  /* Last: the length */
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    v3 ^= m[i];
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m[i];
+  }
+  v2 ^= 0xff;
+  for (i = 0; i < 4; i++)
+    SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+////////////////////////////////// FAST OPEN //////////////////////////////////
+
+/**
+ * [Server only]
+ * Generates the Fast Open cookie for a client. The cookie only depends on the
+ * client's IP address, so the client can reuse it for later connections.
+ *
+ * ip_addr: IP address of the client.
+ * cookie: Buffer of TFO_COOKIE_LEN bytes to write the cookie into.
+ */
+void tfo_make_cookie(in_addr_t ip_addr, uint8_t *cookie) {
+  uint64_t h = keyed_hash(&tfo_cookie_key, ip_addr, 0);
+  memcpy(cookie, &h, TFO_COOKIE_LEN);
+}
 
+/**
+ * [Client only]
+ * Gets the path of the Fast Open cookie cache. It is kept in a directory of
+ * the user's own, never in a shared one like /tmp, where anyone could put a
+ * symlink in its place.
+ *
+ * path: Buffer for the path.
+ * len: Size of the buffer.
+ * returns: 0 on success, -1 if there is nowhere to keep it.
+ */
+int tfo_cache_path(char *path, size_t len) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir == NULL || dir[0] == '\0')
+    dir = getenv("HOME");
+  if (dir == NULL || dir[0] == '\0')
+    return -1;
+  if (snprintf(path, len, "%s/.%s", dir, TFO_CACHE_FILE) >= (int) len)
+    return -1;
   return 0;
 }
 
+/**
+ * [Client only]
+ * Opens the Fast Open cookie cache for reading. It must be a regular file
+ * owned by this user, and not a symlink.
+ *
+ * path: Path of the cache.
+ * returns: The open cache, or NULL if there is none.
+ */
+FILE *tfo_cache_open(const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+    close(fd);
+    return NULL;
+  }
+  FILE *f = fdopen(fd, "r");
+  if (f == NULL)
+    close(fd);
+  return f;
+}
+
+/**
+ * [Client only]
+ * Loads the cached Fast Open cookie for the server into tfo_cookie, along with
+ * the window size and handshake round-trip time seen on the last connection.
+ *
+ * server: The server's connection details.
+ * window: Return parameter. The server's window size.
+ * rtt: Return parameter. Round-trip time of the last handshake, in ms.
+ * returns: 0 if a cookie was found, -1 otherwise.
+ */
+int tfo_cache_load(conn_t *server, uint16_t *window, long *rtt) {
+  char path[PATH_MAX];
+  FILE *f;
+  if (tfo_cache_path(path, sizeof(path)) < 0 ||
+      (f = tfo_cache_open(path)) == NULL)
+    return -1;
+
+  unsigned int ip;
+  int port;
+  unsigned long long cookie;
+  have_tfo_cookie = false;
+  while (fscanf(f, "%u %d %llx %hu %ld", &ip, &port, &cookie, window,
+                rtt) == 5) {
+    if (ip == server->ip_addr && port == server->port) {
+      memcpy(tfo_cookie, &cookie, TFO_COOKIE_LEN);
+      have_tfo_cookie = true;
+      break;
+    }
+  }
+  fclose(f);
+  return have_tfo_cookie ? 0 : -1;
+}
+
+/**
+ * [Client only]
+ * Updates the cache entry for the server with the cookie in tfo_cookie. If
+ * there is no cookie, the server's entry is removed. The entries are written
+ * to a new file (mode 0600), which then replaces the cache in one go, so a
+ * reader never sees half of it.
+ *
+ * server: The server's connection details.
+ * window: The server's window size.
+ * rtt: Round-trip time of the handshake, in ms.
+ */
+void tfo_cache_store(conn_t *server, uint16_t window, long rtt) {
+  char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+  char line[100];
+
+  if (tfo_cache_path(path, sizeof(path)) < 0)
+    return;
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp_path);
+  if (fd < 0)
+    return;
+  FILE *out = fdopen(fd, "w");
+  if (out == NULL) {
+    close(fd);
+    unlink(tmp_path);
+    return;
+  }
+
+  /* Keep entries for other servers, however many there are. */
+  FILE *in = tfo_cache_open(path);
+  if (in != NULL) {
+    unsigned int ip;
+    int port;
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (sscanf(line, "%u %d", &ip, &port) == 2 &&
+          ip == server->ip_addr && port == server->port)
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+
+  if (have_tfo_cookie) {
+    unsigned long long cookie = 0;
+    memcpy(&cookie, tfo_cookie, TFO_COOKIE_LEN);
+    fprintf(out, "%u %d %016llx %hu %ld\n", server->ip_addr, server->port,
+            cookie, window, rtt);
+  }
+  bool failed = ferror(out);
+  if (fclose(out) != 0 || failed || rename(tmp_path, path) < 0)
+    unlink(tmp_path);
+}
+
 
 ///////////////////////////// PACKETS AND SEGMENTS ////////////////////////////
 
@@ -314,6 +805,93 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   return datagram;
 }
 
+/**
+ * Creates a SYN or SYN-ACK segment (including the IP header). If a cookie is
+ * given, a TCP Fast Open option is added to the segment, and data may be
+ * carried along with the SYN. The returned segment must be freed.
+ *
+ * dst: A conn_t containing details for the destination.
+ * flags: TCP flags.
+ * cookie: Fast Open cookie, or NULL to leave out the Fast Open option.
+ * cookie_len: Length of the cookie. 0 to request a cookie from the server.
+ * data: Buffer containing the data payload, if any.
+ * len: Data length (should not include the size of the headers).
+ * rlen: Return parameter. Total length of the packet.
+ *
+ * returns: A TCP segment with the specified fields.
+ */
+char *create_tcp_syn(conn_t *dst, uint8_t flags, const uint8_t *cookie,
+                     int cookie_len, const char *data, uint16_t len,
+                     int *rlen) {
+  /* Options are padded with NOPs to a multiple of 4 bytes. */
+  int opt_len = cookie == NULL ? 0 : (2 + cookie_len + 3) & ~3;
+  uint16_t tcp_seg_len = TCP_HDR_SIZE + opt_len + len;
+  char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_seg_len);
+  iphdr_t *ip_hdr = (iphdr_t *) datagram;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
+  uint8_t *opt = (uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+
+  /* Fast Open option. */
+  if (cookie != NULL) {
+    memset(opt, TCPOPT_NOP, opt_len);
+    opt[0] = TCPOPT_FASTOPEN;
+    opt[1] = 2 + cookie_len;
+    memcpy(opt + 2, cookie, cookie_len);
+  }
+
+  /* Copy data over, if there is any. */
+  if (len > 0 && data != NULL)
+    memcpy(opt + opt_len, data, len);
+
+  /* TCP header. */
+  tcp_hdr->th_sport = htons(config->port);
+  tcp_hdr->th_dport = htons(dst->port);
+  tcp_hdr->th_seq = htonl(dst->next_seqno);
+  tcp_hdr->th_ack = htonl(dst->ackno);
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opt_len) / 4;
+  tcp_hdr->th_flags = flags;
+  tcp_hdr->th_win = htons(ctcp_cfg->recv_window);
+  tcp_hdr->th_sum = 0;
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + len);
+
+  *rlen = IP_HDR_SIZE + tcp_seg_len;
+  return datagram;
+}
+
+/**
+ * Looks for a TCP Fast Open option in a segment.
+ *
+ * tcp_hdr: The TCP header.
+ * len: Number of bytes available starting at the TCP header.
+ * cookie: Return parameter. Set to the start of the cookie.
+ *
+ * returns: Length of the cookie (0 if this is a cookie request), or -1 if
+ *          there is no Fast Open option.
+ */
+int find_tfo_option(tcphdr_t *tcp_hdr, int len, uint8_t **cookie) {
+  uint8_t *opt = (uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+  uint8_t *end = (uint8_t *) tcp_hdr + tcp_hdr->th_off * 4;
+  if (tcp_hdr->th_off * 4 > len)
+    return -1;
+
+  while (opt < end && *opt != TCPOPT_EOL) {
+    if (*opt == TCPOPT_NOP) {
+      opt++;
+      continue;
+    }
+    /* Malformed option. */
+    if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+      return -1;
+
+    if (opt[0] == TCPOPT_FASTOPEN) {
+      *cookie = opt + 2;
+      return opt[1] - 2;
+    }
+    opt += opt[1];
+  }
+  return -1;
+}
+
 /**
  * Converts a packet from a raw IP packet to a cTCP segment. If there is
  * padding, keep it. The resulting segment must be freed.
@@ -341,9 +919,12 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   segment->flags = tcp_hdr->th_flags;
   segment->window = tcp_hdr->th_win;
   segment->cksum = 0;
-  if (data_len > 0)
-    memcpy(segment->data, payload, data_len);
-  segment->cksum = cksum(segment, len);
+
+  /* The data is the same in both checksums, so it is summed once, as it is
+     copied, and only the headers differ. */
+  uint64_t data_sum = inet_sum_copy(segment->data, payload, data_len, 0);
+  segment->cksum = inet_fold(inet_sum(segment, sizeof(ctcp_segment_t),
+                                      data_sum));
 
   /* Find the difference in the given TCP checksum and the correct one. This
      difference is the same difference that should be added to the cTCP one.
@@ -351,11 +932,50 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
      the student (see convert_to_datagram). */
   uint16_t sum = tcp_hdr->th_sum;
   tcp_hdr->th_sum = 0;
-  uint16_t correct_sum = cksum_tcp(ip_hdr, data_len);
+  uint16_t correct_sum = cksum_tcp_hdr(ip_hdr, data_len, data_sum);
   segment->cksum += (correct_sum - sum);
   return segment;
 }
 
+/**
+ * [Server only]
+ * Converts the data carried in a Fast Open SYN to a cTCP segment, as if it had
+ * been sent in its own segment right after the SYN.
+ *
+ * pkt: The SYN segment.
+ * len: Length of the SYN segment.
+ * returns: The segment, or NULL if the SYN has no data or a bad checksum.
+ */
+pending_seg_t *tfo_syn_data(char *pkt, int len) {
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  int hdr_len = IP_HDR_SIZE + tcp_hdr->th_off * 4;
+  int data_len = ntohs(ip_hdr->tot_len) - hdr_len;
+  if (data_len <= 0 || data_len > MAX_SEG_DATA_SIZE ||
+      ntohs(ip_hdr->tot_len) > len)
+    return NULL;
+
+  /* Drop the data if it got corrupted. */
+  uint16_t sum = tcp_hdr->th_sum;
+  tcp_hdr->th_sum = 0;
+  uint16_t correct_sum = cksum_tcp(ip_hdr, ntohs(ip_hdr->tot_len) -
+                                           FULL_HDR_SIZE);
+  tcp_hdr->th_sum = sum;
+  if (sum != correct_sum)
+    return NULL;
+
+  /* Data starts right after the SYN, at relative sequence number 1. */
+  size_t seg_len = sizeof(ctcp_segment_t) + data_len;
+  pending_seg_t *seg = calloc(offsetof(pending_seg_t, segment) + seg_len, 1);
+  seg->len = seg_len;
+  seg->segment.seqno = htonl(1);
+  seg->segment.len = htons(seg_len);
+  seg->segment.window = tcp_hdr->th_win;
+  memcpy(seg->segment.data, pkt + hdr_len, data_len);
+  seg->segment.cksum = cksum(&seg->segment, seg_len);
+  return seg;
+}
+
 /**
  * Converts a segment from a cTCP segment to a raw IP packet. The resulting
  * packet must be freed.
@@ -372,12 +992,11 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
 
-  /* Copy data over, if there is any. */
+  /* Copy data over, if there is any, summing it on the way for both
+     checksums below. */
   uint16_t data_len = len - sizeof(ctcp_segment_t);
-  if (data_len > 0 && segment->data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
-    memcpy(payload, segment->data, data_len);
-  }
+  char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+  uint64_t data_sum = inet_sum_copy(payload, segment->data, data_len, 0);
 
   /* TCP header. Convert relative sequence numbers to sequence numbers. */
   tcp_hdr->th_sport = htons(config->port);
@@ -388,7 +1007,7 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   tcp_hdr->th_flags = segment->flags;
 
   /* Need to add ACK to all segments if sending it to the web. */
-  if (!run_program && !unix_socket)
+  if (!run_program && !unix_socket && !udp_socket)
     tcp_hdr->th_flags |= TH_ACK;
   tcp_hdr->th_win = segment->window;
   tcp_hdr->th_sum = 0;
@@ -399,35 +1018,207 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
      incorrect TCP checksum. */
   uint16_t sum = segment->cksum;
   segment->cksum = 0;
-  uint16_t correct_sum = cksum(segment, len);
+  uint16_t correct_sum = inet_fold(inet_sum(segment, sizeof(ctcp_segment_t),
+                                            data_sum));
   segment->cksum = sum;
 
   /* TCP checksum. Add on the difference between the correct checksum and the
      student's checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, data_len);
+  tcp_hdr->th_sum = cksum_tcp_hdr(ip_hdr, data_len, data_sum);
   tcp_hdr->th_sum += (correct_sum - sum);
   return datagram;
 }
 
+/**
+ * Updates a checksum for a 32-bit word that changed, without going over the
+ * rest of the data again (RFC 1624).
+ *
+ * sum: The checksum, as stored.
+ * old: The word before the change, as stored.
+ * new: The word after the change, as stored.
+ * returns: The new checksum.
+ */
+static uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new) {
+  uint32_t s = (uint16_t) ~sum;
+  s += (uint16_t) ~old + (uint16_t) ~(old >> 16);
+  s += (uint16_t) new + (uint16_t) (new >> 16);
+  while (s > 0xffff)
+    s = (s >> 16) + (s & 0xffff);
+  /* cksum() never gives 0. */
+  return (uint16_t) ~s ? (uint16_t) ~s : 0xffff;
+}
+
+/**
+ * [UDP only]
+ * Puts the address a datagram came from in the source of the IP header it
+ * carries. The sender does not know which of its addresses the receiver
+ * sees, and connections are looked up by it. The checksums are updated to
+ * match, so a segment that was bad stays bad.
+ *
+ * pkt: The packet carried in the datagram.
+ * len: Length of the packet.
+ * from: Where the datagram came from.
+ */
+static void udp_set_source(char *pkt, int len,
+                           const struct sockaddr_in *from) {
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  in_addr_t old = ip_hdr->saddr;
+
+  if (len < FULL_HDR_SIZE || old == from->sin_addr.s_addr)
+    return;
+  ip_hdr->saddr = from->sin_addr.s_addr;
+  ip_hdr->check = cksum_update32(ip_hdr->check, old, ip_hdr->saddr);
+  tcp_hdr->th_sum = cksum_update32(tcp_hdr->th_sum, old, ip_hdr->saddr);
+}
+
+/**
+ * [UDP only]
+ * Receives datagrams the kernel has merged (GRO), and splits them back into
+ * the segments that were sent, up to RECV_BATCH. What does not fit is kept
+ * for the next call.
+ *
+ * sockfd: Socket file descriptor.
+ * pkts: Return parameter. The datagrams.
+ * lens: Return parameter. Length of each datagram.
+ *
+ * returns: Number of datagrams received, or -1 if there are none.
+ */
+static int recv_gro(int sockfd, char **pkts, int *lens) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int n = 0;
+
+  if (gro_buf == NULL)
+    gro_buf = malloc(GRO_BUF_SIZE);
+
+  while (n < RECV_BATCH) {
+    /* The rest of the last datagram first. */
+    if (gro_off < gro_len) {
+      int len = gro_len - gro_off < gro_seg ? gro_len - gro_off : gro_seg;
+      if (len > MAX_PACKET_SIZE)
+        len = MAX_PACKET_SIZE;
+      memcpy(rx_bufs[n], gro_buf + gro_off, len);
+      memset(rx_bufs[n] + len, 0, MAX_PACKET_SIZE - len);
+      udp_set_source(rx_bufs[n], len, &gro_from);
+      pkts[n] = rx_bufs[n];
+      lens[n] = len;
+      gro_off += gro_seg;
+      n++;
+      continue;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = gro_buf;
+    iov.iov_len = GRO_BUF_SIZE;
+    msg.msg_name = &gro_from;
+    msg.msg_namelen = sizeof(gro_from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    int r = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+    if (r < 0)
+      break;
+
+    /* Without a GRO message, it is a single datagram. */
+    gro_len = r;
+    gro_off = 0;
+    gro_seg = r > 0 ? r : 1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        memcpy(&gro_seg, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  return n > 0 ? n : -1;
+}
+
+/**
+ * Receives as many datagrams as are waiting, up to RECV_BATCH. They come from
+ * the socket, or from the worker's rx_ring with --threads. Whatever is left of
+ * each buffer is zeroed. Once handled, they must be given back with
+ * recv_release.
+ *
+ * sockfd: Socket file descriptor.
+ * pkts: Return parameter. The datagrams.
+ * lens: Return parameter. Length of each datagram.
+ *
+ * returns: Number of datagrams received, or -1 on failure (including when
+ *          there are none).
+ */
+int recv_batch(int sockfd, char **pkts, int *lens) {
+  struct mmsghdr msgs[RECV_BATCH];
+  struct iovec iovs[RECV_BATCH];
+  struct sockaddr_in froms[RECV_BATCH];
+  int i;
+
+  /* Packets from the receive thread. */
+  if (rx_ring != NULL) {
+    unsigned head = atomic_load_explicit(&rx_ring->head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&rx_ring->tail, memory_order_relaxed);
+    int n = head - tail > RECV_BATCH ? RECV_BATCH : head - tail;
+    for (i = 0; i < n; i++) {
+      unsigned slot = (tail + i) & (PKT_RING_LEN - 1);
+      pkts[i] = rx_ring->pkts[slot];
+      lens[i] = rx_ring->lens[slot];
+    }
+    return n;
+  }
+  if (udp_gro)
+    return recv_gro(sockfd, pkts, lens);
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < RECV_BATCH; i++) {
+    iovs[i].iov_base = rx_bufs[i];
+    iovs[i].iov_len = MAX_PACKET_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (udp_socket) {
+      msgs[i].msg_hdr.msg_name = &froms[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(froms[i]);
+    }
+  }
+
+  int n = recvmmsg(sockfd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+  for (i = 0; i < n; i++) {
+    pkts[i] = rx_bufs[i];
+    lens[i] = msgs[i].msg_len;
+    memset(rx_bufs[i] + lens[i], 0, MAX_PACKET_SIZE - lens[i]);
+    if (udp_socket)
+      udp_set_source(rx_bufs[i], lens[i], &froms[i]);
+  }
+  return n;
+}
+
+/**
+ * Gives back datagrams from recv_batch once they have been handled.
+ *
+ * n: Number of datagrams.
+ */
+void recv_release(int n) {
+  if (rx_ring != NULL && n > 0)
+    atomic_fetch_add_explicit(&rx_ring->tail, n, memory_order_release);
+}
+
 /**
  * Naive filtering. Host might receive many unwanted packets or leftover
  * packets from a previous session. We drop these packets.
  *
- * sockfd: Socket file descriptor.
- * buf: Buffer to receive data into.
- * len: Length of buffer and maximum size of data to receive.
- * flags: Flags for recv.
+ * buf: The received packet.
+ * r: Length of the received packet.
  * rconn: Return parameter. Pointer to the connection state associated with
  *        the sender of the packet.
  *
- * returns: Length of packet if packet wasn't dropped, 0 if no packet
- *          received, and -1 on failure.
+ * returns: Length of packet if packet wasn't dropped, 0 otherwise. For the
+ *          server, a packet with no associated connection is returned with
+ *          rconn left untouched.
  */
-int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
-  int r = recv(sockfd, buf, len, flags);
-  if (r < 0)
-    return -1;
-
+int recv_filter(void *buf, int r, conn_t **rconn) {
   if (r < FULL_HDR_SIZE)
     return 0;
 
@@ -450,93 +1241,230 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
   /* Some other packet from somewhere where we've already established a
      connection. Must have the correct source IP, port, and a sequence
      number we expect. */
-  conn_t *conn = get_connections();
-  while (conn != NULL) {
-    if (conn->port == ntohs(tcp_hdr->th_sport) &&
-        (unix_socket || (!unix_socket && conn->ip_addr == ip_hdr->saddr)) &&
-        ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
-        ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
-      /* Return associated connection. */
-      if (rconn != NULL)
-        *rconn = conn;
-
-      return r;
-    }
-    conn = conn->next;
+  conn_t *conn = conn_lookup(ip_hdr->saddr, ntohs(tcp_hdr->th_sport));
+  if (conn != NULL &&
+      ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
+      ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
+    /* Return associated connection. */
+    if (rconn != NULL)
+      *rconn = conn;
+
+    return r;
   }
 
+  /* The server may still be waiting on the ACK that finishes a handshake.
+     Let it decide. */
+  if (SERVER)
+    return r;
+  send_reset(buf);
   return 0;
 }
 
+/* One GSO send never goes over the largest UDP datagram. */
+_Static_assert(SEND_BATCH <= UDP_MAX_SEGMENTS &&
+               SEND_BATCH * MAX_PACKET_SIZE <= 65507,
+               "a batch must fit in one UDP GSO send");
+
 /**
- * Sends a packet out through the appropriate socket.
- *
- * dst: Destination connection object.
- * sockfd: Socket file descriptor.
- * buf: Data to send.
- * len: Length of data.
- * flags: Flags for sendto.
+ * [UDP only]
+ * Sends the datagrams of a GSO send one by one, after the kernel would not
+ * split it up (it does not on routes with a small MTU). GSO is not used
+ * again.
  *
- * returns: Number of bytes actually sent, or -1 if error.
+ * msg: The GSO send, one datagram per iovec.
  */
-int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
-  struct sockaddr *addr;
-  size_t size;
-
-  /* Get the correct socket. */
-  if (unix_socket) {
-    addr = (struct sockaddr *) &dst->sunaddr;
-    size = sizeof(dst->sunaddr);
-  }
-  else {
-    addr = (struct sockaddr *) &dst->saddr;
-    size = sizeof(dst->saddr);
+static void gso_fallback(struct msghdr *msg) {
+  struct iovec *iovs = msg->msg_iov;
+  size_t i, n = msg->msg_iovlen;
+
+  fprintf(stderr, "[INFO] UDP segmentation offload failed (%s), turning it "
+                  "off\n", strerror(errno));
+  udp_gso = false;
+  msg->msg_control = NULL;
+  msg->msg_controllen = 0;
+  msg->msg_iovlen = 1;
+  for (i = 0; i < n; i++) {
+    msg->msg_iov = &iovs[i];
+    sendmsg(config->socket, msg, 0);
   }
-
-  return sendto(config->socket, buf, len, flags, addr, size);
 }
 
 /**
- * Send resets to previous connections, if they exist. We can tell if there are
- * lots of RSTs or ACKs being sent to us.
+ * Sends all queued datagrams, and wakes up shared memory peers that were sent
+ * packets. A datagram that cannot be sent is dropped, like one lost in the
+ * network. Over UDP with GSO, a run of datagrams of the same size to the same
+ * host goes out as one send (the last may be shorter), which the kernel splits
+ * up again.
  */
-void *send_resets(void *args) {
-  fprintf(stderr, "[INFO] Cleaning up old connections... ");
-  char buf[MAX_PACKET_SIZE];
-  memset(buf, 0, MAX_PACKET_SIZE);
-  int r;
-
-  /* See if there are leftover packets. If so, send resets to them. */
-  r = recv(config->socket, buf, MAX_PACKET_SIZE, 0);
-  while (r > 0) {
-    handling_resets = true;
+void tx_flush() {
+  struct mmsghdr msgs[SEND_BATCH];
+  struct iovec iovs[SEND_BATCH];
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } ctrl[SEND_BATCH];
+  int i, m;
+
+  shm_flush();
+  if (tx_count == 0)
+    return;
 
-    iphdr_t *ip_hdr = (iphdr_t *) buf;
-    tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-    char *rst = create_tcp_rst(ip_hdr->saddr, tcp_hdr->th_dport,
-                               tcp_hdr->th_sport, tcp_hdr->th_ack);
+  memset(msgs, 0, sizeof(struct mmsghdr) * tx_count);
+  for (i = 0, m = 0; i < tx_count; m++) {
+    struct tx_slot *first = &tx_queue[i];
+    struct msghdr *hdr = &msgs[m].msg_hdr;
+    hdr->msg_name = &first->saddr;
+    hdr->msg_namelen = first->addr_len;
+    hdr->msg_iov = &iovs[i];
+    do {
+      iovs[i].iov_base = tx_queue[i].buf;
+      iovs[i].iov_len = tx_queue[i].len;
+      i++;
+    } while (udp_gso && i < tx_count && tx_queue[i - 1].len == first->len &&
+             tx_queue[i].len <= first->len &&
+             tx_queue[i].addr_len == first->addr_len &&
+             memcmp(&tx_queue[i].saddr, &first->saddr, first->addr_len) == 0);
+    hdr->msg_iovlen = &iovs[i] - hdr->msg_iov;
+
+    if (hdr->msg_iovlen > 1) {
+      hdr->msg_control = ctrl[m].buf;
+      hdr->msg_controllen = sizeof(ctrl[m].buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t gso_size = first->len;
+      memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+  }
+
+  /* sendmmsg stops at the first datagram that fails. Skip it and go on. */
+  i = 0;
+  while (i < m) {
+    int n = sendmmsg(config->socket, msgs + i, m - i, 0);
+    if (n <= 0) {
+      if (msgs[i].msg_hdr.msg_controllen > 0 &&
+          (errno == EINVAL || errno == EIO))
+        gso_fallback(&msgs[i].msg_hdr);
+      else if (DEBUG)
+        fprintf(stderr, "[DEBUG] Could not send datagram: %s\n",
+                strerror(errno));
+      n = 1;
+    }
+    i += n;
+  }
+  tx_count = 0;
+}
+
+/**
+ * Sends a packet to an address. It is batched with the others when possible.
+ *
+ * addr: Where the packet goes.
+ * size: Length of the address.
+ * buf: The packet.
+ * len: Length of the packet.
+ * flags: Flags for sendto().
+ * returns: The number of bytes sent, or -1 on failure.
+ */
+static int send_to(const struct sockaddr *addr, socklen_t size,
+                   const void *buf, size_t len, int flags) {
+  if (dump_enabled())
+    dump_packet(buf, len);
+
+  /* Straight into the peer's ring. A full ring loses it like the network. */
+  if (shm_transport) {
+    int port = atoi(((const struct sockaddr_un_port *) addr)->sun_path + 1);
+    if (shm_send(port, buf, len) < 0 && DEBUG)
+      fprintf(stderr, "[DEBUG] Could not send to port %d\n", port);
+    return len;
+  }
 
-    /* Create connection object to send resets to. */
-    conn_t conn;
-    memset((void *) &conn, 0, sizeof(conn_t));
-    conn_setup(&conn, ip_hdr->saddr, ntohs(tcp_hdr->th_sport), false);
+  /* Too big to queue. Keep the order and send it right away. */
+  if (len > MAX_PACKET_SIZE || flags != 0) {
+    tx_flush();
+    return sendto(config->socket, buf, len, flags, addr, size);
+  }
 
-    int s = sendto(config->socket, rst, FULL_HDR_SIZE, 0,
-                   (struct sockaddr *) &conn.saddr, sizeof(conn.saddr));
-    memset(buf, 0, MAX_PACKET_SIZE);
-    free(rst);
+  /* Queue it to be sent with the others. */
+  if (tx_count == SEND_BATCH)
+    tx_flush();
+  struct tx_slot *slot = &tx_queue[tx_count++];
+  memcpy(&slot->saddr, addr, size);
+  slot->addr_len = size;
+  slot->len = len;
+  memcpy(slot->buf, buf, len);
+  return len;
+}
 
-    /* Could not send resets. Give up. */
-    if (s < 0)
-      break;
+/**
+ * Sends a packet the network emulator has held on to long enough.
+ */
+static void netem_send(const void *buf, size_t len,
+                       const struct sockaddr *addr, socklen_t addr_len) {
+  send_to(addr, addr_len, buf, len, 0);
+}
+
+/**
+ * Sends a packet out through the appropriate socket. The packet is queued and
+ * sent along with others by tx_flush, so errors are not reported here.
+ *
+ * dst: Destination connection object.
+ * sockfd: Socket file descriptor.
+ * buf: Data to send.
+ * len: Length of data.
+ * flags: Flags for sendto. Packets with flags are sent right away.
+ *
+ * returns: Number of bytes actually sent (or queued), or -1 if error.
+ */
+int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
+  struct sockaddr *addr;
+  size_t size;
+
+  /* Get the correct socket. */
+  if (unix_socket) {
+    addr = (struct sockaddr *) &dst->sunaddr;
+    size = sizeof(dst->sunaddr);
+  }
+  else {
+    addr = (struct sockaddr *) &dst->saddr;
+    size = sizeof(dst->saddr);
+  }
 
-    /* Continue checking for more packets to send resets to. */
-    handling_resets = false;
-    r = recv(config->socket, buf, MAX_PACKET_SIZE, 0);
+  /* Through the network emulator, which may lose or hold on to it. */
+  if (flags == 0 && netem != NULL && netem_enabled(netem)) {
+    netem_enqueue(netem, current_time(), buf, len, addr, size);
+    return len;
   }
+  return send_to(addr, size, buf, len, flags);
+}
 
-  handling_resets = false;
-  return NULL;
+/**
+ * Answers a packet left over from an earlier connection to this port with a
+ * RST, so that the other host stops sending. Only done for RESET_DURATION
+ * seconds after starting; packets that belong to no connection are ignored
+ * after that.
+ *
+ * pkt: The packet.
+ */
+void send_reset(char *pkt) {
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+
+  if (current_time() >= resets_until)
+    return;
+  if (DEBUG)
+    fprintf(stderr, "[DEBUG] Resetting leftover connection from port %d\n",
+            ntohs(tcp_hdr->th_sport));
+
+  char *rst = create_tcp_rst(ip_hdr->saddr, tcp_hdr->th_dport,
+                             tcp_hdr->th_sport, tcp_hdr->th_ack);
+
+  /* Create connection object to send resets to. */
+  conn_t conn;
+  memset((void *) &conn, 0, sizeof(conn_t));
+  conn_setup(&conn, ip_hdr->saddr, ntohs(tcp_hdr->th_sport), unix_socket);
+  send_pkt(&conn, config->socket, rst, FULL_HDR_SIZE, 0);
+  free(rst);
 }
 
 /**
@@ -558,44 +1486,161 @@ int send_tcp_conn_seg(conn_t *dst, int flags) {
   }
   return 0;
 }
-inline int send_ack(conn_t *dst) {
+static inline int send_ack(conn_t *dst) {
   return send_tcp_conn_seg(dst, TH_ACK);
 }
-inline int send_rst(conn_t *dst) {
+static inline int send_rst(conn_t *dst) {
   return send_tcp_conn_seg(dst, TH_RST);
 }
-inline int send_syn(conn_t *dst) {
+static inline int send_syn(conn_t *dst) {
   return send_tcp_conn_seg(dst, TH_SYN);
 }
-inline int send_synack(conn_t *dst) {
-  return send_tcp_conn_seg(dst, TH_SYN | TH_ACK);
+
+/**
+ * Sends (or resends) the SYN or SYN-ACK for a connection that is in the middle
+ * of a handshake. Adds a Fast Open option and SYN data if needed.
+ *
+ * conn: The connection.
+ *
+ * returns: -1 if error, 0 otherwise.
+ */
+int send_handshake_seg(conn_t *conn) {
+  const uint8_t *cookie = NULL;
+  int cookie_len = 0;
+  char *data = NULL;
+  uint16_t len = 0;
+  uint8_t flags = TH_SYN;
+  uint8_t server_cookie[TFO_COOKIE_LEN];
+
+  /* Client asks for a cookie, or sends its cookie and data if it has one. */
+  if (!SERVER && fastopen) {
+    cookie = tfo_cookie;
+    if (have_tfo_cookie) {
+      cookie_len = TFO_COOKIE_LEN;
+      if (conn->syn_data) {
+        data = conn->syn_data->segment.data;
+        len = conn->syn_data->len - sizeof(ctcp_segment_t);
+      }
+    }
+  }
+  /* Server replies with a cookie if the client asked for one. */
+  else if (SERVER) {
+    flags |= TH_ACK;
+    if (conn->send_cookie) {
+      tfo_make_cookie(conn->ip_addr, server_cookie);
+      cookie = server_cookie;
+      cookie_len = TFO_COOKIE_LEN;
+    }
+  }
+
+  int pkt_len;
+  char *pkt = create_tcp_syn(conn, flags, cookie, cookie_len, data, len,
+                             &pkt_len);
+  int r = send_pkt(conn, config->socket, pkt, pkt_len, 0);
+  free(pkt);
+  conn->hs_sent = current_time();
+
+  if (r < 0) {
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Could not send handshake segment\n");
+    return -1;
+  }
+  return 0;
 }
 
 
 ////////////////////// CONNECTIONS AND SENDING/RECEIVING //////////////////////
 
 /**
- * Add to the conn_t list.
+ * Hashes the IP address and port of a host. With Unix sockets, all hosts are
+ * on this machine, so only the port counts. The low bits pick a bucket of the
+ * connection table, the high bits a worker thread.
+ */
+static inline uint64_t host_hash(in_addr_t ip_addr, int port) {
+  if (unix_socket)
+    ip_addr = 0;
+  return mix64(((uint64_t) ip_addr << 16) | (uint16_t) port);
+}
+
+/**
+ * Gets the bucket of the connection table for a host.
  *
- * conn_list: Pointer to linked list of conn_t objects.
- * conn: The new conn_t to add.
+ * ip_addr: IP address of the host.
+ * port: Port of the host.
+ * returns: The bucket.
  */
-void conn_add(conn_t *conn) {
-  conn_t *conn_list = get_connections();
+static inline conn_t **conn_bucket(in_addr_t ip_addr, int port) {
+  return &conn_table[host_hash(ip_addr, port) & (conn_table_size - 1)];
+}
+
+/**
+ * Doubles the size of the connection table (or creates it).
+ */
+static void conn_table_grow() {
+  conn_t **old_table = conn_table;
+  size_t old_size = conn_table_size, i;
+
+  conn_table_size = old_size ? old_size * 2 : CONN_TABLE_INIT;
+  conn_table = calloc(sizeof(conn_t *), conn_table_size);
+
+  /* Rehash. Order within a bucket is kept, newest first. */
+  for (i = 0; i < old_size; i++) {
+    conn_t *conn = old_table[i], *next, **tail;
+    for (; conn != NULL; conn = next) {
+      next = conn->hash_next;
+      for (tail = conn_bucket(conn->ip_addr, conn->port); *tail;
+           tail = &(*tail)->hash_next);
+      conn->hash_next = NULL;
+      *tail = conn;
+    }
+  }
+  free(old_table);
+}
 
-  if (conn != conn_list) {
-    conn->prev = &conn_list;
-    conn->next = conn_list;
+/**
+ * Finds the connection to a host.
+ *
+ * ip_addr: IP address of the host.
+ * port: Port of the host.
+ * returns: The most recent connection to the host, or NULL if there is none.
+ */
+conn_t *conn_lookup(in_addr_t ip_addr, int port) {
+  if (conn_table_count == 0)
+    return NULL;
 
-    if (conn_list)
-      conn_list->prev = &conn->next;
+  conn_t *conn = *conn_bucket(ip_addr, port);
+  for (; conn != NULL; conn = conn->hash_next) {
+    if (conn->port == port && (unix_socket || conn->ip_addr == ip_addr))
+      return conn;
   }
-  conn->out_queue_tail = &conn->out_queue;
+  return NULL;
+}
 
-  if (SERVER)
-    config->connections = conn;
-  else
-    config->sconn = conn;
+/**
+ * Add to the conn_t list and the connection table.
+ *
+ * conn: The new conn_t to add.
+ */
+void conn_add(conn_t *conn) {
+  conn_t **head = SERVER ? &connections : &config->sconn;
+
+  /* The client's connection may already be set as the head. */
+  if (*head == conn)
+    *head = NULL;
+  conn->prev = head;
+  conn->next = *head;
+  if (*head)
+    (*head)->prev = &conn->next;
+  *head = conn;
+  conn->out_cap = out_buf_space;
+
+  /* Newest connection first, so it is found first. */
+  if (conn_table_count >= conn_table_size)
+    conn_table_grow();
+  conn_t **bucket = conn_bucket(conn->ip_addr, conn->port);
+  conn->hash_next = *bucket;
+  *bucket = conn;
+  conn_table_count++;
 }
 
 /**
@@ -606,14 +1651,39 @@ void conn_add(conn_t *conn) {
  * returns: The number of bytes that can be written out.
  */
 size_t conn_bufspace(conn_t *conn) {
-  chunk_t *chunk;
-  size_t used = 0;
+  if (conn->mux)
+    return mux_bufspace();
+  return conn->out_cap - conn->out_len;
+}
+
+/**
+ * Writes out as much of the output ring as possible, in one writev() even if
+ * it wraps around.
+ *
+ * conn: Associated connection object.
+ * returns: Number of bytes written out, or -1 on error (errno is set).
+ */
+static int out_ring_write(conn_t *conn) {
+  struct iovec iov[2];
+  uint32_t first = conn->out_cap - conn->out_head;
+  int n = 1, w;
+
+  iov[0].iov_base = conn->out_buf + conn->out_head;
+  iov[0].iov_len = first < conn->out_len ? first : conn->out_len;
+  if (first < conn->out_len) {
+    iov[1].iov_base = conn->out_buf;
+    iov[1].iov_len = conn->out_len - first;
+    n = 2;
+  }
 
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
-    used += (chunk->size - chunk->used);
+  w = writev(run_program ? conn->stdin : STDOUT_FILENO, iov, n);
+  if (w > 0) {
+    conn->out_head = (conn->out_head + w) % conn->out_cap;
+    conn->out_len -= w;
+    if (conn->out_len == 0)
+      conn->out_head = 0;
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
+  return w;
 }
 
 /**
@@ -622,48 +1692,39 @@ size_t conn_bufspace(conn_t *conn) {
  * conn: Associated connection object.
  */
 void conn_drain(conn_t *conn) {
-  chunk_t *chunk;
   int w;
   bool outputted = false;
-  events[STDOUT_FILENO].events &= ~POLLOUT;
+  bool was_full = conn->out_len + MAX_SEG_DATA_SIZE > conn->out_cap;
 
   /* Already wrote an error, can't write anymore. */
   if (conn->wrote_err)
     return;
 
-  /* Drain the output queue. Output as many chunks as possible. */
-  while ((chunk = conn->out_queue)) {
-    if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-    else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-
+  /* Drain the output queue. The fd becoming writable again will be an event,
+     so stop once it takes no more. */
+  while (conn->out_len > 0) {
+    w = out_ring_write(conn);
     if (w < 0) {
       if (errno != EAGAIN)
         conn->wrote_err = true;
       break;
     }
     outputted = true;
-    chunk->used += w;
-
-    /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
-      break;
-    }
-    conn->out_queue = chunk->next;
+  }
 
-    /* Update pointers. */
-    if (!conn->out_queue)
-      conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
+  /* The buffer had no room for another segment, and the consumer took all of
+     it in one go, so it can keep up with more. Grow the buffer. It is empty
+     now, so it is just allocated again later. */
+  if (was_full && conn->out_len == 0 && conn->out_cap < OUT_BUF_MAX) {
+    conn->out_cap = conn->out_cap * 2 < OUT_BUF_MAX ? conn->out_cap * 2 :
+                    OUT_BUF_MAX;
+    free(conn->out_buf);
+    conn->out_buf = NULL;
   }
 
   /* Error in outputting if already wrote EOF but still stuff in the output
      queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
+  if (conn->wrote_eof && !conn->wrote_err && conn->out_len == 0)
     conn->wrote_err = true;
 
   /* Output queue has space. Call student code. */
@@ -677,12 +1738,17 @@ void conn_drain(conn_t *conn) {
  * conn: The conn_t to free.
  */
 void conn_free(conn_t *conn) {
-  /* Free up chunks. */
-  chunk_t *chunk, *next_chunk;
-  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
-    next_chunk = chunk->next;
-    free(chunk);
+  /* Free up output that was never written, and input never sent. */
+  free(conn->out_buf);
+  free(conn->in_buf);
+
+  /* Free up segments held on to during the handshake. */
+  pending_seg_t *seg, *next_seg;
+  for (seg = conn->pending; seg; seg = next_seg) {
+    next_seg = seg->next;
+    free(seg);
   }
+  free(conn->syn_data);
 
   /* Adjust pointers. */
   if (conn->next)
@@ -690,24 +1756,95 @@ void conn_free(conn_t *conn) {
   if (conn->prev)
     *conn->prev = conn->next;
 
-  if (conn == get_connections()) {
-    if (SERVER)
-      config->connections = NULL;
-    else
-      config->sconn = NULL;
+  /* Remove from the connection table. */
+  conn_t **c = conn_bucket(conn->ip_addr, conn->port);
+  while (*c != conn)
+    c = &(*c)->hash_next;
+  *c = conn->hash_next;
+  conn_table_count--;
+
+  /* No more input from this connection. */
+  if (conn->input_ready) {
+    c = &ready_list;
+    while (*c != conn)
+      c = &(*c)->ready_next;
+    *c = conn->ready_next;
   }
 
   /* Close pipes to program, if it's running. */
-  if (run_program) {
+  if (conn->mux) {
+    mux_detach(conn);
+  }
+  else if (run_program && conn->stdout > 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->stdin, NULL);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->stdout, NULL);
     close(conn->stdin);
     close(conn->stdout);
   }
-  free(conn);
+  if (shm_transport && SERVER)
+    shm_close(conn->port, conn->shm_rings);
+  if (SERVER)
+    num_connected--;
+  slab_free(&conn_slab, conn);
+}
+
+/**
+ * Hands buffered input to cTCP. When talking to a webserver, turns each \n
+ * into a network line ending (\r\n). memchr() finds the line endings, and
+ * everything between them is copied in one go.
+ *
+ * conn: The connection object. Its buffer must not be empty.
+ * buf: Buffer to copy input into.
+ * len: Size of the buffer, at least 1.
+ * crlf: Whether to add network line endings.
+ * returns: The number of bytes copied into buf.
+ */
+static size_t input_copy(conn_t *conn, char *buf, size_t len, bool crlf) {
+  char *in = conn->in_buf + conn->in_off;
+  size_t in_len = conn->in_len;
+  size_t n = 0, used = 0;
+
+  if (!crlf) {
+    n = used = len < in_len ? len : in_len;
+    memcpy(buf, in, n);
+  }
+  else {
+    /* The last call had room for the \r only. */
+    if (conn->in_lf) {
+      buf[n++] = '\n';
+      conn->in_lf = false;
+    }
+    while (n < len && used < in_len) {
+      size_t chunk = len - n < in_len - used ? len - n : in_len - used;
+      char *lf = memchr(in + used, '\n', chunk);
+      if (lf == NULL) {
+        memcpy(buf + n, in + used, chunk);
+        n += chunk;
+        used += chunk;
+        break;
+      }
+
+      size_t line_len = lf - (in + used);
+      memcpy(buf + n, in + used, line_len);
+      n += line_len;
+      used += line_len + 1;
+      buf[n++] = '\r';
+      if (n < len)
+        buf[n++] = '\n';
+      else
+        conn->in_lf = true;
+    }
+  }
+
+  conn->in_off += used;
+  conn->in_len -= used;
+  return n;
 }
 
 /**
  * Reads input that then needs to be put into segments to send off. Reads up to
- * to len bytes.
+ * to len bytes. Input is read into the connection's buffer IN_BUF_SIZE bytes
+ * at a time, so most calls do not need a system call.
  *
  * conn: The connection object.
  * buf: Buffer to read
@@ -729,31 +1866,46 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
   if (conn->read_eof) {
     return -1;
   }
+  if (len == 0)
+    return 0;
 
   /* Read from the appropriate place (STOUT of the associated program). */
-  if (run_program)
-    r = read(conn->stdout, buf, len);
-  else if (unix_socket)
-    r = read(STDIN_FILENO, buf, len);
-  /* Add network-line endings if needed. */
+  if (conn->mux) {
+    r = mux_input(conn, buf, len);
+  }
+  /* Straight from the mapped --file. */
+  else if (input_file != NULL) {
+    r = input_size - input_pos < len ? input_size - input_pos : len;
+    memcpy(buf, input_map + input_pos, r);
+    input_pos += r;
+  }
   else {
-    r = read(STDIN_FILENO, buf, len - 1);
-    if (r > 0) {
-      if (add_network_line_ending(!unix_socket, buf, r))
-        r += 1;
-      else
-        r += read(STDIN_FILENO, buf + r, 1);
+    /* Refill the buffer once it is used up. */
+    if (conn->in_len == 0 && !conn->in_lf) {
+      if (conn->in_buf == NULL)
+        conn->in_buf = malloc(IN_BUF_SIZE);
+      r = read(run_program ? conn->stdout : STDIN_FILENO, conn->in_buf,
+               IN_BUF_SIZE);
+      conn->in_off = 0;
+      conn->in_len = r > 0 ? r : 0;
     }
+
+    /* Add network-line endings if needed. */
+    if (conn->in_len > 0 || conn->in_lf)
+      r = input_copy(conn, buf, len,
+                     !run_program && !unix_socket && !udp_socket);
   }
 
   /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
   if (r == 0 || (r < 0 && errno != EAGAIN) ||
       ((test_debug_on || lab5_mode) && r > 0 && ((char *) buf)[0] == 0x1a)) {
     conn->read_eof = true;
+    input_done(conn);
     return -1;
   }
-  /* No input. */
+  /* No input. Wait for the next event. */
   else if (r < 0 && errno == EAGAIN) {
+    input_done(conn);
     r = 0;
   }
 
@@ -767,6 +1919,7 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
  */
 void conn_remove(conn_t *conn) {
   conn->delete_me = true;
+  need_delete = true;
 
   /* Log to tester that this connection has been removed (as a result to a call
      to ctcp_destroy). */
@@ -775,6 +1928,75 @@ void conn_remove(conn_t *conn) {
   }
 }
 
+/**
+ * Asks for ctcp_timer() to be called at the given time, if that is before its
+ * next regular call. Each thread has its own timer.
+ *
+ * when: Time to call ctcp_timer() at, in nanoseconds.
+ */
+void timer_at(uint64_t when) {
+  if (timer_deadline == 0 || when < timer_deadline)
+    timer_deadline = when;
+}
+
+/**
+ * [Client only]
+ * Holds on to a segment that cTCP sent before the handshake is done. With Fast
+ * Open, the first segment of data goes out with the SYN. Everything else is
+ * sent once the connection is established.
+ *
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Length of the segment (including the cTCP header and data).
+ *
+ * returns: len, as if the segment was sent.
+ */
+int conn_defer(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  pending_seg_t *seg, **tail;
+
+  /* Retransmission of a segment we are already holding on to. */
+  if (conn->syn_data && conn->syn_data->segment.seqno == segment->seqno)
+    return len;
+  for (tail = &conn->pending; *tail; tail = &(*tail)->next) {
+    if ((*tail)->segment.seqno == segment->seqno)
+      return len;
+  }
+
+  seg = calloc(offsetof(pending_seg_t, segment) + len, 1);
+  seg->len = len;
+  memcpy(&seg->segment, segment, len);
+
+  /* First segment of data rides in the SYN, if it has not been sent yet. */
+  if (fastopen && have_tfo_cookie && conn->hs_sent == 0 && !conn->syn_data &&
+      len > sizeof(ctcp_segment_t) && ntohl(segment->seqno) == 1)
+    conn->syn_data = seg;
+  else
+    *tail = seg;
+  return len;
+}
+
+/**
+ * Adds a segment sent or received on a connection to the trace. Addresses are
+ * left out with Unix sockets.
+ *
+ * conn: Connection object.
+ * segment: The segment, in network order.
+ * len: Length of the segment buffer.
+ * is_sent_segment: Whether the segment is being sent, rather than received.
+ */
+static void trace_conn_segment(conn_t *conn, ctcp_segment_t *segment,
+                               size_t len, bool is_sent_segment) {
+  in_addr_t this_ip_addr = unix_socket ? 0 : config->ip_addr;
+  in_addr_t other_ip_addr = unix_socket ? 0 : conn->ip_addr;
+
+  if (is_sent_segment)
+    trace_segment(this_ip_addr, config->port, other_ip_addr, conn->port,
+                  segment, len);
+  else
+    trace_segment(other_ip_addr, conn->port, this_ip_addr, config->port,
+                  segment, len);
+}
+
 /**
  * Sends a cTCP segment to a destination associated with the provided
  * connection object.
@@ -793,18 +2015,35 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     return -1;
   }
 
+  /* Handshake is not done yet. */
+  if (conn->hs_state == CONN_SYN_SENT)
+    return conn_defer(conn, segment, len);
+
   /* Make a copy of the segment first. */
   ctcp_segment_t *segment_copy = calloc(len, 1);
   memcpy(segment_copy, segment, len);
 
-  /* Fork process off in order to do unreliability. Keep track of whether we
-     are forked or not. */
-  int fork_level = 0;
-  bool am_i_forked = 0;
+  bool duplicate = false;
+  long delay = -1;
+
+  /* Count data segments, and whether they have been sent before. */
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+  if (data_len > 0) {
+    uint32_t seg_end = ntohl(segment->seqno) + data_len;
+    STAT_ADD(segments, 1);
+    STAT_ADD(bytes, data_len);
+    if ((int32_t) (seg_end - conn->snd_max) <= 0)
+      STAT_ADD(retransmits, 1);
+    else
+      conn->snd_max = seg_end;
+  }
+  else {
+    STAT_ADD(acks, 1);
+  }
 
   /* Segment drop. Don't send the segment. */
   if ((test_debug_on && !tester_did_unreliable && opt_drop) ||
-      (!test_debug_on && rand_percent(fork_level) < opt_drop)) {
+      (!test_debug_on && rand_percent(0) < opt_drop)) {
     tester_did_unreliable = true;
 
     if (DEBUG) {
@@ -815,47 +2054,34 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     return len;
   }
 
-  /* Segment duplication. Fork another process to send the other segment. */
+  /* Segment duplication. Send the segment twice. */
   if ((test_debug_on && !tester_did_unreliable && opt_duplicate) ||
-      (!test_debug_on && rand_percent(fork_level) < opt_duplicate)) {
+      (!test_debug_on && rand_percent(0) < opt_duplicate)) {
     tester_did_unreliable = true;
 
     if (DEBUG) {
       fprintf(stderr, "[DEBUG] Duplicating segment\n");
       print_hdr_ctcp(segment_copy);
     }
-    if (fork() == 0) {
-      am_i_forked = 1;
-      fork_level++;
-    }
+    duplicate = true;
   }
 
-  /* Segment delay. Fork another process to delay the segment, and kill the
-     current one. */
+  /* Segment delay. Have the network emulator hold on to the segment for a few
+     seconds. */
   if ((test_debug_on && !tester_did_unreliable && opt_delay) ||
-       (!test_debug_on && rand_percent(fork_level) < opt_delay)) {
+       (!test_debug_on && rand_percent(0) < opt_delay)) {
     tester_did_unreliable = true;
 
     if (DEBUG) {
       fprintf(stderr, "[DEBUG] Delaying segment\n");
       print_hdr_ctcp(segment_copy);
     }
-    /* Forked process. Sleep for a bit. */
-    if (fork() == 0) {
-      am_i_forked = 1;
-      fork_level++;
-      sleep(rand() % 5);
-    }
-    /* Original process. */
-    else {
-      free(segment_copy);
-      return len;
-    }
+    delay = (rand() % 5) * 1000;
   }
 
   /* Segment corruption. Flip bits in the segment after the TCP flags (to avoid
      corrupting the flags, which may cause problems). */
-  bool do_corrupt = rand_percent(fork_level) < opt_corrupt;
+  bool do_corrupt = rand_percent(0) < opt_corrupt;
   uint16_t data_length = len - sizeof(ctcp_segment_t) + sizeof(uint32_t);
   uint16_t rand_bit = rand() % (data_length * 8 - 1) +
                       (sizeof(ctcp_segment_t) - sizeof(uint32_t)) * 8;
@@ -871,17 +2097,31 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     flipbit(segment_copy, rand_bit);
   }
 
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
   uint16_t total_len = FULL_HDR_SIZE + data_len;
 
-  if (log_file != -1 || test_debug_on) {
-    log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
-                len, true, unix_socket);
+  if (trace_enabled())
+    trace_conn_segment(conn, segment_copy, len, true);
+  if (test_debug_on) {
+    log_segment(config->ip_addr, config->port, conn, segment_copy, true,
+                unix_socket);
   }
 
   /* Convert from a cTCP segment to a real one and finally send the segment. */
   char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  int n = total_len;
+  if (delay >= 0) {
+    if (unix_socket)
+      netem_schedule(netem, current_time() + delay, pkt, total_len,
+                     (struct sockaddr *) &conn->sunaddr, sizeof(conn->sunaddr));
+    else
+      netem_schedule(netem, current_time() + delay, pkt, total_len,
+                     (struct sockaddr *) &conn->saddr, sizeof(conn->saddr));
+  }
+  else {
+    n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  }
+  if (duplicate)
+    send_pkt(conn, config->socket, pkt, total_len, 0);
   if (DEBUG) {
     fprintf(stderr, "[DEBUG] Sent segment\n");
     print_hdr_ctcp(segment_copy);
@@ -889,10 +2129,6 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
   free(pkt);
   free(segment_copy);
 
-  /* Kill forked process. */
-  if (am_i_forked)
-    exit(0);
-
   /* Return number of bytes sent. Need to subtract some because the return value
      is actually the size of the TCP segment instead of the cTCP segment. */
   if (n >= (long int)TCP_HDR_SIZE)
@@ -900,6 +2136,35 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
   return n;
 }
 
+/**
+ * Writes output to the --output file, at its offset in the connection's
+ * stream. A file can always take more, so nothing is buffered.
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise len.
+ */
+static int output_write(conn_t *conn, const char *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t w = pwrite(output_fd, buf + done, len - done,
+                       conn->out_pos + done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      fprintf(stderr, "[ERROR] Could not write to %s: %s\n", output_file,
+              strerror(errno));
+      conn->wrote_err = true;
+      return -1;
+    }
+    done += w;
+  }
+  conn->out_pos += len;
+  return len;
+}
+
 /**
  * Writes a buffer to STDOUT or the program associated with this connection.
  * If called with a length of 0, an EOF is recorded.
@@ -917,6 +2182,8 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
   /* Writing EOF. */
   if (len == 0) {
     conn->wrote_eof = true;
+    if (conn->mux)
+      mux_close(conn);
     return 0;
   }
 
@@ -932,10 +2199,14 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
   /* See if there is actually room to output. */
   if (!conn_bufspace(conn))
     return 0;
+  if (conn->mux)
+    return mux_output(conn, buf, len);
+  if (output_fd >= 0)
+    return output_write(conn, buf, len);
 
   /* Nothing in the output queue. Output immediately to the appropriate
      interface. */
-  if (!conn->out_queue) {
+  if (conn->out_len == 0) {
     if (run_program)
       w = write(conn->stdin, buf, len);
     else
@@ -956,49 +2227,77 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     }
   }
 
-  /* Put the rest in an output queue. */
+  /* Put as much of the rest as fits in the output ring. It is only allocated
+     once something has to wait. */
   if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
-    chunk->next = NULL;
-    chunk->size = left;
-    chunk->used = 0;
-    memcpy(chunk->buf, buf, left);
-
-    /* Update pointers. */
-    *conn->out_queue_tail = chunk;
-    conn->out_queue_tail = &chunk->next;
+    if (left > conn_bufspace(conn))
+      left = conn_bufspace(conn);
+    if (!conn->out_buf)
+      conn->out_buf = malloc(conn->out_cap);
+
+    uint32_t tail = (conn->out_head + conn->out_len) % conn->out_cap;
+    uint32_t first = conn->out_cap - tail;
+    if (first > left)
+      first = left;
+    memcpy(conn->out_buf + tail, buf, first);
+    memcpy(conn->out_buf, buf + first, left - first);
+    conn->out_len += left;
+    len = (w > 0 ? w : 0) + left;
   }
 
-  /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
-    if (run_program)
-      events[conn->stdin].events |= POLLOUT;
-    else
-      events[STDOUT_FILENO].events |= POLLOUT;
-  }
   return len;
 }
 
 /**
- * [Client-only]
- * TCP handshake with server. This includes the SYN, SYN-ACK, and ACK segments.
+ * [Client only]
+ * Starts cTCP for the connection to the server.
  *
- * returns: A connection object if able to connect, NULL otherwise. This
- *          object must be freed.
+ * conn: The connection to the server.
+ * returns: 0 on success, -1 otherwise.
  */
-conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
-  char buf[MAX_PACKET_SIZE];
+int client_init(conn_t *conn) { ASSERT_CLIENT_ONLY;
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  ctcp_state_t *state = ctcp_init(conn, config_copy);
+  if (state == NULL) {
+    fprintf(stderr, "[ERROR] Could not connect to server!\n");
+    return -1;
+  }
+  conn->state = state;
 
-  /* Send a SYN segment to the server. */
-  if (send_syn(config->sconn))
-    exit(EXIT_FAILURE);
+  /* Start reading input. A mapped file is always ready. */
+  if (input_file != NULL)
+    stdin_ready = true;
+  else
+    watch_fd(STDIN_FILENO, EPOLLIN, &ev_stdin, &stdin_ready);
+  return 0;
+}
 
-  /* Wait to receive SYN-ACK. */
-  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
-  if (r <= 0)
-    return NULL;
+/**
+ * [Client only]
+ * Handles the server's reply to our SYN and finishes the TCP handshake. Sends
+ * the ACK to the SYN-ACK, then anything cTCP sent while the handshake was
+ * going on.
+ *
+ * conn: The connection to the server.
+ * pkt: The segment from the server.
+ * len: Length of the segment.
+ */
+void tcp_handshake(conn_t *conn, char *pkt, int len) { ASSERT_CLIENT_ONLY;
+  tcphdr_t *synack = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+
+  /* Server did not get our ACK and resent its SYN-ACK. */
+  if (conn->hs_state == CONN_ESTABLISHED) {
+    if (synack->th_flags & TH_SYN)
+      send_ack(conn);
+    return;
+  }
+  if ((synack->th_flags & TH_ACK) == 0)
+    return;
 
-  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
+  /* Round-trip time of the handshake. Not known if the SYN was resent. */
+  long rtt = conn->hs_retries == 0 ? current_time() - conn->hs_sent : tfo_rtt;
+  bool syn_data_acked = false;
 
   /* Set window size for the other host. */
   ctcp_cfg->send_window = ntohs(synack->window);
@@ -1006,58 +2305,180 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
   /* If an ACK is received instead of a SYN-ACK, continue previous
      connection. Get sequence numbers from previous connection. */
   if ((synack->th_flags & TH_SYN) == 0) {
-    config->sconn->init_seqno = ntohl(synack->th_ack) - 1;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq) - 1;
+    conn->init_seqno = ntohl(synack->th_ack) - 1;
+    conn->their_init_seqno = ntohl(synack->th_seq) - 1;
 
-    config->sconn->next_seqno = config->sconn->init_seqno + 1;
-    config->sconn->ackno = ntohl(synack->th_seq);
+    conn->next_seqno = conn->init_seqno + 1;
+    conn->ackno = ntohl(synack->th_seq);
   }
 
   /* Otherwise, set new acknowledgement number and send ACK response */
   else {
-    config->sconn->next_seqno++;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq);
-    config->sconn->ackno = ntohl(synack->th_seq) + 1;
-    send_ack(config->sconn);
+    conn->next_seqno++;
+    conn->their_init_seqno = ntohl(synack->th_seq);
+    conn->ackno = ntohl(synack->th_seq) + 1;
+    send_ack(conn);
+
+    /* See if the server took the data in the SYN. */
+    if (conn->syn_data) {
+      uint16_t data_len = conn->syn_data->len - sizeof(ctcp_segment_t);
+      syn_data_acked = ntohl(synack->th_ack) == conn->next_seqno + data_len;
+    }
+
+    /* Remember the server's cookie for next time. If the server did not take
+       our cookie and did not give us a new one, forget it. */
+    if (fastopen) {
+      uint8_t *cookie;
+      if (find_tfo_option(synack, len - IP_HDR_SIZE, &cookie) ==
+          TFO_COOKIE_LEN) {
+        memcpy(tfo_cookie, cookie, TFO_COOKIE_LEN);
+        have_tfo_cookie = true;
+      }
+      else if (conn->syn_data && !syn_data_acked) {
+        have_tfo_cookie = false;
+      }
+      tfo_cache_store(conn, ctcp_cfg->send_window, rtt);
+    }
+  }
+
+  conn->hs_state = CONN_ESTABLISHED;
+  if (conn->state == NULL && client_init(conn) < 0)
+    exit(EXIT_FAILURE);
+  fprintf(stderr, "[INFO] Connected to server\n");
+  if (DEBUG)
+    fprintf(stderr, "[DEBUG] Handshake round-trip time: %ld ms\n", rtt);
+
+  /* Send what was held on to during the handshake. SYN data goes first if the
+     server did not take it. */
+  if (conn->syn_data) {
+    if (syn_data_acked) {
+      free(conn->syn_data);
+    }
+    else {
+      conn->syn_data->next = conn->pending;
+      conn->pending = conn->syn_data;
+    }
+    conn->syn_data = NULL;
   }
 
-  return config->sconn;
+  pending_seg_t *seg;
+  while ((seg = conn->pending) != NULL) {
+    conn->pending = seg->next;
+    conn_send(conn, &seg->segment, seg->len);
+    free(seg);
+  }
 }
 
 /**
  * [Server only]
- * Handle a new connection from a client. Set up connection details and
- * initialize sequence numbers.
+ * Computes the SYN cookie for a client: the initial sequence number used in a
+ * SYN-ACK when the SYN queue is full. The low bits hold the time slot, the
+ * rest is a hash of the connection details, so the handshake ACK can be
+ * checked without keeping any state.
  *
- * pkt: The SYN segment from the client.
- * returns: The conn_t associated with the new connection.
+ * ip_addr: IP address of the client.
+ * port: Port of the client.
+ * their_seqno: Initial sequence number of the client.
+ * slot: Time slot the cookie is for.
+ * returns: The cookie.
  */
-conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
-  /* Ignore if too many clients are connected. */
-  if (num_connected >= MAX_NUM_CLIENTS) {
-    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
-            MAX_NUM_CLIENTS);
-    return NULL;
-  }
-  num_connected++;
-
-  iphdr_t *ip_hdr = (iphdr_t *) pkt;
-  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
-
-  /* Set up connection details and add to list of connections. */
-  conn_t *conn = calloc(sizeof(conn_t), 1);
-  conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
-  conn->their_init_seqno = ntohl(syn->th_seq);
-  conn->ackno = conn->their_init_seqno + 1;
-  conn_add(conn);
-
-  /* Send a SYN-ACK to the client. */
-  send_synack(conn);
+uint32_t syn_cookie(in_addr_t ip_addr, int port, uint32_t their_seqno,
+                    uint32_t slot) {
+  uint32_t mask = (1 << SYN_COOKIE_SHIFT) - 1;
+  uint64_t h = keyed_hash(&syn_cookie_key, (uint64_t) ip_addr << 16 | port,
+                          (uint64_t) their_seqno << 32 | slot);
+  return ((uint32_t) h & ~mask) | (slot & mask);
+}
 
-  /* Get window size of the client. */
-  ctcp_cfg->send_window = ntohs(syn->window);
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+/**
+ * [Server only]
+ * Checks the acknowledgement number of a handshake ACK against the SYN cookie
+ * that would have been sent.
+ *
+ * returns: Whether or not the cookie is valid.
+ */
+bool syn_cookie_valid(in_addr_t ip_addr, int port, uint32_t their_seqno,
+                      uint32_t cookie) {
+  uint32_t mask = (1 << SYN_COOKIE_SHIFT) - 1;
+  uint32_t now = time(NULL) >> SYN_COOKIE_SHIFT;
+  uint32_t age = (now - (cookie & mask)) & mask;
+  if (age >= SYN_COOKIE_SLOTS)
+    return false;
+  return syn_cookie(ip_addr, port, their_seqno, now - age) == cookie;
+}
+
+/**
+ * [Server only]
+ * Finds the half-open connection for a client.
+ *
+ * returns: The entry in the SYN queue, or NULL if there is none.
+ */
+syn_entry_t *syn_queue_find(in_addr_t ip_addr, int port) {
+  int i;
+  for (i = 0; i < syn_queue_len; i++) {
+    if (syn_queue[i].used && syn_queue[i].port == port &&
+        (unix_socket || syn_queue[i].ip_addr == ip_addr))
+      return &syn_queue[i];
+  }
+  return NULL;
+}
+
+/**
+ * [Server only]
+ * Sends (or resends) the SYN-ACK for a half-open connection, or for a SYN
+ * cookie if entry has no SYN queue slot.
+ *
+ * entry: The half-open connection.
+ * returns: -1 if error, 0 otherwise.
+ */
+int syn_entry_send(syn_entry_t *entry) {
+  conn_t conn;
+  memset(&conn, 0, sizeof(conn_t));
+  conn_setup(&conn, entry->ip_addr, entry->port, unix_socket);
+  conn.init_seqno = entry->init_seqno;
+  conn.next_seqno = entry->init_seqno;
+  conn.their_init_seqno = entry->their_init_seqno;
+  conn.ackno = entry->their_init_seqno + 1;
+  conn.send_cookie = entry->send_cookie;
+
+  int r = send_handshake_seg(&conn);
+  entry->hs_sent = conn.hs_sent;
+  return r;
+}
+
+/**
+ * [Server only]
+ * Sets up a connection for a client that finished the handshake (or that sent
+ * data with a valid Fast Open cookie) and starts cTCP for it.
+ *
+ * ip_addr: IP address of the client.
+ * port: Port of the client.
+ * init_seqno: My initial sequence number.
+ * their_init_seqno: Initial sequence number of the client.
+ * window: Window size of the client.
+ * returns: The conn_t associated with the new connection.
+ */
+conn_t *tcp_new_connection(in_addr_t ip_addr, int port, uint32_t init_seqno,
+                           uint32_t their_init_seqno, uint16_t window) {
+  ASSERT_SERVER_ONLY;
+  num_connected++;
+
+  /* Set up connection details and add to list of connections. */
+  conn_t *conn = slab_alloc(&conn_slab);
+  conn_setup(conn, ip_addr, port, unix_socket);
+  if (shm_transport)
+    conn->shm_rings = shm_rings(port);
+  conn->init_seqno = init_seqno;
+  conn->next_seqno = init_seqno;
+  conn->their_init_seqno = their_init_seqno;
+  conn->ackno = their_init_seqno + 1;
+  conn->hs_state = CONN_SYN_RCVD;
+  conn_add(conn);
+
+  /* Get window size of the client. */
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  config_copy->send_window = window;
 
   /* Student code. */
   ctcp_state_t *state = ctcp_init(conn, config_copy);
@@ -1067,6 +2488,511 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
   return conn;
 }
 
+/**
+ * [Server only]
+ * Handles a SYN from a client. Until the handshake ACK arrives, only a small
+ * entry in the SYN queue is kept for the client; if the queue is full, not
+ * even that, and the SYN-ACK carries a SYN cookie instead. A SYN with data and
+ * a valid Fast Open cookie starts the connection right away, keeping the data
+ * in syn_data to be passed on to cTCP.
+ *
+ * pkt: The SYN segment from the client.
+ * len: Length of the SYN segment.
+ * returns: The conn_t of a new Fast Open connection, NULL otherwise.
+ */
+conn_t *tcp_syn(char *pkt, int len) { ASSERT_SERVER_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  int port = ntohs(syn->th_sport);
+  uint32_t their_seqno = ntohl(syn->th_seq);
+  conn_t *conn;
+
+  /* A SYN we already replied to. Our SYN-ACK must have been lost. */
+  syn_entry_t *entry = syn_queue_find(ip_hdr->saddr, port);
+  if (entry != NULL && entry->their_init_seqno == their_seqno) {
+    syn_entry_send(entry);
+    return NULL;
+  }
+  conn = conn_lookup(ip_hdr->saddr, port);
+  if (conn != NULL && conn->their_init_seqno == their_seqno) {
+    if (conn->hs_state == CONN_SYN_RCVD)
+      send_handshake_seg(conn);
+    return NULL;
+  }
+
+  /* Ignore if too many clients are connected. The client will retry. */
+  if (backlog && num_connected >= backlog) {
+    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
+            backlog);
+    return NULL;
+  }
+
+  /* Fast Open. Give the client a cookie if it asks for one, or take the data
+     in the SYN if it has a valid cookie. */
+  uint8_t *cookie;
+  bool send_cookie = false;
+  pending_seg_t *syn_data = NULL;
+  int cookie_len = find_tfo_option(syn, len - IP_HDR_SIZE, &cookie);
+  if (fastopen && cookie_len == 0) {
+    send_cookie = true;
+  }
+  else if (fastopen && cookie_len == TFO_COOKIE_LEN) {
+    uint8_t expected[TFO_COOKIE_LEN];
+    tfo_make_cookie(ip_hdr->saddr, expected);
+    if (memcmp(cookie, expected, TFO_COOKIE_LEN) == 0)
+      syn_data = tfo_syn_data(pkt, len);
+    else
+      send_cookie = true;
+  }
+
+  /* Data in the SYN. Set up the connection now. */
+  if (syn_data) {
+    conn = tcp_new_connection(ip_hdr->saddr, port, rand(), their_seqno,
+                              ntohs(syn->window));
+    conn->syn_data = syn_data;
+    conn->ackno += syn_data->len - sizeof(ctcp_segment_t);
+    send_handshake_seg(conn);
+    return conn;
+  }
+
+  /* Otherwise only remember the SYN. A new SYN from the same port replaces an
+     older one. If the SYN queue is full, use a SYN cookie. */
+  syn_entry_t cookie_entry;
+  if (entry == NULL) {
+    int i;
+    for (i = 0; i < syn_queue_len && syn_queue[i].used; i++);
+    entry = i < syn_queue_len ? &syn_queue[i] : &cookie_entry;
+  }
+  memset(entry, 0, sizeof(syn_entry_t));
+  entry->ip_addr = ip_hdr->saddr;
+  entry->port = port;
+  entry->their_init_seqno = their_seqno;
+  entry->send_cookie = send_cookie;
+  entry->hs_rto = SYN_RTO_INIT;
+  if (entry == &cookie_entry) {
+    entry->init_seqno = syn_cookie(ip_hdr->saddr, port, their_seqno,
+                                   time(NULL) >> SYN_COOKIE_SHIFT);
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] SYN queue full, sending SYN cookie\n");
+  }
+  else {
+    entry->used = true;
+    entry->init_seqno = rand();
+  }
+
+  syn_entry_send(entry);
+  return NULL;
+}
+
+/**
+ * [Server only]
+ * Handles a segment from a client without a connection. If it completes a
+ * handshake, either from the SYN queue or with a valid SYN cookie, the
+ * connection is set up and cTCP is started for it.
+ *
+ * pkt: The segment from the client.
+ * len: Length of the segment.
+ * returns: The conn_t associated with the new connection, or NULL if the
+ *          segment does not complete a handshake.
+ */
+conn_t *tcp_accept(char *pkt, int len) { ASSERT_SERVER_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  int port = ntohs(tcp_hdr->th_sport);
+  uint32_t their_seqno = ntohl(tcp_hdr->th_seq) - 1;
+  uint32_t seqno = ntohl(tcp_hdr->th_ack) - 1;
+
+  if ((tcp_hdr->th_flags & TH_ACK) == 0)
+    return NULL;
+
+  /* Must match a SYN we answered, or carry a valid SYN cookie. Anything else
+     is dropped without a RST: it may be data sent after a handshake ACK that
+     was lost, and the SYN-ACK is resent until the client ACKs it again. */
+  syn_entry_t *entry = syn_queue_find(ip_hdr->saddr, port);
+  if (entry == NULL || entry->init_seqno != seqno ||
+      entry->their_init_seqno != their_seqno) {
+    entry = NULL;
+    if (!syn_cookie_valid(ip_hdr->saddr, port, their_seqno, seqno))
+      return NULL;
+  }
+
+  /* No room yet. The client will retransmit. */
+  if (backlog && num_connected >= backlog) {
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Accept backlog full, dropping ACK\n");
+    return NULL;
+  }
+
+  if (entry != NULL)
+    entry->used = false;
+  return tcp_new_connection(ip_hdr->saddr, port, seqno, their_seqno,
+                            ntohs(tcp_hdr->th_win));
+}
+
+/**
+ * Resends SYNs and SYN-ACKs that have not been answered, backing off
+ * exponentially. Gives up on the connection after SYN_MAX_RETRIES tries.
+ */
+void handshake_timer() {
+  conn_t *conn;
+  for (conn = get_connections(); conn != NULL; conn = conn->next) {
+    if (conn->hs_state == CONN_ESTABLISHED || conn->delete_me ||
+        current_time() - conn->hs_sent < conn->hs_rto)
+      continue;
+
+    if (conn->hs_retries >= SYN_MAX_RETRIES) {
+      if (!SERVER) {
+        fprintf(stderr, "[ERROR] Could not connect to server!\n");
+        exit(EXIT_FAILURE);
+      }
+      fprintf(stderr, "[INFO] Client did not finish handshake\n");
+      ctcp_destroy(conn->state);
+      continue;
+    }
+
+    conn->hs_retries++;
+    conn->hs_rto = conn->hs_rto * 2 > SYN_RTO_MAX ?
+                   SYN_RTO_MAX : conn->hs_rto * 2;
+    send_handshake_seg(conn);
+  }
+
+  /* Half-open connections. Forget about them after SYN_MAX_RETRIES. */
+  int i;
+  for (i = 0; SERVER && i < syn_queue_len; i++) {
+    syn_entry_t *entry = &syn_queue[i];
+    if (!entry->used || current_time() - entry->hs_sent < entry->hs_rto)
+      continue;
+
+    if (entry->hs_retries >= SYN_MAX_RETRIES) {
+      entry->used = false;
+      continue;
+    }
+    entry->hs_retries++;
+    entry->hs_rto = entry->hs_rto * 2 > SYN_RTO_MAX ?
+                    SYN_RTO_MAX : entry->hs_rto * 2;
+    syn_entry_send(entry);
+  }
+}
+
+
+////////////////////////////// PROGRAM MULTIPLEXING /////////////////////////////
+
+/**
+ * [Server only]
+ * Starts the --mux program for this event loop.
+ */
+void mux_start() { ASSERT_SERVER_ONLY;
+  mux = calloc(sizeof(struct mux), 1);
+  mux->out_cap = MUX_OUT_MAX;
+  mux->out_buf = malloc(mux->out_cap);
+  if (program_spawn(config->program, config->argv, &mux->prog) < 0)
+    mux->dead = true;
+
+  async(mux->prog.stdout);
+  async(mux->prog.stdin);
+  watch_fd(mux->prog.stdout, EPOLLIN, &ev_mux, NULL);
+  watch_fd(mux->prog.stdin, EPOLLOUT, &ev_mux, NULL);
+}
+
+/**
+ * Finds a connection by the ID used in frames.
+ *
+ * returns: The connection, or NULL if it is gone.
+ */
+static mux_conn_t *mux_find(uint32_t id) {
+  mux_conn_t *mc = mux->table[id % MUX_TABLE_SIZE];
+  while (mc != NULL && mc->id != id)
+    mc = mc->next;
+  return mc;
+}
+
+/**
+ * [Server]
+ * Sends as many waiting frames to the --mux program as it takes. If
+ * connections were told there was no room to output and there is now, lets
+ * them output.
+ */
+void mux_flush() {
+  while (mux->out_len > 0) {
+    int w = write(mux->prog.stdin, mux->out_buf + mux->out_off, mux->out_len);
+    if (w < 0) {
+      if (errno != EAGAIN) {
+        fprintf(stderr, "[INFO] Program exited\n");
+        mux->dead = true;
+        mux->readable = true;
+        mux->out_len = 0;
+      }
+      break;
+    }
+    mux->out_off += w;
+    mux->out_len -= w;
+  }
+  if (mux->out_len == 0)
+    mux->out_off = 0;
+
+  if (mux->out_full && mux_bufspace() >= MAX_SEG_DATA_SIZE) {
+    mux->out_full = false;
+    conn_t *conn;
+    for (conn = get_connections(); conn; conn = conn->next) {
+      if (conn->mux && !conn->delete_me && conn->state)
+        ctcp_output(conn->state);
+    }
+  }
+}
+
+/**
+ * Queues a frame for the program and sends what it takes. Control frames
+ * always fit, since the buffer grows for them if needed.
+ *
+ * mc: The connection.
+ * type: MUX_OPEN, MUX_DATA or MUX_CLOSE.
+ * buf: The data.
+ * len: Bytes of data.
+ */
+static void mux_send(mux_conn_t *mc, uint16_t type, const char *buf,
+                     uint16_t len) {
+  mux_hdr_t hdr;
+  uint32_t need = sizeof(hdr) + len;
+
+  if (mux->dead)
+    return;
+
+  /* Make room at the end: first by moving what is left to the front, then by
+     growing. */
+  if (mux->out_off + mux->out_len + need > mux->out_cap) {
+    memmove(mux->out_buf, mux->out_buf + mux->out_off, mux->out_len);
+    mux->out_off = 0;
+  }
+  if (mux->out_len + need > mux->out_cap) {
+    mux->out_cap *= 2;
+    mux->out_buf = realloc(mux->out_buf, mux->out_cap);
+  }
+
+  hdr.id = htonl(mc->id);
+  hdr.type = htons(type);
+  hdr.len = htons(len);
+  char *tail = mux->out_buf + mux->out_off + mux->out_len;
+  memcpy(tail, &hdr, sizeof(hdr));
+  memcpy(tail + sizeof(hdr), buf, len);
+  mux->out_len += need;
+  mux_flush();
+}
+
+/**
+ * [Server]
+ * How much data a connection can output to the --mux program. The buffer of
+ * frames is shared by all connections of the event loop.
+ *
+ * returns: The number of bytes that can be output.
+ */
+size_t mux_bufspace() {
+  size_t space = 0;
+  if (mux->out_len + sizeof(mux_hdr_t) < MUX_OUT_MAX)
+    space = MUX_OUT_MAX - mux->out_len - sizeof(mux_hdr_t);
+  if (space > UINT16_MAX)
+    space = UINT16_MAX;
+
+  /* cTCP waits for room before outputting. Let it know once there is. */
+  if (space < MAX_SEG_DATA_SIZE)
+    mux->out_full = true;
+  return space;
+}
+
+/**
+ * [Server]
+ * Sends data from a connection to the --mux program.
+ *
+ * conn: The connection.
+ * buf: The data.
+ * len: Bytes of data.
+ * returns: Bytes taken, or -1 if the program has exited.
+ */
+int mux_output(conn_t *conn, const char *buf, size_t len) {
+  if (mux->dead) {
+    conn->wrote_err = true;
+    return -1;
+  }
+  size_t space = mux_bufspace();
+  if (len > space)
+    len = space;
+  mux_send(conn->mux, MUX_DATA, buf, len);
+  return len;
+}
+
+/**
+ * [Server]
+ * Tells the --mux program that a connection has no more data for it. Only
+ * done once.
+ *
+ * conn: The connection.
+ */
+void mux_close(conn_t *conn) {
+  if (!conn->mux->sent_close) {
+    conn->mux->sent_close = true;
+    mux_send(conn->mux, MUX_CLOSE, NULL, 0);
+  }
+}
+
+/**
+ * [Server]
+ * Hands a new connection to the --mux program.
+ *
+ * conn: The connection.
+ */
+void mux_attach(conn_t *conn) {
+  mux_conn_t *mc = malloc(sizeof(mux_conn_t));
+  mc->conn = conn;
+  mc->id = mux->next_id++;
+  mc->in_off = 0;
+  mc->in_len = 0;
+  mc->closed = mux->dead;
+  mc->sent_close = false;
+
+  mux_conn_t **bucket = &mux->table[mc->id % MUX_TABLE_SIZE];
+  mc->next = *bucket;
+  *bucket = mc;
+  conn->mux = mc;
+  mux_send(mc, MUX_OPEN, NULL, 0);
+  if (mc->closed)
+    input_ready(conn);
+}
+
+/**
+ * [Server]
+ * Forgets a connection that is going away, closing it first if needed. Frames
+ * the --mux program sends for it afterwards are dropped.
+ *
+ * conn: The connection.
+ */
+void mux_detach(conn_t *conn) {
+  mux_conn_t *mc = conn->mux;
+  mux_close(conn);
+
+  mux_conn_t **c = &mux->table[mc->id % MUX_TABLE_SIZE];
+  while (*c != mc)
+    c = &(*c)->next;
+  *c = mc->next;
+  free(mc);
+  conn->mux = NULL;
+}
+
+/**
+ * [Server]
+ * Reads data the --mux program sent for a connection. Works like read().
+ *
+ * conn: The connection.
+ * buf: Buffer to read into.
+ * len: Most bytes to read.
+ * returns: Bytes read, 0 once the program has closed the connection, or -1
+ *          with errno set to EAGAIN if there is nothing yet.
+ */
+int mux_input(conn_t *conn, void *buf, size_t len) {
+  mux_conn_t *mc = conn->mux;
+
+  if (mc->in_len > 0) {
+    if (len > mc->in_len)
+      len = mc->in_len;
+    memcpy(buf, mc->in_buf + mc->in_off, len);
+    mc->in_off += len;
+    mc->in_len -= len;
+    if (mc->in_len == 0)
+      mc->in_off = 0;
+
+    /* There may be room for the frame that did not fit. */
+    mux->blocked = false;
+    return len;
+  }
+
+  /* Like read(): 0 for EOF, or EAGAIN if there is nothing yet. */
+  if (mc->closed)
+    return 0;
+  errno = EAGAIN;
+  return -1;
+}
+
+/**
+ * Hands the frames read from the program to their connections, stopping at
+ * one whose connection has no room for it.
+ *
+ * returns: Bytes of frames handled.
+ */
+static uint32_t mux_parse() {
+  uint32_t pos = 0;
+  mux_hdr_t hdr;
+
+  while (mux->in_len - pos >= sizeof(hdr)) {
+    memcpy(&hdr, mux->in_buf + pos, sizeof(hdr));
+    uint16_t len = ntohs(hdr.len);
+    if (mux->in_len - pos < sizeof(hdr) + len)
+      break;
+
+    /* Frames for connections that are gone, or closed, are dropped. */
+    mux_conn_t *mc = mux_find(ntohl(hdr.id));
+    if (mc != NULL && !mc->closed) {
+      if (ntohs(hdr.type) == MUX_DATA && len > 0) {
+        if (mc->in_off + mc->in_len + len > MUX_CONN_BUF) {
+          memmove(mc->in_buf, mc->in_buf + mc->in_off, mc->in_len);
+          mc->in_off = 0;
+        }
+        if (mc->in_len + len > MUX_CONN_BUF) {
+          mux->blocked = true;
+          break;
+        }
+        memcpy(mc->in_buf + mc->in_off + mc->in_len,
+               mux->in_buf + pos + sizeof(hdr), len);
+        mc->in_len += len;
+        input_ready(mc->conn);
+      }
+      else if (ntohs(hdr.type) == MUX_CLOSE) {
+        mc->closed = true;
+        input_ready(mc->conn);
+      }
+    }
+    pos += sizeof(hdr) + len;
+  }
+  return pos;
+}
+
+/**
+ * [Server only]
+ * Reads the program's output until it has no more, or a connection has no
+ * room for the next frame. If the program exits, every connection gets an
+ * EOF.
+ */
+void mux_read() { ASSERT_SERVER_ONLY;
+  while (mux->readable && !mux->blocked) {
+    int r = 0;
+    if (!mux->dead) {
+      r = read(mux->prog.stdout, mux->in_buf + mux->in_len,
+               sizeof(mux->in_buf) - mux->in_len);
+      if (r < 0 && errno == EAGAIN) {
+        mux->readable = false;
+        break;
+      }
+    }
+
+    /* Program exited. */
+    if (r <= 0) {
+      mux->dead = true;
+      mux->readable = false;
+      int i;
+      for (i = 0; i < MUX_TABLE_SIZE; i++) {
+        mux_conn_t *mc;
+        for (mc = mux->table[i]; mc != NULL; mc = mc->next) {
+          mc->closed = true;
+          input_ready(mc->conn);
+        }
+      }
+      break;
+    }
+
+    mux->in_len += r;
+    uint32_t done = mux_parse();
+    memmove(mux->in_buf, mux->in_buf + done, mux->in_len - done);
+    mux->in_len -= done;
+  }
+}
+
 
 ///////////////////////////// SETUP AND MAIN LOOP /////////////////////////////
 
@@ -1075,55 +3001,53 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
  * Executes a new program upon client connection. When the client sends a
  * message to the server, it is forwarded to the STDIN of this program. The
  * STDOUT of the program is then passed through the server back to the client.
+ * With --prefork, an instance started ahead of time is used if there is one.
+ * With --mux, the connection is handed to the program of this event loop
+ * instead. If the program cannot be started (e.g. out of fds), the client is
+ * sent a RST and the connection is torn down.
  *
  * conn: The conn_t associated with the client.
+ * returns: 0 on success, -1 if the connection was torn down.
  */
-void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
-  /* Create pipes to child. */
-  int pipes[2][2];
-  pipe(pipes[PARENT_READ_PIPE]);
-  pipe(pipes[PARENT_WRITE_PIPE]);
-
-  /* Fork child process to run program. */
-  if (fork() == 0) {
-    /* Duplicate fds so child and parent will share same pipe. */
-    dup2(CHILD_READ_FD, STDIN_FILENO);
-    dup2(CHILD_WRITE_FD, STDOUT_FILENO);
-    dup2(CHILD_WRITE_FD, STDERR_FILENO);
+int execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
+  program_t prog;
 
-    /* Close fds not required by child. */
-    close(CHILD_READ_FD);
-    close(CHILD_WRITE_FD);
-    close(PARENT_READ_FD);
-    close(PARENT_WRITE_FD);
-
-    execvp(config->program, config->argv);
+  if (mux_mode) {
+    mux_attach(conn);
+    return 0;
+  }
+  if (pool_take(&prog) < 0 &&
+      program_spawn(config->program, config->argv, &prog) < 0) {
+    if (prog.stdin >= 0)
+      close(prog.stdin);
+    if (prog.stdout >= 0)
+      close(prog.stdout);
+    conn->stdin = conn->stdout = -1;
+    send_tcp_conn_seg(conn, TH_RST);
+    ctcp_destroy(conn->state);
+    return -1;
   }
 
-  /* Continue parent process's execution. */
-  else {
-    /* Close fds not required by parent. */
-    close(CHILD_READ_FD);
-    close(CHILD_WRITE_FD);
-
-    /* Store fds for communication with program later. */
-    conn->stdin = PARENT_WRITE_FD;
-    conn->stdout = PARENT_READ_FD;
+  /* Store fds for communication with program later. */
+  conn->stdin = prog.stdin;
+  conn->stdout = prog.stdout;
 
-    /* Start polling the stdout. */
-    int id = NUM_POLL + num_connected - 1;
-    struct pollfd *stdout = &events[id];
-    stdout->fd = conn->stdout;
-    async(stdout->fd);
-    stdout->events = POLLIN | POLLHUP;
-    conn->poll_fd = stdout;
-  }
+  /* Watch the program's output, and its input for when it fills up. */
+  async(conn->stdout);
+  async(conn->stdin);
+  watch_fd(conn->stdout, EPOLLIN, conn, NULL);
+  watch_fd(conn->stdin, EPOLLOUT, conn, NULL);
+  return 0;
 }
 
 /**
- * Delete all connections.
+ * Delete all connections scheduled for removal.
  */
 void delete_all_connections() {
+  if (!need_delete)
+    return;
+  need_delete = false;
+
   /* Delete connections if needed. */
   conn_t *conn, *next;
   for (conn = get_connections(); conn != NULL; conn = next) {
@@ -1133,96 +3057,298 @@ void delete_all_connections() {
   }
 }
 
+/**
+ * Handles a packet received from another host.
+ *
+ * buf: The packet.
+ * len: Length of the packet.
+ * conn: The connection it belongs to, or NULL if none.
+ */
+void handle_packet(char *buf, int len, conn_t *conn) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
+
+  /* ACK that finishes a handshake. Only now is the connection set up and a
+     program started for it. */
+  if (SERVER && conn == NULL && !(tcp_hdr->th_flags & TH_SYN)) {
+    conn = tcp_accept(buf, len);
+    if (run_program && conn && execute_program(conn) < 0)
+      conn = NULL;
+  }
+
+  /* Reply to our SYN. */
+  if (!SERVER && (tcp_hdr->th_flags & TH_SYN || (conn != NULL &&
+      conn->hs_state == CONN_SYN_SENT))) {
+    tcp_handshake(config->sconn, buf, len);
+  }
+
+  /* Packet from an established connection. Pass to student code. */
+  else if (conn != NULL) {
+    if (conn->delete_me)
+      return;
+    ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
+    len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
+
+    /* First segment from a new client finishes the handshake. Don't log or
+       forward to student code if it's just the ACK. */
+    bool handshake_ack = false;
+    if (conn->hs_state == CONN_SYN_RCVD) {
+      conn->hs_state = CONN_ESTABLISHED;
+      handshake_ack = len == sizeof(ctcp_segment_t) &&
+                      !(segment->flags & TH_FIN);
+    }
+
+    if (handshake_ack) {
+      free(segment);
+    }
+    else {
+      if (trace_enabled())
+        trace_conn_segment(conn, segment, len, false);
+      if (test_debug_on) {
+        log_segment(config->ip_addr, config->port, conn, segment, false,
+                    unix_socket);
+      }
+      STAT_ADD(received, 1);
+      ctcp_receive(conn->state, segment, len);
+    }
+  }
+
+  /* New connection. */
+  else if (SERVER && tcp_hdr->th_flags & TH_SYN) {
+    conn = tcp_syn(buf, len);
+
+    /* Start a new program associated with this client. */
+    if (run_program && conn && execute_program(conn) < 0)
+      conn = NULL;
+
+    /* Pass data from a Fast Open SYN to student code. */
+    if (conn && conn->syn_data) {
+      pending_seg_t *seg = conn->syn_data;
+      ctcp_segment_t *segment = calloc(seg->len, 1);
+      memcpy(segment, &seg->segment, seg->len);
+      conn->syn_data = NULL;
+      ctcp_receive(conn->state, segment, seg->len);
+      free(seg);
+    }
+  }
+}
+
+/**
+ * Handles an event from epoll.
+ *
+ * ev: The event.
+ */
+void handle_event(struct epoll_event *ev) {
+  conn_t *conn;
+
+  /* Input from stdin. Remembered until it is used up. */
+  if (ev->data.ptr == &ev_stdin) {
+    stdin_ready = true;
+  }
+
+  /* STDOUT can take more output. */
+  else if (ev->data.ptr == &ev_stdout) {
+    for (conn = get_connections(); conn; conn = conn->next) {
+      if (conn->out_len > 0 && !conn->delete_me)
+        conn_drain(conn);
+    }
+  }
+
+  /* The --mux program has output, or can take more input. */
+  else if (ev->data.ptr == &ev_mux) {
+    if (ev->events & (EPOLLIN | EPOLLHUP))
+      mux->readable = true;
+    if (ev->events & (EPOLLOUT | EPOLLERR))
+      mux_flush();
+  }
+
+  /* Packets from other hosts. Remembered until there are none left. */
+  else if (ev->data.ptr == &ev_socket) {
+    eventfd_t count;
+    if (rx_ring != NULL)
+      eventfd_read(rx_ring->efd, &count);
+    socket_ready = true;
+  }
+
+  /* Packets in the shared memory rings. Remembered until there are none
+     left. */
+  else if (ev->data.ptr == &ev_shm) {
+    shm_ready = true;
+  }
+
+  /* The program of a connection has output, or can take more input. */
+  else {
+    conn = ev->data.ptr;
+    if (conn->delete_me)
+      return;
+
+    if (ev->events & (EPOLLIN | EPOLLHUP))
+      input_ready(conn);
+    if (ev->events & (EPOLLOUT | EPOLLERR))
+      conn_drain(conn);
+  }
+}
+
+/**
+ * Handles a batch of received packets. Ignores packets that are not large
+ * enough or not for us.
+ *
+ * pkts: The packets.
+ * lens: Length of each packet.
+ * n: Number of packets.
+ */
+static void handle_packets(char **pkts, int *lens, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    conn_t *conn = NULL;
+    int len = recv_filter(pkts[i], lens[i], &conn);
+    if (len < FULL_HDR_SIZE)
+      continue;
+    if (dump_enabled())
+      dump_packet(pkts[i], len);
+    handle_packet(pkts[i], len, conn);
+  }
+}
+
+/**
+ * Waits for events on the epoll instance. Uses epoll_pwait2(), which takes the
+ * timeout in nanoseconds, and falls back to epoll_wait() on kernels without
+ * it.
+ *
+ * evs: Return parameter. The events, up to EPOLL_MAX_EVENTS.
+ * timeout: Most nanoseconds to wait for.
+ * returns: The number of events, or -1 on error.
+ */
+static int wait_events(struct epoll_event *evs, uint64_t timeout) {
+  /* Per thread, like the rest of the event loop state. */
+  static __thread bool have_pwait2 = true;
+
+  if (have_pwait2) {
+    struct timespec ts = { timeout / 1000000000, timeout % 1000000000 };
+    int n = epoll_pwait2(epoll_fd, evs, EPOLL_MAX_EVENTS, &ts, NULL);
+    if (n >= 0 || errno != ENOSYS)
+      return n;
+    have_pwait2 = false;
+  }
+  /* Round up, so as not to wake up just before the deadline. */
+  return epoll_wait(epoll_fd, evs, EPOLL_MAX_EVENTS,
+                    (timeout + 999999) / 1000000);
+}
+
 /**
  * Main loop. Handles the following:
  *   - Input from STDIN.
  *   - Messages from programs.
  *   - Packets from the socket.
  *   - Timeouts.
+ * Work done per wakeup depends on the number of events, not on the number of
+ * connections.
  */
 void do_loop() {
-  char buf[MAX_PACKET_SIZE];
+  struct epoll_event evs[EPOLL_MAX_EVENTS];
   conn_t *conn = NULL;
+  int i;
 
   while (true) {
-    memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+    /* Don't sleep if there is input left over from earlier events. */
+    conn = get_connections();
+    bool stdin_pending = stdin_ready && conn && conn->state;
+    uint64_t deadline = next_timer;
+    if (timer_deadline != 0 && timer_deadline < deadline)
+      deadline = timer_deadline;
+    uint64_t timeout = need_timer_in(deadline);
+    bool mux_pending = mux && mux->readable && !mux->blocked;
+    if (stdin_pending || socket_ready || shm_ready || ready_list ||
+        mux_pending)
+      timeout = 0;
+
+    /* Send packets the network emulator has held on to long enough, and wake
+       up for the next one. */
+    long netem_wait = netem_run(netem, current_time(), netem_send);
+    if (netem_wait >= 0 && netem_wait * 1000000 < timeout)
+      timeout = netem_wait * 1000000;
+
+    /* Send everything queued up since last time before sleeping. */
+    tx_flush();
+    int n = wait_events(evs, timeout);
+    if (stop_requested) {
+      print_stats();
+      trace_close();
+      dump_close();
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++)
+      handle_event(&evs[i]);
+
+    /* Packets from other hosts, up to RECV_BATCH per iteration. With shared
+       memory, the socket only has rings handed over by clients. */
+    if (socket_ready && shm_transport) {
+      shm_accept(config->socket);
+      socket_ready = false;
+    }
+    else if (socket_ready) {
+      char *pkts[RECV_BATCH];
+      int lens[RECV_BATCH];
+      n = recv_batch(config->socket, pkts, lens);
+      if (n < RECV_BATCH)
+        socket_ready = false;
+      handle_packets(pkts, lens, n);
+      recv_release(n);
+    }
+    if (shm_ready) {
+      char *pkts[RECV_BATCH];
+      int lens[RECV_BATCH];
+      n = shm_recv(shm_bufs, MAX_PACKET_SIZE, lens, RECV_BATCH);
+      if (n < RECV_BATCH)
+        shm_ready = false;
+      for (i = 0; i < n; i++)
+        pkts[i] = shm_bufs + i * MAX_PACKET_SIZE;
+      handle_packets(pkts, lens, n);
+    }
 
     /* Input from stdin. Server will only send to most-recently connected
        client. */
-    if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
-      conn = get_connections();
+    conn = get_connections();
+    if (stdin_ready && conn != NULL && conn->state != NULL &&
+        !conn->delete_me) {
+      ctcp_read(conn->state);
+      if (conn->read_eof)
+        stdin_ready = false;
+    }
 
-      if (conn != NULL)
+    /* Output from the --mux program, handed to the connections it is for.
+       Stops while one has no room for its next frame. */
+    if (mux && mux->readable && !mux->blocked)
+      mux_read();
+
+    /* Output from running programs. Send to the client associated with this
+       program instance. Connections stay on the list until their input is
+       used up. */
+    conn_t **c = &ready_list;
+    while ((conn = *c) != NULL) {
+      if (!conn->delete_me && !conn->read_eof)
         ctcp_read(conn->state);
-    }
 
-    /* See if we can output more. */
-    if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR)) {
-      for (conn = get_connections(); conn; conn = conn->next) {
-        conn_drain(conn);
+      if (conn->input_ready && !conn->delete_me && !conn->read_eof) {
+        c = &conn->ready_next;
       }
-    }
-
-    /* Poll for output received from running programs. Send to client
-       client associated with this program instance. */
-    if (run_program) {
-      conn = get_connections();
-      while (conn != NULL) {
-        if (conn->poll_fd->revents & POLLIN) {
-          ctcp_read(conn->state);
-        }
-        conn = conn->next;
+      else {
+        conn->input_ready = false;
+        *c = conn->ready_next;
       }
     }
 
-    /* Receive packet on socket from other hosts. Ignore packets if they are
-       not large enough or not for us. */
-    if (events[2].revents & POLLIN) {
-      conn = NULL;
-      int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
-      if (len >= FULL_HDR_SIZE) {
-        tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-
-        /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
-          ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
-          len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
-
-          /* Don't log or forward to student code if it's an ACK from a new
-             connection. */
-          if (tcp_hdr->th_sport == new_connection &&
-              (segment->flags & TH_ACK) &&
-              ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
-            new_connection = 0;
-            free(segment);
-          }
-          else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
-            }
-            ctcp_receive(conn->state, segment, len);
-          }
-        }
-
-        /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
-          conn_t *conn = tcp_new_connection(buf);
-
-          /* Start a new program associated with this client. */
-          if (run_program && conn)
-            execute_program(conn);
-          new_connection = tcp_hdr->th_sport;
-        }
+    /* Check if timer is up, either the regular one or one asked for with
+       timer_at(). */
+    uint64_t now = current_time_ns();
+    if (now >= next_timer || (timer_deadline != 0 && now >= timer_deadline)) {
+      if (now >= next_timer) {
+        handshake_timer();
+        next_timer = now + ctcp_cfg->timer * 1000000ULL;
       }
-    }
-
-    /* Check if timer is up. */
-    if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
-      ctcp_timer();
-      get_time(&last_timeout);
+      timer_deadline = 0;
+      if (SERVER || config->sconn->hs_state == CONN_ESTABLISHED)
+        ctcp_timer();
     }
 
     /* Delete connections if needed. */
@@ -1234,28 +3360,136 @@ void do_loop() {
  * Setup config for polling.
  */
 void setup_poll() {
-  /* Poll for input from stdin. */
-  struct pollfd *stdin = &events[STDIN_FILENO];
-  stdin->fd = STDIN_FILENO;
-  stdin->events = POLLIN | POLLHUP | POLLERR;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  netem = netem_new(&netem_cfg, seed + (worker ? worker->id : 0));
+
+  /* Poll for input from stdin. A client only starts reading once connected,
+     and a server running programs does not read it at all. */
   async(STDIN_FILENO);
+  if (SERVER && !run_program)
+    watch_fd(STDIN_FILENO, EPOLLIN, &ev_stdin, &stdin_ready);
 
-  /* Poll stdout to do asynchronous output.. */
-  struct pollfd *stdout = &events[STDOUT_FILENO];
-  stdout->fd = STDOUT_FILENO;
-  stdout->events = POLLOUT | POLLERR;
+  /* Poll stdout to do asynchronous output. */
   async(STDOUT_FILENO);
+  watch_fd(STDOUT_FILENO, EPOLLOUT, &ev_stdout, NULL);
+
+  /* The program serving this event loop's connections. */
+  if (mux_mode)
+    mux_start();
 
-  /* Poll for segments from the server. */
-  struct pollfd *socket = &events[2];
-  socket->fd = config->socket;
-  socket->events = POLLIN | POLLHUP | POLLERR;
+  /* Poll for segments from other hosts, or from the receive thread. */
   async(config->socket);
+  if (rx_ring != NULL)
+    watch_fd(rx_ring->efd, EPOLLIN, &ev_socket, NULL);
+  else
+    watch_fd(config->socket, EPOLLIN, &ev_socket, NULL);
+  if (shm_transport) {
+    shm_bufs = malloc(RECV_BATCH * MAX_PACKET_SIZE);
+    watch_fd(shm_init(), EPOLLIN, &ev_shm, &shm_ready);
+  }
 
   /* Used to detect if a network service has closed. */
   signal(SIGPIPE, SIG_IGN);
 }
 
+/**
+ * [Server only]
+ * Worker thread for --threads. Runs its own event loop over the connections
+ * hashed to it.
+ *
+ * arg: The worker_t of this thread.
+ */
+void *worker_main(void *arg) { ASSERT_SERVER_ONLY;
+  worker = arg;
+  rx_ring = &worker->ring;
+  syn_queue = calloc(sizeof(syn_entry_t), syn_queue_len);
+  setup_poll();
+  do_loop();
+  return NULL;
+}
+
+/**
+ * [Server only]
+ * Receive thread for --threads. Reads packets off the socket and hands each one
+ * to the worker that owns its connection, waking the worker up. If a worker
+ * falls too far behind, its packets are dropped. Never returns.
+ */
+void dispatch_loop() { ASSERT_SERVER_ONLY;
+  struct pollfd pfd = { config->socket, POLLIN, 0 };
+  char *pkts[RECV_BATCH];
+  int lens[RECV_BATCH];
+  bool woken[num_workers];
+  int i, n;
+
+  async(config->socket);
+  while (true) {
+    poll(&pfd, 1, -1);
+    if (stop_requested) {
+      print_stats();
+      trace_close();
+      dump_close();
+      exit(EXIT_FAILURE);
+    }
+
+    do {
+      n = recv_batch(config->socket, pkts, lens);
+      memset(woken, 0, sizeof(woken));
+
+      for (i = 0; i < n; i++) {
+        if (lens[i] < FULL_HDR_SIZE)
+          continue;
+        iphdr_t *ip_hdr = (iphdr_t *) pkts[i];
+        tcphdr_t *tcp_hdr = (tcphdr_t *) (pkts[i] + IP_HDR_SIZE);
+        uint64_t h = host_hash(ip_hdr->saddr, ntohs(tcp_hdr->th_sport));
+        worker_t *w = &workers[(h >> 32) % num_workers];
+
+        unsigned tail = atomic_load_explicit(&w->ring.tail,
+                                             memory_order_acquire);
+        unsigned head = atomic_load_explicit(&w->ring.head,
+                                             memory_order_relaxed);
+        if (head - tail == PKT_RING_LEN) {
+          if (DEBUG)
+            fprintf(stderr, "[DEBUG] Worker %d is behind, dropping packet\n",
+                    w->id);
+          continue;
+        }
+        unsigned slot = head & (PKT_RING_LEN - 1);
+        memcpy(w->ring.pkts[slot], pkts[i], MAX_PACKET_SIZE);
+        w->ring.lens[slot] = lens[i];
+        atomic_store_explicit(&w->ring.head, head + 1, memory_order_release);
+        woken[w->id] = true;
+      }
+
+      for (i = 0; i < num_workers; i++) {
+        if (woken[i])
+          eventfd_write(workers[i].ring.efd, 1);
+      }
+    } while (n == RECV_BATCH);
+  }
+}
+
+/**
+ * [Server only]
+ * Starts the worker threads for --threads.
+ *
+ * returns: 0 on success, -1 otherwise.
+ */
+int start_workers() { ASSERT_SERVER_ONLY;
+  int i;
+  workers = calloc(sizeof(worker_t), num_workers);
+  for (i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    workers[i].ring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (workers[i].ring.efd < 0 ||
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+      fprintf(stderr, "[ERROR] Could not start worker threads\n");
+      return -1;
+    }
+  }
+  fprintf(stderr, "[INFO] Started %d worker threads\n", num_workers);
+  return 0;
+}
+
 /**
  * Library teardown for a client.
  */
@@ -1267,8 +3501,12 @@ void end_client() {
   }
 
   delete_all_connections();
+  tx_flush();
   close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
+  print_stats();
+  trace_close();
+  dump_close();
   exit(EXIT_SUCCESS);
 }
 
@@ -1281,20 +3519,38 @@ void end_client() {
 int start_client(char *server, char *port) {
   if (do_config_server(server) < 0 || do_config(port) < 0)
     return -1;
+  setup_poll();
 
-  /* Initialize connection with server. Go to student code. */
-  conn_t *conn = tcp_handshake();
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
-  if (state == NULL) {
-    fprintf(stderr, "[ERROR] Could not connect to server!\n");
+  /* Hand the server the rings before anything is sent through them. */
+  conn_t *conn = config->sconn;
+  if (shm_transport &&
+      shm_connect(config->socket, (struct sockaddr *) &conn->sunaddr,
+                  sizeof(conn->sunaddr), config->port, conn->port) < 0) {
+    fprintf(stderr, "[ERROR] Could not set up shared memory\n");
     return -1;
   }
-  fprintf(stderr, "[INFO] Connected to server\n");
-  config->sconn->state = state;
 
-  setup_poll();
+  /* Start the handshake. Input is not read until cTCP is started. */
+  conn->hs_state = CONN_SYN_SENT;
+
+  /* With a Fast Open cookie for this server, cTCP starts right away and any
+     input already available goes out with the SYN. */
+  uint16_t window;
+  if (fastopen && tfo_cache_load(conn, &window, &tfo_rtt) == 0) {
+    ctcp_cfg->send_window = window;
+    conn->hs_rto = 3 * tfo_rtt;
+    if (conn->hs_rto < SYN_RTO_MIN)
+      conn->hs_rto = SYN_RTO_MIN;
+    if (conn->hs_rto > SYN_RTO_INIT)
+      conn->hs_rto = SYN_RTO_INIT;
+
+    if (client_init(conn) < 0)
+      return -1;
+    ctcp_read(conn->state);
+  }
+
+  /* A SYN that could not be sent is retried like a lost one. */
+  send_handshake_seg(conn);
   do_loop();
   return 0;
 }
@@ -1317,13 +3573,59 @@ int start_server(char *port, int argc, char *argv[]) {
     config->argc = argc - optind;
     config->argv = argv + optind;
   }
+  if (prefork > 0 && pool_start(config->program, config->argv, prefork) < 0)
+    return -1;
   fprintf(stderr, "[INFO] Server started\n");
 
+  /* Spread connections over worker threads. This thread only receives. */
+  if (num_workers > 1) {
+    if (start_workers() < 0)
+      return -1;
+    dispatch_loop();
+  }
+
+  syn_queue = calloc(sizeof(syn_entry_t), syn_queue_len);
   setup_poll();
   do_loop();
   return 0;
 }
 
+/**
+ * [Client only]
+ * Maps the file to send (--file) into memory. cTCP's segments are filled
+ * straight from the mapping, without a read() per chunk.
+ *
+ * path: The file.
+ * returns: 0 on success, -1 on failure.
+ */
+static int map_input(const char *path) {
+  struct stat st;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "[ERROR] Could not open %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  /* An empty file cannot be mapped, and there is nothing to send anyway. */
+  input_size = st.st_size;
+  if (input_size > 0) {
+    input_map = mmap(NULL, input_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (input_map == MAP_FAILED) {
+      fprintf(stderr, "[ERROR] Could not map %s: %s\n", path,
+              strerror(errno));
+      close(fd);
+      return -1;
+    }
+    /* Read ahead aggressively. Pages already sent are not needed again. */
+    madvise(input_map, input_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return 0;
+}
+
 /**
  * Prints out a usage message.
  *
@@ -1342,6 +3644,23 @@ static void usage(char *progname) {
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--netem model]\n"
+    "   [--stats]\n"
+    "   [-l]\n"
+    "   [--snaplen bytes]\n"
+    "   [--pcap file]\n"
+    "   [--pcap-snaplen bytes]\n"
+    "   [--pcap-rotate megabytes]\n"
+    "   [--fastopen]\n"
+    "   [--backlog num_clients]      [server only]\n"
+    "   [--syn-queue num_half_open]  [server only]\n"
+    "   [--threads num_threads]      [server only]\n"
+    "   [--prefork num_programs]     [server only]\n"
+    "   [--mux]                      [server only]\n"
+    "   [--outbuf bytes]\n"
+    "   [--file path]                [client only]\n"
+    "   [--output path]\n"
+    "   [--transport unix|raw|udp|shm]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
@@ -1381,6 +3700,22 @@ int main(int argc , char *argv[]) {
     { "duplicate", required_argument, NULL, 'q' },
     { "logging", no_argument, NULL, 'l' },
     { "lab5", no_argument, NULL, 'f' },
+    { "fastopen", no_argument, NULL, 'o' },
+    { "backlog", required_argument, NULL, 'b' },
+    { "syn-queue", required_argument, NULL, 'g' },
+    { "threads", required_argument, NULL, 'n' },
+    { "netem", required_argument, NULL, 'm' },
+    { "stats", no_argument, NULL, 'x' },
+    { "outbuf", required_argument, NULL, 'u' },
+    { "snaplen", required_argument, NULL, 'k' },
+    { "prefork", required_argument, NULL, 'i' },
+    { "mux", no_argument, NULL, 'h' },
+    { "pcap", required_argument, NULL, 'a' },
+    { "pcap-snaplen", required_argument, NULL, 'j' },
+    { "pcap-rotate", required_argument, NULL, 'v' },
+    { "file", required_argument, NULL, 'F' },
+    { "output", required_argument, NULL, 'O' },
+    { "transport", required_argument, NULL, 'T' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1432,7 +3767,23 @@ int main(int argc , char *argv[]) {
       break;
     /* Turn logging on. */
     case 'l':
-      log_file = 0;
+      opt_logging = true;
+      break;
+    /* Data bytes to keep per segment in the trace. */
+    case 'k':
+      trace_snaplen = atoi(optarg);
+      break;
+    /* Write datagrams sent and received to a pcap file. */
+    case 'a':
+      pcap_file = optarg;
+      break;
+    /* Bytes to save per datagram in the pcap file. */
+    case 'j':
+      pcap_snaplen = atoi(optarg);
+      break;
+    /* Start a new pcap file every this many megabytes. */
+    case 'v':
+      pcap_rotate = atol(optarg) * 1000000;
       break;
     /* Turn logging data off for tester. */
     case 'z':
@@ -1442,6 +3793,64 @@ int main(int argc , char *argv[]) {
     case 'f':
       lab5_mode = true;
       break;
+    /* TCP Fast Open. */
+    case 'o':
+      fastopen = true;
+      break;
+    /* Maximum number of connected clients. */
+    case 'b':
+      backlog = atoi(optarg);
+      break;
+    /* Maximum number of half-open connections. */
+    case 'g':
+      syn_queue_len = atoi(optarg);
+      break;
+    /* Number of worker threads. */
+    case 'n':
+      num_workers = atoi(optarg);
+      break;
+    /* Program instances to start ahead of time. */
+    case 'i':
+      prefork = atoi(optarg);
+      break;
+    /* One program per event loop for all connections. */
+    case 'h':
+      mux_mode = true;
+      break;
+    /* Print counters when done. */
+    case 'x':
+      opt_stats = true;
+      break;
+    /* Network emulator model. */
+    case 'm':
+      if (netem_parse(optarg, &netem_cfg) < 0) {
+        fprintf(stderr, "[ERROR] Could not parse netem model: %s\n", optarg);
+        usage(progname);
+      }
+      break;
+    /* Starting size of each connection's output buffer. */
+    case 'u':
+      out_buf_space = atoi(optarg);
+      break;
+    /* Send a file instead of STDIN. */
+    case 'F':
+      input_file = optarg;
+      break;
+    /* Write output to a file instead of STDOUT. */
+    case 'O':
+      output_file = optarg;
+      break;
+    /* How segments get to the other host. */
+    case 'T':
+      transport_set = true;
+      shm_transport = strcmp(optarg, "shm") == 0;
+      unix_socket = strcmp(optarg, "unix") == 0 || shm_transport;
+      udp_socket = strcmp(optarg, "udp") == 0;
+      if (!unix_socket && !udp_socket && strcmp(optarg, "raw") != 0) {
+        fprintf(stderr, "[ERROR] Unknown transport: %s\n", optarg);
+        usage(progname);
+      }
+      break;
     default:
       usage(progname);
       break;
@@ -1450,27 +3859,79 @@ int main(int argc , char *argv[]) {
 
   /* Seed RNG. */
   srand(seed);
+  random_key(&tfo_cookie_key);
+  random_key(&syn_cookie_key);
 
   /* Validate arguments. */
-  if ((is_client && is_server) || (!is_client && !is_server) || port <= 0) {
+  if ((is_client && is_server) || (!is_client && !is_server) || port <= 0 ||
+      backlog < 0 || syn_queue_len < 0 || num_workers <= 0 ||
+      out_buf_space < MAX_SEG_DATA_SIZE || out_buf_space > OUT_BUF_MAX ||
+      trace_snaplen < 0 || trace_snaplen > MAX_SEG_DATA_SIZE ||
+      pcap_snaplen <= 0 || pcap_snaplen > PCAP_SNAPLEN || pcap_rotate < 0 ||
+      prefork < 0 || prefork > POOL_MAX) {
+    usage(progname);
+  }
+
+  /* Without a program, stdin and stdout belong to a single connection, so
+     there is nothing to spread over threads. */
+  if (num_workers > 1 && argc - optind <= 0) {
+    fprintf(stderr, "[ERROR] --threads needs a program to run\n");
+    usage(progname);
+  }
+  if ((prefork > 0 || mux_mode) && (!is_server || argc - optind <= 0)) {
+    fprintf(stderr, "[ERROR] --prefork and --mux need a program to run\n");
+    usage(progname);
+  }
+  if (shm_transport && num_workers > 1) {
+    fprintf(stderr, "[ERROR] --threads cannot be used with shared memory\n");
+    usage(progname);
+  }
+  if (prefork > 0 && mux_mode) {
+    fprintf(stderr, "[ERROR] --prefork and --mux cannot be used together\n");
+    usage(progname);
+  }
+  if (input_file != NULL && !is_client) {
+    fprintf(stderr, "[ERROR] --file is for clients only\n");
+    usage(progname);
+  }
+  if (output_file != NULL && argc - optind > 0) {
+    fprintf(stderr, "[ERROR] --output cannot be used with a program\n");
     usage(progname);
   }
 
-  /* Construct log file if logging is turned on. Don't create a file if not
-     logging data, since that is only used for testing purposes. */
-  if (log_file == 0) {
+  if (input_file != NULL && map_input(input_file) < 0)
+    return 1;
+  if (output_file != NULL) {
+    output_fd = open(output_file, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                     0666);
+    if (output_fd < 0) {
+      fprintf(stderr, "[ERROR] Could not open %s: %s\n", output_file,
+              strerror(errno));
+      return 1;
+    }
+  }
+
+  /* Start the trace if logging is turned on. It is written in the
+     background; use trace2csv to read it. */
+  if (opt_logging) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    char log_filename[40];
-    memset(log_filename, 0, 40);
-    snprintf(log_filename, sizeof(log_filename), "%d-%d.csv", (int) tv.tv_sec,
-             port);
-    log_file = open(log_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
-    write_log_header(log_file);
+    char trace_filename[40];
+    snprintf(trace_filename, sizeof(trace_filename), "%d-%d.trace",
+             (int) tv.tv_sec, port);
+    if (trace_open(trace_filename, trace_snaplen) < 0) {
+      fprintf(stderr, "[ERROR] Could not open trace file %s\n",
+              trace_filename);
+      return 1;
+    }
   }
 
+  if (pcap_file != NULL && dump_open(pcap_file, pcap_snaplen, pcap_rotate) < 0)
+    return 1;
+
   /* Global configuration. */
   struct config cc;
+  memset(&cc, 0, sizeof(cc));
   config = &cc;
 
   /* CTCP config for students. */
@@ -1481,10 +3942,16 @@ int main(int argc , char *argv[]) {
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
 
-  /* Used for polling later. */
-  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
-  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + MAX_NUM_CLIENTS));
-  events = _events;
+
+  /* Print the counters and flush the trace and pcap file even if stopped
+     early. No SA_RESTART, so the event loop wakes up to do it. */
+  if (opt_stats || opt_logging || pcap_file != NULL) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  }
 
   /* Start client/server. */
   if (is_client) {
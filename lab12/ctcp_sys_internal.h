@@ -9,9 +9,14 @@
 #ifndef CTCP_SYS_INTERNAL_H
 #define CTCP_SYS_INTERNAL_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "ctcp.h"
 #include "ctcp_sys.h"
+#include "ctcp_timers.h"
 #include "ctcp_utils.h"
+#include "inet_cksum.h"
 
 #define DEFAULT_PORT 80
 #define DEFAULT_TTL 64
@@ -21,60 +26,83 @@
 /** Localhost IP address in_addr_t. */
 #define LOCALHOST 16777343
 
-/** Maximum number of clients that can connect to the server. */
-#define MAX_NUM_CLIENTS 10
+/** Default number of half-open connections the server keeps state for. Once
+    this many are waiting on a handshake ACK, SYN cookies are used instead.
+    Can be changed with --syn-queue. */
+#define SYN_QUEUE_LEN 64
 
-/** Default number of things to poll (stdin, stdout, socket). */
-#define NUM_POLL 3
+/** SYN cookies change every 2^SYN_COOKIE_SHIFT seconds and stay valid for
+    SYN_COOKIE_SLOTS such periods. */
+#define SYN_COOKIE_SHIFT 6
+#define SYN_COOKIE_SLOTS 2
 
-/** Polling interval in milliseconds. */
-#define POLL_INTERVAL 20
+/** 128-bit key for keyed_hash(), e.g. to make SYN cookies. */
+typedef struct {
+  uint64_t k0, k1;
+} hash_key_t;
 
-/** Length of time to wait while sending resets in seconds. */
-#define RESET_THREAD_DURATION 1
+/** Initial number of buckets in the connection table. Must be a power of 2. */
+#define CONN_TABLE_INIT 64
 
-/* Parameters to be changed by the tester. */
+/** Maximum number of events handled per wakeup of the main loop. */
+#define EPOLL_MAX_EVENTS 64
 
-/** Retransmission interval in milliseconds. */
-#define RT_INTERVAL 200
+/** Maximum number of datagrams read with one recvmmsg, and sent with one
+    sendmmsg. */
+#define RECV_BATCH 32
+#define SEND_BATCH 32
 
-/** Timer interval (for calls to ctcp_timer) in milliseconds. */
-#define TIMER_INTERVAL 40
+/** [UDP] Most segments the kernel splits one send into (GSO) or merges into
+    one receive (GRO), and the buffer a merged datagram is received into. */
+#define UDP_MAX_SEGMENTS 64
+#define GRO_BUF_SIZE 65536
 
-/** Connection timeout interval in seconds. */
-#define CONN_TIMEOUT 10
+/** Number of packets the receive thread can queue up for a worker thread
+    (--threads). Packets beyond that are dropped. Must be a power of 2. */
+#define PKT_RING_LEN 256
 
-/////////////////////////////////// SYSTEM ////////////////////////////////////
+/** Polling interval in milliseconds. */
+#define POLL_INTERVAL 20
 
-/** Pipe created by parent process. */
-#define PARENT_WRITE_PIPE 0
-#define PARENT_READ_PIPE 1
+/** How long after starting to answer packets left over from earlier
+    connections with RSTs, in seconds. */
+#define RESET_DURATION 1
 
-#define READ_FD 0
-#define WRITE_FD 1
+/** TCP Fast Open option (RFC 7413) and cookie length in bytes. */
+#define TCPOPT_FASTOPEN 34
+#define TFO_COOKIE_LEN 8
 
-/** File descriptors used by parent to read and write from child. */
-#define PARENT_READ_FD (pipes[PARENT_READ_PIPE][READ_FD])
-#define PARENT_WRITE_FD (pipes[PARENT_WRITE_PIPE][WRITE_FD])
+/** Where a client caches Fast Open cookies for servers it has talked to, in
+    $XDG_RUNTIME_DIR, or $HOME if that is not set. */
+#define TFO_CACHE_FILE "ctcp-tfo-cache"
 
-/** File descriptors used by child to read and write to parent. */
-#define CHILD_READ_FD (pipes[PARENT_WRITE_PIPE][READ_FD])
-#define CHILD_WRITE_FD (pipes[PARENT_READ_PIPE][WRITE_FD])
+/////////////////////////////////// SYSTEM ////////////////////////////////////
 
-/** Maximum space for buffering STDOUT for a given connection. */
+/** Default space for buffering STDOUT for a given connection. */
 #define MAX_BUF_SPACE 8192
 
-/**
- * Chunk of output. Used to do asynchronous output. A connection will store
- * a queue of chunks to be outputted later.
- */
-struct chunk {
-  struct chunk *next;
-  size_t size;              /* Size of chunk, in bytes */
-  size_t used;              /* Amount of chunk already outputted */
-  char buf[1];              /* Data */
-} __attribute__((packed));
-typedef struct chunk chunk_t;
+/** Most the output buffer of a connection can grow to. */
+#define OUT_BUF_MAX (256 * 1024)
+
+/** Size of a connection's input buffer. Input is read in chunks this large,
+    and handed to cTCP a segment at a time. */
+#define IN_BUF_SIZE (256 * 1024)
+
+/** [Server] --mux frame types. See struct mux_hdr. */
+#define MUX_OPEN  1            /* New connection. No data */
+#define MUX_DATA  2            /* Data for or from a connection */
+#define MUX_CLOSE 3            /* No more data for or from a connection */
+
+/** [Server] Most bytes of frames waiting to go to a --mux program, beyond
+    which connections are told there is no room to output. */
+#define MUX_OUT_MAX (1024 * 1024)
+
+/** [Server] Most bytes of data from a --mux program waiting to be sent on one
+    connection. Holds the largest frame. */
+#define MUX_CONN_BUF (64 * 1024)
+
+/** [Server] Buckets in the table of --mux connections, by ID. */
+#define MUX_TABLE_SIZE 1024
 
 
 /**
@@ -93,43 +121,25 @@ int async(int fd) {
 }
 
 /**
- * Gets the current time and stores it into the provided timespec object.
+ * Returns the number of nanoseconds until the given time, or 0 if it has
+ * already passed.
  *
- * ts: Timespec object to store result.
+ * deadline: The time, in nanoseconds (see current_time_ns()).
  */
-void get_time(struct timespec *ts) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  ts->tv_sec = tv.tv_sec;
-  ts->tv_nsec = tv.tv_usec * 1000;
+uint64_t need_timer_in(uint64_t deadline) {
+  uint64_t now = current_time_ns();
+  return deadline > now ? deadline - now : 0;
 }
 
 /**
- * Returns the number of milliseconds until the next timeout.
+ * Answers a packet left over from an earlier connection to this port with a
+ * RST, so that the other host stops sending. Only done for RESET_DURATION
+ * seconds after starting; packets that belong to no connection are ignored
+ * after that.
  *
- * last: The previous timeout.
- * interval: The timeout interval.
- */
-long need_timer_in(const struct timespec *last, long interval) {
-  long elapsed;
-  struct timespec ts;
-
-  get_time(&ts);
-  elapsed = ts.tv_sec - last->tv_sec;
-  if (elapsed > interval / 1000)
-    return 0;
-
-  elapsed = elapsed * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (elapsed >= interval)
-    return 0;
-  return interval - elapsed;
-}
-
-/**
- * Send resets to previous connections, if they exist. We can tell if there are
- * lots of RSTs or ACKs being sent to us.
+ * pkt: The packet.
  */
-void *send_resets(void *args);
+void send_reset(char *pkt);
 
 
 /////////////////////////////////// SEGMENTS //////////////////////////////////
@@ -147,37 +157,22 @@ typedef struct tcphdr tcphdr_t;
 /** Maximum packet size (data and headers). */
 #define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t))
 
-/** TCP pseudoheader, used in checksum calculations. */
-struct tcp_pseudoheader {
-  uint32_t src_addr;        /* Source address */
-  uint32_t dst_addr;        /* Destination address */
-  uint8_t placeholder;
-  uint8_t protocol;         /* IP protocol (should be 6 for TCP) */
-  uint16_t tcp_len;         /* TCP length */
-  tcphdr_t tcp_hdr;         /* TCP header */
-} __attribute__((packed));
-typedef struct tcp_pseudoheader tcp_pseudoheader_t;
-
-#define TCP_PSEUDOHDR_SIZE sizeof(tcp_pseudoheader_t)
-
 
 /**
- * Add network-line endings to a string (converts from \n to \r\n).
+ * Computes the TCP checksum of a header whose data has already been summed,
+ * e.g. by inet_sum_copy() while it was copied into the packet. The
+ * pseudo-header is summed from the IP header rather than built in memory.
  *
- * webserver: Whether or not communications is with a webserver. If so, adds
- *            extra line-endings. If not, does nothing.
- * buf: Buffer where the string is stored.
- * len: Length of data.
- * returns: Whether or not the network-line ending was added.
- */
-bool add_network_line_ending(bool webserver, char *buf, size_t len) {
-  if (!webserver || *(buf + len - 1) != '\n')
-    return false;
-
-  *(buf + len - 1) = '\r';
-  *(buf + len) = '\n';
-  *(buf + len + 1) = '\0';
-  return true;
+ * packet: IP packet with a TCP payload.
+ * len: Length of data (0 if no data and only TCP and IP headers).
+ * data_sum: inet_sum() of the data after the TCP header.
+ * returns: The checksum in network order.
+ */
+uint16_t cksum_tcp_hdr(iphdr_t *packet, uint16_t len, uint64_t data_sum) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
+  uint64_t sum = inet_sum_pseudo(packet->saddr, packet->daddr, IPPROTO_TCP,
+                                 TCP_HDR_SIZE + len, data_sum);
+  return inet_fold(inet_sum(tcp_hdr, TCP_HDR_SIZE, sum));
 }
 
 /**
@@ -190,19 +185,9 @@ bool add_network_line_ending(bool webserver, char *buf, size_t len) {
  */
 uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
   tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
-
-  /* Construct pseudoheader. */
-  tcp_pseudoheader_t *phdr = calloc(TCP_PSEUDOHDR_SIZE + len, 1);
-  phdr->src_addr = packet->saddr;
-  phdr->dst_addr = packet->daddr;
-  phdr->protocol = IPPROTO_TCP;
-  phdr->tcp_len = htons(TCP_HDR_SIZE + len);
-
-  /* Append TCP segment and compute checksum. */
-  memcpy(&(phdr->tcp_hdr), tcp_hdr, TCP_HDR_SIZE + len);
-  uint16_t result = cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
-  free(phdr);
-  return result;
+  uint64_t sum = inet_sum_pseudo(packet->saddr, packet->daddr, IPPROTO_TCP,
+                                 TCP_HDR_SIZE + len, 0);
+  return inet_fold(inet_sum(tcp_hdr, TCP_HDR_SIZE + len, sum));
 }
 
 /**
@@ -265,47 +250,236 @@ int rand_percent(int level) {
 /** Ethernet interface prefix to determine the client's own IP address. */
 #define ETH_INTERFACE "eth"
 
-/** Connection details for a host connected to the current host. */
+/** Handshake states of a connection. */
+#define CONN_SYN_SENT    1     /* [Client] SYN sent, waiting for SYN-ACK */
+#define CONN_SYN_RCVD    2     /* [Server] SYN-ACK sent, waiting for ACK */
+#define CONN_ESTABLISHED 3     /* Handshake done */
+
+/**
+ * Segment sent by cTCP before the handshake completed. Held on to and sent
+ * once the connection is established.
+ */
+struct pending_seg {
+  struct pending_seg *next;
+  size_t len;               /* Length of the segment, including headers */
+  ctcp_segment_t segment;   /* The segment */
+};
+typedef struct pending_seg pending_seg_t;
+
+/**
+ * [Server] A half-open connection: the SYN has been answered but the handshake
+ * ACK has not arrived yet. This is all that is kept until it does.
+ */
+struct syn_entry {
+  bool used;                   /* Whether or not this entry is in use */
+  bool send_cookie;            /* Client asked for a Fast Open cookie */
+  in_addr_t ip_addr;           /* IP address of the client */
+  int port;                    /* Port of the client */
+  uint32_t init_seqno;         /* My initial sequence number */
+  uint32_t their_init_seqno;   /* Their initial sequence number */
+  int hs_retries;              /* Number of SYN-ACK retransmissions */
+  long hs_rto;                 /* Current handshake timeout, in ms */
+  long hs_sent;                /* When the last SYN-ACK was sent */
+};
+typedef struct syn_entry syn_entry_t;
+
+/**
+ * [Server] Packets handed from the receive thread to a worker thread. There is
+ * one producer and one consumer, so no locks are needed.
+ */
+struct pkt_ring {
+  atomic_uint head;            /* Next slot to fill (receive thread) */
+  atomic_uint tail;            /* Next slot to take (worker thread) */
+  int efd;                     /* eventfd that wakes up the worker */
+  int lens[PKT_RING_LEN];      /* Length of each packet */
+  char pkts[PKT_RING_LEN][MAX_PACKET_SIZE];
+};
+typedef struct pkt_ring pkt_ring_t;
+
+/** [Server] A worker thread with its own event loop and connections. */
+struct worker {
+  pthread_t thread;
+  int id;                      /* 0 to the number of workers - 1 */
+  pkt_ring_t ring;             /* Packets for this worker */
+};
+typedef struct worker worker_t;
+
+/**
+ * [Server] Header of each frame between the server and a --mux program, in
+ * network order. The data, if any, follows right after.
+ */
+struct mux_hdr {
+  uint32_t id;                 /* The connection */
+  uint16_t type;               /* MUX_OPEN, MUX_DATA or MUX_CLOSE */
+  uint16_t len;                /* Bytes of data that follow */
+};
+typedef struct mux_hdr mux_hdr_t;
+
+/** [Server] A connection served by a --mux program. */
+struct mux_conn {
+  struct mux_conn *next;       /* Next in the same bucket of the mux table */
+  struct conn *conn;
+  uint32_t id;                 /* ID used in frames */
+  uint32_t in_off;             /* Start of the data in in_buf */
+  uint32_t in_len;             /* Bytes of data in in_buf */
+  bool closed;                 /* Program sent MUX_CLOSE, or exited */
+  bool sent_close;             /* Sent MUX_CLOSE to the program */
+  char in_buf[MUX_CONN_BUF];   /* Data from the program, waiting for cTCP */
+};
+typedef struct mux_conn mux_conn_t;
+
+/**
+ * Unix socket address of another host. Its path is always "/<port>", so this
+ * only needs a fraction of the space of a struct sockaddr_un.
+ */
+struct sockaddr_un_port {
+  sa_family_t sun_family;
+  char sun_path[8];
+};
+
+/**
+ * Connection details for a host connected to the current host. A server may
+ * have very many of these, mostly idle, so keep it small: fields are ordered
+ * to avoid padding and only one of the socket addresses is ever used.
+ */
 struct conn {
-  in_addr_t ip_addr;           /* IP address */
-  int port;                    /* Port */
-  struct sockaddr_in saddr;    /* Socket address */
-  struct sockaddr_un sunaddr;  /* Unix socket */
+  struct conn *next;           /* Linked list of connections */
+  struct conn **prev;
+  struct conn *hash_next;      /* Next in the same bucket of the conn table */
   ctcp_state_t *state;         /* Connection state */
 
+  pending_seg_t *syn_data;     /* Data carried in the SYN */
+  pending_seg_t *pending;      /* [Client] Segments sent during handshake */
+  long hs_sent;                /* When the last SYN/SYN-ACK was sent */
+  uint64_t out_pos;            /* Bytes written to the --output file */
+  unsigned shm_rings;          /* [Server] Rings used, with --transport shm */
+
+  char *out_buf;               /* Ring of output waiting for STDOUT */
+  char *in_buf;                /* Input read but not yet used by cTCP */
+  mux_conn_t *mux;             /* [Server] Set if served by a --mux program */
+  struct conn *ready_next;     /* List of connections with input ready */
+
+  in_addr_t ip_addr;           /* IP address */
+  union {
+    struct sockaddr_in saddr;        /* Socket address */
+    struct sockaddr_un_port sunaddr; /* Unix socket */
+  };
+
   uint32_t init_seqno;         /* My initial sequence number */
   uint32_t their_init_seqno;   /* Their initial sequence number */
 
   uint32_t seqno;              /* Current sequence number */
   uint32_t next_seqno;         /* Sequence number of next segment to send */
   uint32_t ackno;              /* Current ack number */
+  uint32_t snd_max;            /* End of the data sent so far, for --stats */
+
+  uint32_t out_cap;            /* Size of the output ring, in bytes */
+  uint32_t out_head;           /* Start of the output in the ring */
+  uint32_t out_len;            /* Bytes of output in the ring */
+  uint32_t in_off;             /* Start of the input left in the buffer */
+  uint32_t in_len;             /* Bytes of input left in the buffer */
 
   int stdin;                   /* STDIN for the program */
   int stdout;                  /* STDOUT for the program */
-  struct pollfd *poll_fd;      /* Used for polling for output from program */
 
+  int hs_rto;                  /* Current handshake timeout, in ms */
+  uint16_t port;               /* Port */
+  uint8_t hs_state;            /* Handshake state (CONN_*) */
+  uint8_t hs_retries;          /* Number of SYN/SYN-ACK retransmissions */
+
+  bool send_cookie;            /* [Server] Put a Fast Open cookie in SYN-ACK */
+  bool input_ready;            /* Program has output to read, until EAGAIN */
   bool read_eof;               /* EOF read from STDIN */
+  bool in_lf;                  /* \n of a \r\n line ending still to be used */
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
   bool delete_me;              /* Whether or not to delete this object. */
-
-  chunk_t *out_queue;          /* Queue for output to STDOUT */
-  chunk_t **out_queue_tail;    /* End of the output queue */
-
-  struct conn *next;           /* Linked list of connections */
-  struct conn **prev;
 };
 typedef struct conn conn_t;
 
 
 /**
- * Add to the conn_t list.
+ * Add to the conn_t list and the connection table.
  *
- * conn_list: Pointer to linked list of conn_t objects.
  * conn: The new conn_t to add.
  */
 void conn_add(conn_t *conn);
 
+/**
+ * Finds the connection to a host.
+ *
+ * ip_addr: IP address of the host.
+ * port: Port of the host.
+ * returns: The most recent connection to the host, or NULL if there is none.
+ */
+conn_t *conn_lookup(in_addr_t ip_addr, int port);
+
+/**
+ * [Server]
+ * Sends as many waiting frames to the --mux program as it takes. If
+ * connections were told there was no room to output and there is now, lets
+ * them output.
+ */
+void mux_flush();
+
+/**
+ * [Server]
+ * How much data a connection can output to the --mux program. The buffer of
+ * frames is shared by all connections of the event loop.
+ *
+ * returns: The number of bytes that can be output.
+ */
+size_t mux_bufspace();
+
+/**
+ * [Server]
+ * Sends data from a connection to the --mux program.
+ *
+ * conn: The connection.
+ * buf: The data.
+ * len: Bytes of data.
+ * returns: Bytes taken, or -1 if the program has exited.
+ */
+int mux_output(conn_t *conn, const char *buf, size_t len);
+
+/**
+ * [Server]
+ * Tells the --mux program that a connection has no more data for it. Only
+ * done once.
+ *
+ * conn: The connection.
+ */
+void mux_close(conn_t *conn);
+
+/**
+ * [Server]
+ * Hands a new connection to the --mux program.
+ *
+ * conn: The connection.
+ */
+void mux_attach(conn_t *conn);
+
+/**
+ * [Server]
+ * Forgets a connection that is going away, closing it first if needed. Frames
+ * the --mux program sends for it afterwards are dropped.
+ *
+ * conn: The connection.
+ */
+void mux_detach(conn_t *conn);
+
+/**
+ * [Server]
+ * Reads data the --mux program sent for a connection. Works like read().
+ *
+ * conn: The connection.
+ * buf: Buffer to read into.
+ * len: Most bytes to read.
+ * returns: Bytes read, 0 once the program has closed the connection, or -1
+ *          with errno set to EAGAIN if there is nothing yet.
+ */
+int mux_input(conn_t *conn, void *buf, size_t len);
+
 /**
  * Set up a conn_t object with the right values.
  *
@@ -321,13 +495,15 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
 
   /* Socket address. Could be a Unix socket. */
   if (unix_socket) {
-    memset(&conn->sunaddr, 0, sizeof(struct sockaddr_un));
+    memset(&conn->sunaddr, 0, sizeof(struct sockaddr_un_port));
     conn->sunaddr.sun_family = AF_UNIX;
-    sprintf(conn->sunaddr.sun_path, "/%d", port);
+    snprintf(conn->sunaddr.sun_path, sizeof(conn->sunaddr.sun_path), "/%d",
+             port);
   }
   else {
     conn->saddr.sin_family = AF_INET;
     conn->saddr.sin_addr.s_addr = ip_addr;
+    conn->saddr.sin_port = htons(port);
   }
 
   /* Random initial sequence number. */
@@ -337,6 +513,10 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
   conn->seqno = 0;
   conn->next_seqno = conn->init_seqno;
   conn->ackno = 0;
+
+  /* Handshake retransmissions. */
+  conn->hs_retries = 0;
+  conn->hs_rto = SYN_RTO_INIT;
 }
 
 /**
@@ -404,14 +584,11 @@ in_addr_t ip_from_hostname(char *hostname) {
 
 /////////////////////////////////// LOGGING ////////////////////////////////////
 
-#define LOG_SIZE (4 * MAX_SEG_DATA_SIZE)
+#define LOG_SIZE 256
 #define LOG_ENTRY_SIZE 20
 #define ADDR_FORMAT_STR "%s\t%d\t%s\t%d\t"
 #define LOCALHOST_STR "localhost"
 
-/** Headers for the log file. */
-#define LOG_HEADERS "Timestamp\tSource IP\tSource Port\tDestination IP\tDestination Port\tSequence Number\tAcknowledgement Number\tLength\tFlags\tWindow\tChecksum\tData\n"
-
 /** Debug messages for tester. */
 #define DEBUG_TEARDOWN "###teardown###\n"
 
@@ -457,39 +634,21 @@ void format_addresses(in_addr_t ip_addr, int port, conn_t *conn,
 }
 
 /**
- * Creates a hex dump of data.
+ * Prints a segment sent or received for the tester, on stderr. Printed output
+ * is of the form:
+ *    !!!time fromIP fromPort toIP toPort seqno ackno len flags window cksum!!!
  *
- * from: Data to create hex dump.
- * to: Location to write output of dump.
- * len: Length of data.
- */
-void hex_dump(unsigned char *from, char *to, int len) {
-  snprintf(to, 2, "\t");
-  to++;
-
-  /* Loop through all bytes in the data. */
-  int i;
-  for (i = 0; i < len; i++) {
-    snprintf(to + i * 3, 4, "%02x ", from[i]);
-  }
-  snprintf(to + i * 3, 2, "\n");
-}
-
-/**
- * Logs a segment sent or received. Logged output is of the form:
- *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
+ * Segments traced with -l go to a binary trace instead (see ctcp_trace.h).
  *
- * file: File to output to.
  * ip_addr: The logger's IP address.
  * port: The logger's port.
  * conn: The other's connection details.
  * segment: Segment to log.
- * len: Length of the segment, including headers.
  * is_sent_segment: Whether or not this is logging a segment sent by the logger.
  * is_unix_socket: Whether or not the connection is via a Unix socket.
  */
-void log_segment(int file, in_addr_t ip_addr, int port, conn_t *conn,
-                 ctcp_segment_t *segment, uint16_t len, bool is_sent_segment,
+void log_segment(in_addr_t ip_addr, int port, conn_t *conn,
+                 ctcp_segment_t *segment, bool is_sent_segment,
                  bool is_unix_socket) {
   /* Create output buffer and write IP addresses and ports. */
   char buf[LOG_SIZE];
@@ -517,27 +676,7 @@ void log_segment(int file, in_addr_t ip_addr, int port, conn_t *conn,
   /* Window and checksum. */
   snprintf(buf + strlen(buf), LOG_ENTRY_SIZE, "\t%d\t0x%x",
            ntohs(segment->window), segment->cksum);
-
-  /* Data. */
-  if (!test_debug_on) {
-    hex_dump((unsigned char *) segment->data,
-             buf + strlen(buf),
-             ntohs(segment->len) - sizeof(ctcp_segment_t));
-    write(file, buf, strlen(buf));
-  }
-  /* Log data for the tester. */
-  else {
-    fprintf(stderr, "!!!%s!!!\n", buf);
-  }
-}
-
-/**
- * Write out the headers to the log file.
- *
- * file: The log file.
- */
-void write_log_header(int file) {
-  write(file, LOG_HEADERS, strlen(LOG_HEADERS));
+  fprintf(stderr, "!!!%s!!!\n", buf);
 }
 
 
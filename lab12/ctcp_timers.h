@@ -0,0 +1,36 @@
+/******************************************************************************
+ * ctcp_timers.h
+ * -------------
+ * Timer and retransmission defaults of the cTCP library. Shared with the
+ * tools that drive cTCP without the library (ctcp_sim, ctcp_load), so they
+ * always run it with the same timers.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TIMERS_H
+#define CTCP_TIMERS_H
+
+/* Parameters to be changed by the tester. */
+
+/** Retransmission interval in milliseconds. */
+#define RT_INTERVAL 200
+
+/** Timer interval (for calls to ctcp_timer) in milliseconds. */
+#define TIMER_INTERVAL 40
+
+/** Connection timeout interval in seconds. */
+#define CONN_TIMEOUT 10
+
+/** Initial SYN/SYN-ACK retransmission timeout in milliseconds. Doubled after
+    every retransmission, up to SYN_RTO_MAX. */
+#define SYN_RTO_INIT 250
+
+/** Lower and upper bounds on the handshake retransmission timeout, in ms. */
+#define SYN_RTO_MIN 20
+#define SYN_RTO_MAX 3000
+
+/** Number of SYN/SYN-ACK retransmissions before giving up. With the backoff
+    above this adds up to roughly CONN_TIMEOUT seconds. */
+#define SYN_MAX_RETRIES 5
+
+#endif /* CTCP_TIMERS_H */
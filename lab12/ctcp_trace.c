@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "ctcp.h"
+#include "ctcp_trace.h"
+#include "ctcp_utils.h"
+
+/**
+ * The ring. Any thread may add records, and only the writer takes them out.
+ * Each slot has a sequence number saying whose turn it is: a producer may fill
+ * slot i when its sequence is the position it reserved, and the writer may
+ * take it once the sequence is one past that. Producers never wait for each
+ * other or for the writer.
+ */
+struct trace {
+  int file;
+  int snaplen;
+  size_t record_size;
+  char *records;                  /* TRACE_RING_LEN records, back to back */
+  atomic_ulong *seq;              /* Sequence number of each slot */
+  atomic_ulong head;              /* Next position to reserve */
+  unsigned long tail;             /* Next position to write. Writer only */
+  atomic_ulong dropped;           /* Records lost because the ring was full */
+  atomic_bool stop;
+  pthread_t writer;
+};
+
+static struct trace *trace = NULL;
+
+static inline trace_record_t *trace_slot(unsigned long pos) {
+  return (trace_record_t *)
+    (trace->records + (pos & (TRACE_RING_LEN - 1)) * trace->record_size);
+}
+
+
+/////////////////////////////////// PRODUCERS /////////////////////////////////
+
+void trace_segment(in_addr_t src_ip, uint16_t src_port, in_addr_t dst_ip,
+                   uint16_t dst_port, const ctcp_segment_t *segment,
+                   size_t len) {
+  unsigned long pos = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  atomic_ulong *seq;
+
+  /* Reserve a slot, or give up if the writer is a whole ring behind. */
+  for (;;) {
+    seq = &trace->seq[pos & (TRACE_RING_LEN - 1)];
+    long diff = (long) (atomic_load_explicit(seq, memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&trace->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+      return;
+    }
+    else {
+      pos = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    }
+  }
+
+  /* Wall-clock time, so traces from different hosts line up. The event loop's
+     clock (current_time()) starts at an arbitrary point. */
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  trace_record_t *record = trace_slot(pos);
+  record->time = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+  record->src_ip = src_ip;
+  record->dst_ip = dst_ip;
+  record->src_port = src_port;
+  record->dst_port = dst_port;
+  record->seqno = ntohl(segment->seqno);
+  record->ackno = ntohl(segment->ackno);
+  record->len = ntohs(segment->len);
+  record->window = ntohs(segment->window);
+  record->cksum = segment->cksum;
+  record->pad = 0;
+  record->flags = ntohl(segment->flags);
+  record->pad2 = 0;
+
+  /* Only as much data as is really there. */
+  size_t datalen = 0;
+  if (record->len > sizeof(ctcp_segment_t))
+    datalen = record->len - sizeof(ctcp_segment_t);
+  if (datalen > len - sizeof(ctcp_segment_t))
+    datalen = len - sizeof(ctcp_segment_t);
+  if (datalen > (size_t) trace->snaplen)
+    datalen = trace->snaplen;
+  record->datalen = datalen;
+  memcpy(record->data, segment->data, datalen);
+
+  atomic_store_explicit(seq, pos + 1, memory_order_release);
+}
+
+
+//////////////////////////////////// WRITER ///////////////////////////////////
+
+/**
+ * Writes out the records that are ready, as far as the end of the ring, and
+ * hands their slots back.
+ *
+ * returns: The number of records written.
+ */
+static int trace_flush() {
+  unsigned long pos = trace->tail;
+  unsigned long first = pos & (TRACE_RING_LEN - 1);
+  int n = 0;
+
+  /* Records are back to back in the ring, so a run of them is one write. */
+  while (first + n < TRACE_RING_LEN &&
+         atomic_load_explicit(&trace->seq[first + n], memory_order_acquire) ==
+         pos + n + 1)
+    n++;
+  if (n == 0)
+    return 0;
+
+  char *buf = (char *) trace_slot(pos);
+  size_t left = n * trace->record_size;
+  while (left > 0) {
+    ssize_t w = write(trace->file, buf, left);
+    if (w < 0 && errno == EINTR)
+      continue;
+    /* Keep emptying the ring anyway, so producers don't start dropping. */
+    if (w <= 0)
+      break;
+    buf += w;
+    left -= w;
+  }
+
+  int i;
+  for (i = 0; i < n; i++)
+    atomic_store_explicit(&trace->seq[first + i],
+                          pos + i + TRACE_RING_LEN, memory_order_release);
+  trace->tail = pos + n;
+  return n;
+}
+
+static void *trace_writer(void *arg) {
+  while (!atomic_load(&trace->stop)) {
+    if (trace_flush() == 0)
+      usleep(TRACE_IDLE_US);
+  }
+  while (trace_flush() > 0);
+  return NULL;
+}
+
+
+/////////////////////////////////// LIFETIME //////////////////////////////////
+
+int trace_open(const char *path, int snaplen) {
+  struct trace_file_header header;
+  unsigned long i;
+
+  if (snaplen < 0 || snaplen > MAX_SEG_DATA_SIZE)
+    return -1;
+  trace = calloc(sizeof(struct trace), 1);
+  trace->snaplen = snaplen;
+  /* Keep every record 8-byte aligned. */
+  trace->record_size = (sizeof(trace_record_t) + snaplen + 7) & ~7;
+  trace->records = malloc(TRACE_RING_LEN * trace->record_size);
+  trace->seq = malloc(TRACE_RING_LEN * sizeof(atomic_ulong));
+  for (i = 0; i < TRACE_RING_LEN; i++)
+    atomic_init(&trace->seq[i], i);
+
+  trace->file = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (trace->file < 0)
+    goto fail;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.snaplen = snaplen;
+  header.record_size = trace->record_size;
+  if (write(trace->file, &header, sizeof(header)) != sizeof(header) ||
+      pthread_create(&trace->writer, NULL, trace_writer, NULL) != 0) {
+    close(trace->file);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  free(trace->records);
+  free(trace->seq);
+  free(trace);
+  trace = NULL;
+  return -1;
+}
+
+bool trace_enabled() {
+  return trace != NULL;
+}
+
+void trace_close() {
+  if (trace == NULL || atomic_exchange(&trace->stop, true))
+    return;
+  pthread_join(trace->writer, NULL);
+  close(trace->file);
+
+  /* The ring stays around, since other threads may still be adding to it on
+     the way out. Their records are dropped. */
+  unsigned long dropped = atomic_load(&trace->dropped);
+  if (dropped > 0)
+    fprintf(stderr, "[INFO] Trace dropped %lu segments\n", dropped);
+}
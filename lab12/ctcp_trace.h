@@ -0,0 +1,94 @@
+/******************************************************************************
+ * ctcp_trace.h
+ * ------------
+ * Binary trace of the segments a host sends and receives, turned on with -l.
+ * Each segment becomes one fixed-size record, put into a lock-free ring by
+ * whichever thread handles it. A background thread writes the ring out to the
+ * trace file, so tracing never waits on the disk. If the ring fills up,
+ * records are dropped and counted instead.
+ *
+ * Use trace2csv to turn a trace into the tab-separated log format.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TRACE_H
+#define CTCP_TRACE_H
+
+#include "ctcp_sys.h"
+
+/** Identifies a trace file. */
+#define TRACE_MAGIC "CTCPTRC1"
+
+/** Number of records the ring holds. Must be a power of two. */
+#define TRACE_RING_LEN 8192
+
+/** How long the writer sleeps when there is nothing to write, in us. */
+#define TRACE_IDLE_US 2000
+
+/** Headers of the tab-separated log (see trace2csv). */
+#define TRACE_CSV_HEADERS "Timestamp\tSource IP\tSource Port\tDestination IP\tDestination Port\tSequence Number\tAcknowledgement Number\tLength\tFlags\tWindow\tChecksum\tData\n"
+
+/** Start of a trace file. Records follow, each record_size bytes. */
+struct trace_file_header {
+  char magic[8];            /* TRACE_MAGIC, without the terminating 0 */
+  uint32_t snaplen;         /* Most data bytes kept per segment */
+  uint32_t record_size;     /* Size of each record, in bytes */
+};
+
+/** One segment. All fields are in host order, except the IP addresses and the
+    checksum, which are as on the wire. */
+struct trace_record {
+  uint64_t time;            /* When sent or received, in ms since epoch */
+  uint32_t src_ip;          /* 0 with Unix sockets */
+  uint32_t dst_ip;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint32_t seqno;
+  uint32_t ackno;
+  uint16_t len;             /* Length of the segment, headers included */
+  uint16_t window;
+  uint16_t cksum;
+  uint16_t pad;
+  uint32_t flags;
+  uint16_t datalen;         /* Data bytes kept, at most snaplen */
+  uint16_t pad2;
+  uint8_t data[];           /* The first datalen bytes of data */
+};
+typedef struct trace_record trace_record_t;
+
+/**
+ * Starts tracing into a new file.
+ *
+ * path: The trace file. Overwritten if it exists.
+ * snaplen: Most data bytes to keep from each segment, up to
+ *          MAX_SEG_DATA_SIZE. 0 keeps only the headers.
+ * returns: 0 on success, -1 on failure.
+ */
+int trace_open(const char *path, int snaplen);
+
+/**
+ * Whether tracing is on.
+ */
+bool trace_enabled();
+
+/**
+ * Adds a segment to the trace. Safe to call from any thread. Does not block.
+ *
+ * src_ip: Where the segment came from, in network order. 0 for Unix sockets.
+ * src_port: Where the segment came from.
+ * dst_ip: Where the segment went to, in network order. 0 for Unix sockets.
+ * dst_port: Where the segment went to.
+ * segment: The segment, in network order.
+ * len: Bytes actually in the segment buffer, which may be fewer than the
+ *      segment's length field says if it was corrupted.
+ */
+void trace_segment(in_addr_t src_ip, uint16_t src_port, in_addr_t dst_ip,
+                   uint16_t dst_port, const ctcp_segment_t *segment,
+                   size_t len);
+
+/**
+ * Writes out everything still in the ring and stops tracing.
+ */
+void trace_close();
+
+#endif /* CTCP_TRACE_H */
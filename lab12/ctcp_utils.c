@@ -1,26 +1,22 @@
 #include "ctcp_utils.h"
+#include "inet_cksum.h"
 
 uint16_t cksum(const void *_data, uint16_t len) {
-  const uint8_t *data = _data;
-  uint32_t sum = 0;
-
-  for (sum = 0; len >= 2; data += 2, len -=2) {
-    sum += (data[0] << 8) | data[1];
-  }
-  if (len > 0) sum += data[0] << 8;
+  return inet_cksum(_data, len);
+}
 
-  while (sum > 0xffff) {
-    sum = (sum >> 16) + (sum & 0xffff);
-  }
-  sum = htons(~sum);
-  return sum ? sum : 0xffff;
+/* The simulator (ctcp_sim.c) has its own, virtual clock. */
+#ifndef CTCP_SIM
+uint64_t current_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 long current_time() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  return current_time_ns() / 1000000;
 }
+#endif
 
 void print_hdr_ctcp(ctcp_segment_t *segment) {
   fprintf(stderr, "[cTCP] seqno: %d, ackno: %d, len: %d, flags:",
@@ -49,4 +45,35 @@ void print_data_ctcp(ctcp_segment_t *segment) {
 void print_segment_ctcp(ctcp_segment_t *segment) {
   print_hdr_ctcp(segment);
   print_data_ctcp(segment);
-}
\ No newline at end of file
+}
+void *slab_alloc(slab_t *slab) {
+  /* Objects hold a free list pointer while free, and stay aligned. */
+  size_t size = (slab->size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  void *obj;
+
+  if (slab->free_list != NULL) {
+    obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+  }
+  else {
+    if (slab->next == NULL || slab->next + size > slab->end) {
+      size_t page_size = size > SLAB_PAGE_SIZE ? size : SLAB_PAGE_SIZE;
+      slab->next = malloc(page_size);
+      if (slab->next == NULL)
+        return NULL;
+      slab->end = slab->next + page_size;
+    }
+    obj = slab->next;
+    slab->next += size;
+  }
+
+  memset(obj, 0, size);
+  return obj;
+}
+
+void slab_free(slab_t *slab, void *obj) {
+  if (obj == NULL)
+    return;
+  *(void **) obj = slab->free_list;
+  slab->free_list = obj;
+}
@@ -23,10 +23,17 @@
 uint16_t cksum(const void *_data, uint16_t len);
 
 /**
- * Gets the current time in milliseconds.
+ * Gets the current time in milliseconds. Only differences between times mean
+ * anything: the clock starts at an arbitrary point, and is not changed when
+ * the system's date and time are.
  */
 long current_time();
 
+/**
+ * Gets the current time in nanoseconds, on the same clock as current_time().
+ */
+uint64_t current_time_ns();
+
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in
  * network-byte order. All fields are converted and printed out in host order,
@@ -38,4 +45,42 @@ void print_hdr_ctcp(ctcp_segment_t *segment);
 void print_data_ctcp(ctcp_segment_t *segment);
 void print_segment_ctcp(ctcp_segment_t *segment);
 
+/** Size of the pages a slab carves its objects out of. */
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+/**
+ * Allocator for many objects of the same size, such as one per connection.
+ * Objects are carved out of large pages, so they cost no malloc header, and
+ * freed objects are reused before a new page is allocated. Pages are never
+ * given back to the system.
+ *
+ * Declare one with SLAB_INIT, e.g.
+ *   static slab_t conn_slab = SLAB_INIT(conn_t);
+ */
+struct slab {
+  size_t size;      /* Size of each object */
+  void *free_list;  /* Freed objects, linked through their first word */
+  char *next;       /* Next unused object in the current page */
+  char *end;        /* End of the current page */
+};
+typedef struct slab slab_t;
+
+#define SLAB_INIT(type) { sizeof(type), NULL, NULL, NULL }
+
+/**
+ * Allocates a zeroed object from a slab.
+ *
+ * slab: The slab.
+ * returns: The object, or NULL if out of memory.
+ */
+void *slab_alloc(slab_t *slab);
+
+/**
+ * Returns an object to the slab it came from.
+ *
+ * slab: The slab.
+ * obj: The object. Does nothing if NULL.
+ */
+void slab_free(slab_t *slab, void *obj);
+
 #endif /* CTCP_UTILS_H */
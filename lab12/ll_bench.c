@@ -0,0 +1,219 @@
+/******************************************************************************
+ * ll_bench.c
+ * ----------
+ * Microbenchmark for the linked lists in ctcp_linked_list.h. Runs the same
+ * two workloads over a list from ll_create() (a malloc() per node), one from
+ * ll_create_pooled() and an intrusive list:
+ *
+ *   queue    A window of segments in flight, like the list of unacknowledged
+ *            segments: the oldest is removed from the front as a new one is
+ *            added to the back.
+ *   sorted   A window of segments arriving out of order, like the output
+ *            list: each is inserted in order by seqno, then the whole window
+ *            is taken off the front.
+ *
+ * Prints key: value lines with the time per operation of each, in ns.
+ *
+ *****************************************************************************/
+
+#include <getopt.h>
+#include <time.h>
+
+#include "ctcp_linked_list.h"
+
+/** Stand-in for a segment. */
+typedef struct {
+  ll_link_t link;
+  uint32_t seqno;
+} bench_seg_t;
+
+/** Which kind of list a run uses. */
+enum { BENCH_MALLOC, BENCH_POOLED, BENCH_INTRUSIVE, BENCH_KINDS };
+static const char *kind_names[] = { "malloc", "pooled", "intrusive" };
+
+/** Keeps the compiler from throwing away results. */
+static volatile uint32_t sink;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Keeps a window of segments on the list, removing from the front and adding
+ * to the back.
+ *
+ * returns: Number of operations done.
+ */
+static uint64_t bench_queue(int kind, bench_seg_t *segs, int window,
+                            uint64_t ops) {
+  linked_list_t *list = NULL;
+  ilist_t ilist;
+  uint64_t i;
+  uint32_t sum = 0;
+
+  if (kind == BENCH_INTRUSIVE)
+    ilist_init(&ilist);
+  else
+    list = kind == BENCH_POOLED ? ll_create_pooled() : ll_create();
+
+  for (i = 0; i < window; i++) {
+    if (list)
+      ll_add(list, &segs[i]);
+    else
+      ilist_add(&ilist, &segs[i].link);
+  }
+
+  /* The segment taken off the front goes back on as the newest. */
+  for (i = 0; i < ops; i++) {
+    bench_seg_t *seg;
+    if (list) {
+      seg = ll_remove(list, ll_front(list));
+      ll_add(list, seg);
+    }
+    else {
+      seg = ll_entry(ilist_front(&ilist), bench_seg_t, link);
+      ilist_remove(&ilist, &seg->link);
+      ilist_add(&ilist, &seg->link);
+    }
+    sum += seg->seqno;
+  }
+
+  ll_destroy(list);
+  sink = sum;
+  return 2 * ops;
+}
+
+/**
+ * Inserts a window of segments in order of seqno as they arrive out of order,
+ * then takes them off the front, over and over.
+ *
+ * returns: Number of operations done.
+ */
+static uint64_t bench_sorted(int kind, bench_seg_t *segs, int window,
+                             uint64_t ops) {
+  linked_list_t *list = NULL;
+  ilist_t ilist;
+  uint64_t done = 0;
+  uint32_t sum = 0;
+  int i;
+
+  if (kind == BENCH_INTRUSIVE)
+    ilist_init(&ilist);
+  else
+    list = kind == BENCH_POOLED ? ll_create_pooled() : ll_create();
+
+  while (done < ops) {
+    for (i = 0; i < window; i++) {
+      bench_seg_t *seg = &segs[i];
+
+      /* Walk from the front to the last segment before this one. */
+      if (list) {
+        ll_node_t *node = ll_front(list), *after = NULL;
+        while (node && ((bench_seg_t *) node->object)->seqno < seg->seqno) {
+          after = node;
+          node = node->next;
+        }
+        if (after)
+          ll_add_after(list, after, seg);
+        else
+          ll_add_front(list, seg);
+      }
+      else {
+        ll_link_t *link = ilist_front(&ilist), *after = NULL;
+        while (link && ll_entry(link, bench_seg_t, link)->seqno < seg->seqno) {
+          after = link;
+          link = link->next;
+        }
+        if (after)
+          ilist_add_after(&ilist, after, &seg->link);
+        else
+          ilist_add_front(&ilist, &seg->link);
+      }
+    }
+
+    for (i = 0; i < window; i++) {
+      if (list) {
+        sum += ((bench_seg_t *) ll_remove(list, ll_front(list)))->seqno;
+      }
+      else {
+        ll_link_t *link = ilist_front(&ilist);
+        ilist_remove(&ilist, link);
+        sum += ll_entry(link, bench_seg_t, link)->seqno;
+      }
+    }
+    done += 2 * window;
+  }
+
+  ll_destroy(list);
+  sink = sum;
+  return done;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-n operations]\n"
+    "   [-w window_size]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = argv[0];
+  uint64_t ops = 10000000;
+  int window = 32;
+  int opt, i, kind;
+
+  static struct option o[] = {
+    { "ops", required_argument, NULL, 'n' },
+    { "window", required_argument, NULL, 'w' },
+    { NULL, 0, NULL, 0 }
+  };
+  while ((opt = getopt_long(argc, argv, "n:w:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      ops = strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    default:
+      usage(progname);
+    }
+  }
+  if (ops == 0 || window <= 0)
+    usage(progname);
+
+  /* Segments in the order they arrive: shuffled, with the same seed every
+     time. */
+  bench_seg_t *segs = calloc(window, sizeof(bench_seg_t));
+  uint64_t x = 144;
+  for (i = 0; i < window; i++)
+    segs[i].seqno = i;
+  for (i = window - 1; i > 0; i--) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int j = (x >> 33) % (i + 1);
+    uint32_t seqno = segs[i].seqno;
+    segs[i].seqno = segs[j].seqno;
+    segs[j].seqno = seqno;
+  }
+
+  for (kind = 0; kind < BENCH_KINDS; kind++) {
+    uint64_t start = now_ns();
+    uint64_t done = bench_queue(kind, segs, window, ops);
+    printf("queue_%s_ns: %.2f\n", kind_names[kind],
+           (double) (now_ns() - start) / done);
+  }
+  for (kind = 0; kind < BENCH_KINDS; kind++) {
+    uint64_t start = now_ns();
+    uint64_t done = bench_sorted(kind, segs, window, ops);
+    printf("sorted_%s_ns: %.2f\n", kind_names[kind],
+           (double) (now_ns() - start) / done);
+  }
+
+  free(segs);
+  return 0;
+}
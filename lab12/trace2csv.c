@@ -0,0 +1,81 @@
+/******************************************************************************
+ * trace2csv.c
+ * -----------
+ * Turns a binary trace written by cTCP with -l (see ctcp_trace.h) into the
+ * tab-separated log format, one segment per line:
+ *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
+ *
+ * Data is a hex dump of the bytes kept in the trace, which is none unless
+ * cTCP was run with --snaplen.
+ *
+ * Usage: trace2csv [trace_file]
+ * Reads from stdin if no file is given, and writes to stdout.
+ *
+ *****************************************************************************/
+
+#include "ctcp.h"
+#include "ctcp_trace.h"
+
+#define LOCALHOST_STR "localhost"
+
+/**
+ * Prints one record.
+ */
+static void print_record(trace_record_t *record, FILE *out) {
+  static const char hex[] = "0123456789abcdef";
+  char src[INET_ADDRSTRLEN] = LOCALHOST_STR;
+  char dst[INET_ADDRSTRLEN] = LOCALHOST_STR;
+  int i;
+
+  /* Unix sockets have no addresses. */
+  if (record->src_ip != 0 || record->dst_ip != 0) {
+    inet_ntop(AF_INET, &record->src_ip, src, sizeof(src));
+    inet_ntop(AF_INET, &record->dst_ip, dst, sizeof(dst));
+  }
+
+  fprintf(out, "%lu\t%s\t%d\t%s\t%d\t%d\t%d\t%d\t%s%s%s\t%d\t0x%x\t",
+          (unsigned long) record->time, src, record->src_port, dst,
+          record->dst_port, record->seqno, record->ackno, record->len,
+          record->flags & SYN ? "SYN " : "", record->flags & ACK ? "ACK " : "",
+          record->flags & FIN ? "FIN " : "", record->window, record->cksum);
+
+  for (i = 0; i < record->datalen; i++) {
+    putc(hex[record->data[i] >> 4], out);
+    putc(hex[record->data[i] & 0xf], out);
+    putc(' ', out);
+  }
+  putc('\n', out);
+}
+
+int main(int argc, char *argv[]) {
+  struct trace_file_header header;
+  FILE *in = stdin;
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [trace_file]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 2 && (in = fopen(argv[1], "rb")) == NULL) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", argv[1]);
+    return 1;
+  }
+
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+      header.record_size < sizeof(trace_record_t) + header.snaplen) {
+    fprintf(stderr, "[ERROR] Not a cTCP trace\n");
+    return 1;
+  }
+
+  trace_record_t *record = malloc(header.record_size);
+  fputs(TRACE_CSV_HEADERS, stdout);
+  /* A record cut short by the end of the file is left out. */
+  while (fread(record, header.record_size, 1, in) == 1) {
+    if (record->datalen > header.snaplen)
+      record->datalen = header.snaplen;
+    print_record(record, stdout);
+  }
+
+  free(record);
+  return 0;
+}
@@ -220,14 +220,6 @@ struct sr_tcp_hdr /* 20 bytes */
 } __attribute__ ((packed)) ;
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
-struct tcp_pseudo_hdr {
-   uint32_t ip_src; 
-   uint32_t ip_dst;; 
-   uint8_t zero;
-   uint8_t ptcl;
-   uint16_t len;
-} __attribute__ ((packed));
-
 #define sr_IFACE_NAMELEN 32
 
 #endif /* -- SR_PROTOCOL_H -- */
@@ -22,6 +22,7 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "inet_cksum.h"
 
 #include <arpa/inet.h>
 /*---------------------------------------------------------------------
@@ -456,19 +457,13 @@ struct sr_nat_mapping *find_internal_mapping(struct sr_instance* sr, uint8_t* bu
 }
 
 uint16_t tcp_cksum(sr_tcp_hdr_t *tcp_hdr, sr_ip_hdr_t *ip_hdr) {
+  /* The pseudo-header is summed in place, rather than copied in front of the
+     segment in a new buffer for every packet. */
+  uint16_t tcp_len = ntohs(ip_hdr->ip_len) - sizeof(sr_ip_hdr_t);
+  uint64_t sum = inet_sum_pseudo(ip_hdr->ip_src, ip_hdr->ip_dst,
+                                 ip_protocol_tcp, tcp_len, 0);
   tcp_hdr->tcp_cksum = 0x0000;
-  struct tcp_pseudo_hdr pseudo_hdr;
-  pseudo_hdr.ip_src = ip_hdr->ip_src;
-  pseudo_hdr.ip_dst = ip_hdr->ip_dst;
-  pseudo_hdr.zero = 0x00;
-  pseudo_hdr.ptcl = 0x06;
-  pseudo_hdr.len = htons(ntohs(ip_hdr->ip_len) - sizeof(sr_ip_hdr_t));
-  void* concat_hdrs = malloc(ntohs(pseudo_hdr.len) + sizeof(struct tcp_pseudo_hdr));
-  memcpy(concat_hdrs, &pseudo_hdr, sizeof(struct tcp_pseudo_hdr));
-  memcpy((uint8_t*)concat_hdrs + sizeof(struct tcp_pseudo_hdr), tcp_hdr, ntohs(pseudo_hdr.len));
-  uint16_t checksum = cksum(concat_hdrs, ntohs(pseudo_hdr.len) + sizeof(struct tcp_pseudo_hdr));
-  free(concat_hdrs);
-  return checksum;
+  return inet_fold(inet_sum(tcp_hdr, tcp_len, sum));
 }
 
 void handle_nat_ip_packet(struct sr_instance *sr, uint8_t* buf, unsigned int len, char* interface) {